@@ -20,6 +20,7 @@
  */
 #include "ConnectedMtpDevices.h"
 #include "MtpLibLock.h"
+#include "MtpLibmtpDevice.h"
 
 bool ConnectedMtpDevices::m_instantiated = false;
 
@@ -53,7 +54,7 @@ std::unique_ptr<MtpDevice> ConnectedMtpDevices::GetDevice(int index)
 {
 MtpLibLock	lock;
 
-	return std::unique_ptr<MtpDevice>(new MtpDevice(m_devs[index]));
+	return std::unique_ptr<MtpDevice>(new MtpLibmtpDevice(m_devs[index]));
 }
 
 std::unique_ptr<MtpDevice> ConnectedMtpDevices::GetDevice(uint32_t busLocation, uint8_t devnum)
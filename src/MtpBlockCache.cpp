@@ -0,0 +1,256 @@
+/*
+ * MtpBlockCache.cpp
+ *
+ * This software is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 3 as published by the Free Software Foundation.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02111-1301, USA.
+ * licensing@fsf.org
+ */
+#include "MtpBlockCache.h"
+#include "MtpStats.h"
+
+#include <algorithm>
+#include <string.h>
+
+const size_t MtpBlockCache::BLOCK_SIZE;
+const size_t MtpBlockCache::MAX_READ_AHEAD;
+
+MtpBlockCache::MtpBlockCache(size_t budgetBytes) : m_mutex(MtpStats::LockBlockCache), m_budget(budgetBytes), m_used(0)
+{
+}
+
+uint64_t MtpBlockCache::blockKey(uint32_t id, uint64_t index)
+{
+	return (((uint64_t) id) << 32) | index;
+}
+
+size_t MtpBlockCache::read(MtpDevice& device, const MtpFileInfo& info, char* buf, size_t size, off_t offset)
+{
+	if ((uint64_t) offset >= info.filesize)
+		return 0;
+	if (size > info.filesize - offset)
+		size = info.filesize - offset;
+	if (size == 0)
+		return 0;
+
+	size_t readAhead;
+	{
+		LockMutex lock(m_mutex);
+		readAhead = updateReadAhead(info, offset, size);
+	}
+
+	uint64_t start = offset;
+	uint64_t end = start + size;
+	uint64_t lastIndex = (end - 1) / BLOCK_SIZE;
+	uint64_t lastObjectIndex = (info.filesize - 1) / BLOCK_SIZE;
+
+	uint64_t index = start / BLOCK_SIZE;
+	while(index <= lastIndex)
+	{
+		uint64_t blockStart = index * BLOCK_SIZE;
+		uint64_t validEnd = 0;
+		uint64_t runEnd = index + 1;
+		bool hit = false;
+		{
+			LockMutex lock(m_mutex);
+
+			const Block* block = findBlock(blockKey(info.id, index));
+			if (block)
+			{
+				hit = true;
+				validEnd = blockStart + block->data.size();
+				uint64_t copyStart = std::max(start, blockStart);
+				uint64_t copyEnd = std::min(end, validEnd);
+				if (copyEnd > copyStart)
+					memcpy(buf + (copyStart - start), &block->data[copyStart - blockStart], copyEnd - copyStart);
+			}
+			else
+			{
+				// Fetch the whole run of missing blocks in one transaction. If the run
+				// reaches the end of the request we also fetch the read ahead window.
+				while((runEnd <= lastIndex) && !findBlock(blockKey(info.id, runEnd)))
+					runEnd++;
+				if (runEnd > lastIndex)
+				{
+					uint64_t aheadEnd = std::min(lastObjectIndex + 1, runEnd + (readAhead + BLOCK_SIZE - 1) / BLOCK_SIZE);
+					while((runEnd < aheadEnd) && !findBlock(blockKey(info.id, runEnd)))
+						runEnd++;
+				}
+			}
+		}
+		if (hit)
+			MtpStats::Add(MtpStats::ReadCacheHits);
+		else
+		{
+			MtpStats::Add(MtpStats::ReadCacheMisses, runEnd - index);
+			validEnd = fetchBlocks(device, info, index, runEnd - index, buf, start, end);
+		}
+		index = runEnd;
+		if (validEnd < std::min(end, index * BLOCK_SIZE))
+		{
+			// The device gave us less than it said the object holds.
+			return validEnd > start ? validEnd - start : 0;
+		}
+	}
+	return size;
+}
+
+uint64_t MtpBlockCache::fetchBlocks(MtpDevice& device, const MtpFileInfo& info, uint64_t firstIndex, uint64_t count,
+		char* buf, uint64_t start, uint64_t end)
+{
+	uint64_t fetchStart = firstIndex * BLOCK_SIZE;
+	uint64_t fetchEnd = std::min((firstIndex + count) * BLOCK_SIZE, info.filesize);
+	MtpTimelineSpan span("cache", "read cache fill", "bytes");
+	span.setArg(fetchEnd - fetchStart);
+	std::vector<char> data(fetchEnd - fetchStart);
+	size_t got = 0;
+	try
+	{
+		while(got < data.size())
+		{
+			size_t n = device.GetPartialObject(info.id, fetchStart + got, data.size() - got, &data[got]);
+			if (n == 0)
+				break;
+			got += n;
+		}
+	}
+	catch(...)
+	{
+		LockMutex lock(m_mutex);
+		object_state_type::iterator object = m_objects.find(info.id);
+		if ((object != m_objects.end()) && object->second.blocks.empty())
+			m_objects.erase(object);
+		throw;
+	}
+
+	uint64_t copyStart = std::max(start, fetchStart);
+	uint64_t copyEnd = std::min(end, fetchStart + got);
+	if (copyEnd > copyStart)
+		memcpy(buf + (copyStart - start), &data[copyStart - fetchStart], copyEnd - copyStart);
+
+	LockMutex lock(m_mutex);
+	// Cleared while we were fetching, so what we have may be stale
+	object_state_type::iterator object = m_objects.find(info.id);
+	if (object == m_objects.end())
+		return fetchStart + got;
+	for(uint64_t i = 0; i < count; i++)
+	{
+		uint64_t blockOffset = i * BLOCK_SIZE;
+		if (blockOffset >= got)
+			break;
+		size_t length = std::min<uint64_t>(BLOCK_SIZE, got - blockOffset);
+		// Only the last block of an object is allowed to be short
+		if ((length < BLOCK_SIZE) && (fetchStart + blockOffset + length < info.filesize))
+			break;
+		insertBlock(blockKey(info.id, firstIndex + i), &data[blockOffset], length);
+	}
+	// Evicting to make room may have taken the object's state with it
+	object = m_objects.find(info.id);
+	if ((object != m_objects.end()) && object->second.blocks.empty())
+		m_objects.erase(object);
+	return fetchStart + got;
+}
+
+const MtpBlockCache::Block* MtpBlockCache::findBlock(uint64_t key)
+{
+	block_lookup_type::iterator i = m_blockLookup.find(key);
+	if (i == m_blockLookup.end())
+		return 0;
+	m_blocks.splice(m_blocks.end(), m_blocks, i->second);
+	return &(*i->second);
+}
+
+void MtpBlockCache::insertBlock(uint64_t key, const char* data, size_t size)
+{
+	if (size > m_budget)
+		return;
+	if (m_blockLookup.find(key) != m_blockLookup.end())
+		return;
+	while(m_used + size > m_budget)
+		evictBlock();
+	object_state_type::iterator object = m_objects.find(key >> 32);
+	if (object == m_objects.end())
+		return;
+	object->second.blocks.insert(key & 0xffffffff);
+	Block newBlock;
+	newBlock.key = key;
+	block_list_type::iterator i = m_blocks.insert(m_blocks.end(), newBlock);
+	i->data.assign(data, data + size);
+	m_blockLookup[key] = i;
+	m_used += size;
+}
+
+void MtpBlockCache::evictBlock()
+{
+	const Block& oldest = m_blocks.front();
+	object_state_type::iterator object = m_objects.find(oldest.key >> 32);
+	if (object != m_objects.end())
+	{
+		object->second.blocks.erase(oldest.key & 0xffffffff);
+		if (object->second.blocks.empty())
+			m_objects.erase(object);
+	}
+	m_used -= oldest.data.size();
+	m_blockLookup.erase(oldest.key);
+	m_blocks.pop_front();
+}
+
+size_t MtpBlockCache::updateReadAhead(const MtpFileInfo& info, uint64_t offset, size_t size)
+{
+	object_state_type::iterator i = m_objects.find(info.id);
+	if ((i != m_objects.end()) && ((i->second.size != info.filesize) ||
+			(i->second.modificationdate != info.modificationdate)))
+	{
+		// The object changed on the device, so whatever we have is stale.
+		clearObject(info.id);
+		i = m_objects.end();
+	}
+	if (i == m_objects.end())
+	{
+		ObjectState state;
+		state.size = info.filesize;
+		state.modificationdate = info.modificationdate;
+		state.nextOffset = 0;
+		state.readAhead = 0;
+		i = m_objects.insert(std::make_pair(info.id, state)).first;
+	}
+
+	ObjectState& state = i->second;
+	size_t maxReadAhead = std::min(MAX_READ_AHEAD, m_budget / 4);
+	if (offset == state.nextOffset)
+		state.readAhead = std::min(maxReadAhead, state.readAhead ? state.readAhead * 2 : BLOCK_SIZE);
+	else
+		state.readAhead = 0;
+	state.nextOffset = offset + size;
+	return state.readAhead;
+}
+
+void MtpBlockCache::clearObject(uint32_t id)
+{
+	LockMutex lock(m_mutex);
+
+	object_state_type::iterator object = m_objects.find(id);
+	if (object == m_objects.end())
+		return;
+	for(std::unordered_set<uint64_t>::iterator index = object->second.blocks.begin();
+			index != object->second.blocks.end(); index++)
+	{
+		block_lookup_type::iterator i = m_blockLookup.find(blockKey(id, *index));
+		if (i == m_blockLookup.end())
+			continue;
+		m_used -= i->second->data.size();
+		m_blocks.erase(i->second);
+		m_blockLookup.erase(i);
+	}
+	m_objects.erase(object);
+}
@@ -0,0 +1,93 @@
+/*
+ * MtpBlockCache.h
+ *
+ * This software is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 3 as published by the Free Software Foundation.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02111-1301, USA.
+ * licensing@fsf.org
+ */
+
+#ifndef MTPBLOCKCACHE_H_
+#define MTPBLOCKCACHE_H_
+
+#include "MtpDevice.h"
+#include "Mutex.h"
+
+#include <list>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include <sys/types.h>
+
+/*
+ * Caches fixed size blocks of object data read from the device with
+ * GetPartialObject. Blocks from all objects share one LRU list and
+ * byte budget. When reads of an object are sequential the cache
+ * fetches ahead of the reader, doubling the read ahead window on each
+ * sequential miss, so that each device transaction moves a large chunk
+ * instead of one FUSE sized read. The cache lock is never held while
+ * talking to the device. An object's read state is dropped along with
+ * its last cached block.
+ */
+class MtpBlockCache
+{
+public:
+	static const size_t BLOCK_SIZE = 256 * 1024;
+	static const size_t MAX_READ_AHEAD = 8 * 1024 * 1024;
+
+	MtpBlockCache(size_t budgetBytes);
+
+	size_t read(MtpDevice& device, const MtpFileInfo& info, char* buf, size_t size, off_t offset);
+	void clearObject(uint32_t id);
+
+private:
+	MtpBlockCache(const MtpBlockCache&);
+	MtpBlockCache& operator=(const MtpBlockCache&);
+
+	struct Block
+	{
+		uint64_t			key;
+		std::vector<char>	data;
+	};
+
+	struct ObjectState
+	{
+		uint64_t	size;
+		time_t		modificationdate;
+		uint64_t	nextOffset;
+		size_t		readAhead;
+		std::unordered_set<uint64_t>	blocks;	// indexes of the cached ones
+	};
+
+	static uint64_t blockKey(uint32_t id, uint64_t index);
+	const Block* findBlock(uint64_t key);
+	uint64_t fetchBlocks(MtpDevice& device, const MtpFileInfo& info, uint64_t firstIndex, uint64_t count,
+			char* buf, uint64_t start, uint64_t end);
+	void insertBlock(uint64_t key, const char* data, size_t size);
+	void evictBlock();
+	size_t updateReadAhead(const MtpFileInfo& info, uint64_t offset, size_t size);
+
+	typedef std::list<Block> block_list_type;
+	typedef std::unordered_map<uint64_t, block_list_type::iterator> block_lookup_type;
+	typedef std::unordered_map<uint32_t, ObjectState> object_state_type;
+
+	RecursiveMutex		m_mutex;
+	size_t				m_budget;
+	size_t				m_used;
+	block_list_type		m_blocks;
+	block_lookup_type	m_blockLookup;
+	object_state_type	m_objects;
+};
+
+
+#endif /* MTPBLOCKCACHE_H_ */
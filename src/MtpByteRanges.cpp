@@ -0,0 +1,103 @@
+/*
+ * MtpByteRanges.cpp
+ *
+ * This software is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 3 as published by the Free Software Foundation.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02111-1301, USA.
+ * licensing@fsf.org
+ */
+#include "MtpByteRanges.h"
+#include <algorithm>
+
+void MtpByteRanges::add(uint64_t start, uint64_t end)
+{
+	if (start >= end)
+		return;
+	range_map_type::iterator i = m_ranges.upper_bound(start);
+	if (i != m_ranges.begin())
+	{
+		range_map_type::iterator previous = i;
+		previous--;
+		if (previous->second >= start)
+			i = previous;
+	}
+	while((i != m_ranges.end()) && (i->first <= end))
+	{
+		start = std::min(start, i->first);
+		end = std::max(end, i->second);
+		m_ranges.erase(i++);
+	}
+	m_ranges[start] = end;
+}
+
+void MtpByteRanges::remove(uint64_t start, uint64_t end)
+{
+	if (start >= end)
+		return;
+	range_map_type::iterator i = m_ranges.upper_bound(start);
+	if (i != m_ranges.begin())
+		i--;
+	while((i != m_ranges.end()) && (i->first < end))
+	{
+		uint64_t rangeStart = i->first;
+		uint64_t rangeEnd = i->second;
+		if (rangeEnd <= start)
+		{
+			i++;
+			continue;
+		}
+		m_ranges.erase(i++);
+		if (rangeStart < start)
+			m_ranges[rangeStart] = start;
+		if (rangeEnd > end)
+			m_ranges[end] = rangeEnd;
+	}
+}
+
+MtpByteRanges MtpByteRanges::within(uint64_t start, uint64_t end) const
+{
+	MtpByteRanges result;
+	if (start >= end)
+		return result;
+	range_map_type::const_iterator i = m_ranges.upper_bound(start);
+	if (i != m_ranges.begin())
+		i--;
+	for(; (i != m_ranges.end()) && (i->first < end); i++)
+	{
+		uint64_t rangeStart = std::max(start, i->first);
+		uint64_t rangeEnd = std::min(end, i->second);
+		if (rangeStart < rangeEnd)
+			result.m_ranges[rangeStart] = rangeEnd;
+	}
+	return result;
+}
+
+void MtpByteRanges::clip(uint64_t size)
+{
+	m_ranges.erase(m_ranges.lower_bound(size), m_ranges.end());
+	if (!m_ranges.empty() && (m_ranges.rbegin()->second > size))
+		m_ranges.rbegin()->second = size;
+}
+
+void MtpByteRanges::clear()
+{
+	m_ranges.clear();
+}
+
+uint64_t MtpByteRanges::bytes() const
+{
+	uint64_t total = 0;
+	for(range_map_type::const_iterator i = m_ranges.begin(); i != m_ranges.end(); i++)
+		total += i->second - i->first;
+	return total;
+}
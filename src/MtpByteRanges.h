@@ -0,0 +1,53 @@
+/*
+ * MtpByteRanges.h
+ *
+ * This software is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 3 as published by the Free Software Foundation.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02111-1301, USA.
+ * licensing@fsf.org
+ */
+
+#ifndef MTPBYTERANGES_H_
+#define MTPBYTERANGES_H_
+
+#include <stdint.h>
+#include <map>
+
+/*
+ * A set of byte ranges of a file, kept sorted with overlapping and
+ * touching ranges merged. Used to remember which parts of a local copy
+ * have been written to, or are still to be fetched.
+ */
+class MtpByteRanges
+{
+public:
+	typedef std::map<uint64_t, uint64_t> range_map_type;	// start -> end (exclusive)
+
+	void add(uint64_t start, uint64_t end);
+	void remove(uint64_t start, uint64_t end);
+	// Forgets everything at or past size
+	void clip(uint64_t size);
+	void clear();
+	// The parts that lie between start and end
+	MtpByteRanges within(uint64_t start, uint64_t end) const;
+
+	bool empty() const { return m_ranges.empty(); }
+	uint64_t bytes() const;
+	const range_map_type& ranges() const { return m_ranges; }
+
+private:
+	range_map_type	m_ranges;
+};
+
+
+#endif /* MTPBYTERANGES_H_ */
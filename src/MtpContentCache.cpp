@@ -0,0 +1,269 @@
+/*
+ * MtpContentCache.cpp
+ *
+ * This software is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 3 as published by the Free Software Foundation.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02111-1301, USA.
+ * licensing@fsf.org
+ */
+#include "MtpContentCache.h"
+#include "mtpFilesystemErrors.h"
+#include "MtpStats.h"
+
+#include <algorithm>
+#include <vector>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace
+{
+	// Copies size bytes from the start of source to the start of destination
+	bool copyContents(int source, int destination, uint64_t size)
+	{
+		std::vector<char> buffer(1024 * 1024);
+		uint64_t offset = 0;
+		while(offset < size)
+		{
+			ssize_t got = pread(source, &buffer[0], std::min<uint64_t>(buffer.size(), size - offset), offset);
+			if (got < 0)
+			{
+				if (errno == EINTR)
+					continue;
+				return false;
+			}
+			if (got == 0)
+				return false;
+			for(ssize_t put = 0; put < got; )
+			{
+				ssize_t wrote = pwrite(destination, &buffer[put], got - put, offset + put);
+				if (wrote < 0)
+				{
+					if (errno == EINTR)
+						continue;
+					return false;
+				}
+				put += wrote;
+			}
+			offset += got;
+		}
+		return true;
+	}
+
+	struct FoundEntry
+	{
+		time_t		lastUsed;
+		uint32_t	id;
+		uint64_t	size;
+		time_t		modificationDate;
+
+		bool operator<(const FoundEntry& other) const { return lastUsed < other.lastUsed; }
+	};
+}
+
+MtpContentCache::MtpContentCache(const std::string& directory, const std::string& deviceSerial, uint64_t maxBytes) :
+		m_mutex(MtpStats::LockContentCache), m_maxBytes(maxBytes), m_bytes(0)
+{
+	// The serial number ends up in a filename, so only keep the harmless characters
+	std::string serial;
+	for(std::string::const_iterator i = deviceSerial.begin(); i != deviceSerial.end(); i++)
+	{
+		if (isalnum(*i) || (*i == '-') || (*i == '_'))
+			serial.push_back(*i);
+	}
+	m_directory = directory + "/" + serial + "-content";
+
+	// Create the directory, and any missing parents
+	for(size_t p = m_directory.find('/', 1); ; p = m_directory.find('/', p + 1))
+	{
+		std::string dir = m_directory.substr(0, p);
+		if ((mkdir(dir.c_str(), 0700) != 0) && (errno != EEXIST))
+			throw WriteError(errno);
+		if (p == std::string::npos)
+			break;
+	}
+	load();
+}
+
+void MtpContentCache::load()
+{
+	DIR* dir = opendir(m_directory.c_str());
+	if (dir == 0)
+		throw ReadError(errno);
+	std::vector<FoundEntry> found;
+	while(struct dirent* d = readdir(dir))
+	{
+		std::string path = m_directory + "/" + d->d_name;
+		// Left behind by a store that didn't finish
+		if (strncmp(d->d_name, ".tmp", 4) == 0)
+		{
+			unlink(path.c_str());
+			continue;
+		}
+		FoundEntry entry;
+		unsigned long long size;
+		long long modificationDate;
+		int length = 0;
+		if ((sscanf(d->d_name, "%8" SCNx32 "-%llu-%lld%n", &entry.id, &size, &modificationDate, &length) != 3) ||
+				(d->d_name[length] != '\0'))
+			continue;
+		struct stat info;
+		if ((stat(path.c_str(), &info) != 0) || !S_ISREG(info.st_mode) || ((uint64_t) info.st_size != size))
+		{
+			unlink(path.c_str());
+			continue;
+		}
+		entry.lastUsed = info.st_mtime;
+		entry.size = size;
+		entry.modificationDate = modificationDate;
+		found.push_back(entry);
+	}
+	closedir(dir);
+
+	std::stable_sort(found.begin(), found.end());
+	for(std::vector<FoundEntry>::iterator i = found.begin(); i != found.end(); i++)
+	{
+		lookup_type::iterator previous = m_lookup.find(i->id);
+		if (previous != m_lookup.end())
+			remove(previous);
+		Entry entry = { i->id, i->size, i->modificationDate };
+		m_lookup[entry.id] = m_lru.insert(m_lru.end(), entry);
+		m_bytes += entry.size;
+	}
+	trim();
+}
+
+std::string MtpContentCache::fileName(const Entry& entry)
+{
+	char name[64];
+	snprintf(name, sizeof(name), "%08" PRIx32 "-%llu-%lld", entry.id, (unsigned long long) entry.size,
+			(long long) entry.modificationDate);
+	return m_directory + "/" + name;
+}
+
+bool MtpContentCache::matches(const Entry& entry, const MtpFileInfo& info)
+{
+	return (entry.size == info.filesize) && (entry.modificationDate == info.modificationdate);
+}
+
+bool MtpContentCache::contains(const MtpFileInfo& info)
+{
+	LockMutex lock(m_mutex);
+
+	lookup_type::iterator i = m_lookup.find(info.id);
+	return (i != m_lookup.end()) && matches(*i->second, info);
+}
+
+bool MtpContentCache::fetch(const MtpFileInfo& info, int fd)
+{
+	int source;
+	{
+		LockMutex lock(m_mutex);
+
+		lookup_type::iterator i = m_lookup.find(info.id);
+		if ((i == m_lookup.end()) || !matches(*i->second, info))
+		{
+			MtpStats::Add(MtpStats::ContentCacheMisses);
+			return false;
+		}
+		// Once it is open the file can be removed from the cache without
+		// getting in the way.
+		source = open(fileName(*i->second).c_str(), O_RDONLY);
+		if (source < 0)
+		{
+			remove(i);
+			MtpStats::Add(MtpStats::ContentCacheMisses);
+			return false;
+		}
+		m_lru.splice(m_lru.end(), m_lru, i->second);
+	}
+
+	// The modification time is what orders the files the next time they are loaded
+	futimens(source, 0);
+	bool copied = copyContents(source, fd, info.filesize);
+	close(source);
+	if (!copied)
+	{
+		if (ftruncate(fd, 0) != 0)
+			throw WriteError(errno);
+		invalidate(info.id);
+		MtpStats::Add(MtpStats::ContentCacheMisses);
+		return false;
+	}
+	MtpStats::Add(MtpStats::ContentCacheHits);
+	return true;
+}
+
+void MtpContentCache::store(const MtpFileInfo& info, int fd)
+{
+	struct stat sourceInfo;
+	if ((fstat(fd, &sourceInfo) != 0) || ((uint64_t) sourceInfo.st_size != info.filesize) ||
+			(info.filesize == 0) || (info.filesize > m_maxBytes))
+		return;
+
+	std::string tempName = m_directory + "/.tmpXXXXXX";
+	int temp = mkstemp(&tempName[0]);
+	if (temp < 0)
+		return;
+	bool copied = copyContents(fd, temp, info.filesize);
+	if (close(temp) != 0)
+		copied = false;
+	if (!copied)
+	{
+		unlink(tempName.c_str());
+		return;
+	}
+
+	LockMutex lock(m_mutex);
+	lookup_type::iterator i = m_lookup.find(info.id);
+	if (i != m_lookup.end())
+		remove(i);
+	Entry entry = { info.id, info.filesize, info.modificationdate };
+	if (rename(tempName.c_str(), fileName(entry).c_str()) != 0)
+	{
+		unlink(tempName.c_str());
+		return;
+	}
+	m_lookup[entry.id] = m_lru.insert(m_lru.end(), entry);
+	m_bytes += entry.size;
+	trim();
+}
+
+void MtpContentCache::invalidate(uint32_t id)
+{
+	LockMutex lock(m_mutex);
+
+	lookup_type::iterator i = m_lookup.find(id);
+	if (i != m_lookup.end())
+		remove(i);
+}
+
+void MtpContentCache::remove(lookup_type::iterator i)
+{
+	unlink(fileName(*i->second).c_str());
+	m_bytes -= i->second->size;
+	m_lru.erase(i->second);
+	m_lookup.erase(i);
+}
+
+void MtpContentCache::trim()
+{
+	while((m_bytes > m_maxBytes) && !m_lru.empty())
+		remove(m_lookup.find(m_lru.front().id));
+}
@@ -0,0 +1,82 @@
+/*
+ * MtpContentCache.h
+ *
+ * This software is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 3 as published by the Free Software Foundation.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02111-1301, USA.
+ * licensing@fsf.org
+ */
+
+#ifndef MTPCONTENTCACHE_H_
+#define MTPCONTENTCACHE_H_
+
+#include "MtpDevice.h"
+#include "Mutex.h"
+
+#include <list>
+#include <string>
+#include <unordered_map>
+
+/*
+ * Whole file contents kept on disk between opens, and between mounts, so
+ * that opening an unchanged file again doesn't fetch it from the device
+ * again. Files are kept in a folder per device serial number, under a name
+ * made from the object id, size and modification date, and are only used
+ * if all three still match. Only the latest contents of each object are
+ * kept. When the folder goes over its byte budget the least recently used
+ * files are removed.
+ */
+class MtpContentCache
+{
+public:
+	MtpContentCache(const std::string& directory, const std::string& deviceSerial, uint64_t maxBytes);
+
+	bool contains(const MtpFileInfo& info);
+	// Whether the file is one that store would keep
+	bool fits(const MtpFileInfo& info) { return (info.filesize != 0) && (info.filesize <= m_maxBytes); }
+	// Copies the cached contents of the file to fd, if there are any
+	bool fetch(const MtpFileInfo& info, int fd);
+	// Keeps a copy of fd as the contents of the file. Failing to is not an error.
+	void store(const MtpFileInfo& info, int fd);
+	void invalidate(uint32_t id);
+
+private:
+	MtpContentCache(const MtpContentCache&);
+	MtpContentCache& operator=(const MtpContentCache&);
+
+	struct Entry
+	{
+		uint32_t	id;
+		uint64_t	size;
+		time_t		modificationDate;
+	};
+
+	typedef std::list<Entry> lru_type;	// least recently used first
+	typedef std::unordered_map<uint32_t, lru_type::iterator> lookup_type;
+
+	void load();
+	bool matches(const Entry& entry, const MtpFileInfo& info);
+	std::string fileName(const Entry& entry);
+	void remove(lookup_type::iterator i);
+	void trim();
+
+	RecursiveMutex		m_mutex;
+	std::string			m_directory;
+	uint64_t			m_maxBytes;
+	uint64_t			m_bytes;
+	lru_type			m_lru;
+	lookup_type			m_lookup;
+};
+
+
+#endif /* MTPCONTENTCACHE_H_ */
@@ -0,0 +1,149 @@
+/*
+ * MtpControlFile.cpp
+ *
+ * This software is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 3 as published by the Free Software Foundation.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02111-1301, USA.
+ * licensing@fsf.org
+ */
+#include "MtpControlFile.h"
+#include "MtpRoot.h"
+#include "MtpStats.h"
+#include "MtpTimeline.h"
+#include "mtpFilesystemErrors.h"
+#include <algorithm>
+#include <limits>
+#include <sstream>
+#include <string.h>
+
+namespace
+{
+
+const char* names[MtpControlFile::ContentsCount] = { "stats", "timeline" };
+
+std::string generate(MtpControlFile::Contents contents)
+{
+	std::ostringstream out;
+	if (contents == MtpControlFile::Stats)
+		MtpStats::WritePrometheus(out);
+	else
+		MtpTimeline::WriteJson(out);
+	return out.str();
+}
+
+}
+
+MtpControlFile::MtpControlFile(MtpDevice& device, MtpMetadataCache& cache, Contents contents) :
+	MtpNode(device, cache, std::numeric_limits<uint32_t>::max() - 2 - contents), m_contents(contents)
+{
+}
+
+const char* MtpControlFile::Name(Contents contents)
+{
+	return names[contents];
+}
+
+std::vector<MtpControlFile::Contents> MtpControlFile::Available()
+{
+	std::vector<Contents> result;
+	result.push_back(Stats);
+	if (MtpTimeline::Enabled())
+		result.push_back(Timeline);
+	return result;
+}
+
+std::unique_ptr<MtpNode> MtpControlFile::Clone()
+{
+	return std::unique_ptr<MtpNode>(new MtpControlFile(m_device, m_cache, m_contents));
+}
+
+std::unique_ptr<MtpNode> MtpControlFile::getNode(const FilesystemPath& path)
+{
+	throw FileNotFound(path.str());
+}
+
+void MtpControlFile::getattr(struct stat& info)
+{
+	info.st_ino = MTP_STATS_FILE_INODE + m_contents;
+	info.st_mode = S_IFREG | 0444;
+	info.st_nlink = 1;
+	// The kernel won't read past the size we give, but the contents change
+	// between reads. So give a size that's big enough; a short read marks
+	// the real end.
+	if (m_contents == Stats)
+	{
+		const size_t slack = 64 * 1024;
+		info.st_size = (generate(m_contents).size() / slack + 1) * slack;
+	}
+	else
+		info.st_size = MtpTimeline::JsonSizeBound();
+	info.st_mtime = time(0);
+}
+
+void MtpControlFile::Open(bool forWriting)
+{
+}
+
+void MtpControlFile::Close()
+{
+	// The timeline can be large, so don't keep it around
+	LockMutex lock(m_snapshotMutex);
+	std::string().swap(m_snapshot);
+}
+
+int MtpControlFile::Read(char *buf, size_t size, off_t offset)
+{
+	LockMutex lock(m_snapshotMutex);
+
+	if ((offset == 0) || m_snapshot.empty())
+		m_snapshot = generate(m_contents);
+	if ((uint64_t) offset >= m_snapshot.size())
+		return 0;
+	size = std::min<uint64_t>(size, m_snapshot.size() - offset);
+	memcpy(buf, m_snapshot.data() + offset, size);
+	return size;
+}
+
+int MtpControlFile::Write(const char* buf, size_t size, off_t offset)
+{
+	throw ReadOnly();
+}
+
+void MtpControlFile::Truncate(off_t length)
+{
+	throw ReadOnly();
+}
+
+void MtpControlFile::Remove()
+{
+	throw ReadOnly();
+}
+
+void MtpControlFile::Rename(MtpNode& newParent, const std::string& newName)
+{
+	throw ReadOnly();
+}
+
+MtpNodeMetadata MtpControlFile::getMetadata()
+{
+	MtpNodeMetadata md;
+	md.self.id = m_id;
+	md.self.parentId = 0;
+	md.self.storageId = 0;
+	return md;
+}
+
+void MtpControlFile::statfs(struct statvfs *stat)
+{
+	MtpRoot(m_device, m_cache).statfs(stat);
+}
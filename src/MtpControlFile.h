@@ -0,0 +1,69 @@
+/*
+ * MtpControlFile.h
+ *
+ * This software is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 3 as published by the Free Software Foundation.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02111-1301, USA.
+ * licensing@fsf.org
+ */
+
+#ifndef MTPCONTROLFILE_H_
+#define MTPCONTROLFILE_H_
+
+#include "MtpNode.h"
+#include "Mutex.h"
+
+// A read only file in /.jmtpfs whose contents are generated by jmtpfs
+class MtpControlFile : public MtpNode
+{
+public:
+	enum Contents
+	{
+		Stats,		// the counters and histograms from MtpStats, in the Prometheus text format
+		Timeline,	// the MtpTimeline events, in the Chrome trace_event JSON format
+		ContentsCount
+	};
+
+	MtpControlFile(MtpDevice& device, MtpMetadataCache& cache, Contents contents);
+
+	static const char* Name(Contents contents);
+	// The files there are now, since the timeline is only there when enabled
+	static std::vector<Contents> Available();
+
+	std::unique_ptr<MtpNode> getNode(const FilesystemPath& path);
+	void getattr(struct stat& info);
+
+	void Open(bool forWriting);
+	void Close();
+	int Read(char *buf, size_t size, off_t offset);
+	int Write(const char* buf, size_t size, off_t offset);
+	void Truncate(off_t length);
+
+	std::unique_ptr<MtpNode> Clone();
+
+	void Remove();
+	void Rename(MtpNode& newParent, const std::string& newName);
+	MtpNodeMetadata getMetadata();
+
+	void statfs(struct statvfs *stat);
+
+private:
+	Contents		m_contents;
+	// A read from the start takes a new snapshot, and the rest of the file is
+	// read from it, so a reader sees one consistent set of numbers. Each open
+	// has its own node, so readers don't share one.
+	RecursiveMutex	m_snapshotMutex;
+	std::string		m_snapshot;
+};
+
+#endif /* MTPCONTROLFILE_H_ */
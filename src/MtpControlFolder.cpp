@@ -0,0 +1,113 @@
+/*
+ * MtpControlFolder.cpp
+ *
+ * This software is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 3 as published by the Free Software Foundation.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02111-1301, USA.
+ * licensing@fsf.org
+ */
+#include "MtpControlFolder.h"
+#include "MtpControlFile.h"
+#include "MtpRoot.h"
+#include "mtpFilesystemErrors.h"
+#include <limits>
+#include <string.h>
+
+const char* MtpControlFolder::Name = ".jmtpfs";
+
+MtpControlFolder::MtpControlFolder(MtpDevice& device, MtpMetadataCache& cache) :
+	MtpNode(device, cache, std::numeric_limits<uint32_t>::max() - 1)
+{
+}
+
+std::unique_ptr<MtpNode> MtpControlFolder::Clone()
+{
+	return std::unique_ptr<MtpNode>(new MtpControlFolder(m_device, m_cache));
+}
+
+void MtpControlFolder::getattr(struct stat& info)
+{
+	info.st_ino = MTP_CONTROL_FOLDER_INODE;
+	info.st_mode = S_IFDIR | 0555;
+	info.st_nlink = 2;
+}
+
+std::unique_ptr<MtpNode> MtpControlFolder::getNode(const FilesystemPath& path)
+{
+	if (path.Body().Empty())
+	{
+		std::vector<MtpControlFile::Contents> files = MtpControlFile::Available();
+		for(std::vector<MtpControlFile::Contents>::iterator i = files.begin(); i != files.end(); i++)
+			if (path.Head() == MtpControlFile::Name(*i))
+				return std::unique_ptr<MtpNode>(new MtpControlFile(m_device, m_cache, *i));
+	}
+	throw FileNotFound(path.str());
+}
+
+std::vector<std::string> MtpControlFolder::readDirectory()
+{
+	std::vector<MtpControlFile::Contents> files = MtpControlFile::Available();
+	std::vector<std::string> result;
+	for(std::vector<MtpControlFile::Contents>::iterator i = files.begin(); i != files.end(); i++)
+		result.push_back(MtpControlFile::Name(*i));
+	return result;
+}
+
+std::vector<MtpDirectoryEntry> MtpControlFolder::readDirectoryEntries()
+{
+	std::vector<MtpControlFile::Contents> files = MtpControlFile::Available();
+	std::vector<MtpDirectoryEntry> result(files.size());
+	for(size_t i = 0; i < files.size(); i++)
+	{
+		result[i].name = MtpControlFile::Name(files[i]);
+		memset(&result[i].info, 0, sizeof(result[i].info));
+		result[i].info.st_ino = MTP_STATS_FILE_INODE + files[i];
+		result[i].info.st_mode = S_IFREG | 0444;
+		result[i].info.st_nlink = 1;
+	}
+	return result;
+}
+
+void MtpControlFolder::mkdir(const std::string& name)
+{
+	throw ReadOnly();
+}
+
+void MtpControlFolder::Remove()
+{
+	throw ReadOnly();
+}
+
+void MtpControlFolder::CreateFile(const std::string& name)
+{
+	throw ReadOnly();
+}
+
+void MtpControlFolder::Rename(MtpNode& newParent, const std::string& newName)
+{
+	throw ReadOnly();
+}
+
+MtpNodeMetadata MtpControlFolder::getMetadata()
+{
+	MtpNodeMetadata md;
+	md.self.id = m_id;
+	md.self.parentId = 0;
+	md.self.storageId = 0;
+	return md;
+}
+
+void MtpControlFolder::statfs(struct statvfs *stat)
+{
+	MtpRoot(m_device, m_cache).statfs(stat);
+}
@@ -0,0 +1,51 @@
+/*
+ * MtpControlFolder.h
+ *
+ * This software is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 3 as published by the Free Software Foundation.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02111-1301, USA.
+ * licensing@fsf.org
+ */
+
+#ifndef MTPCONTROLFOLDER_H_
+#define MTPCONTROLFOLDER_H_
+
+#include "MtpNode.h"
+
+// The hidden /.jmtpfs folder. It isn't listed in the root folder, but can
+// be opened by name.
+class MtpControlFolder : public MtpNode
+{
+public:
+	MtpControlFolder(MtpDevice& device, MtpMetadataCache& cache);
+
+	static const char* Name;
+
+	std::unique_ptr<MtpNode> getNode(const FilesystemPath& path);
+	void getattr(struct stat& info);
+
+	std::vector<std::string> readDirectory();
+	std::vector<MtpDirectoryEntry> readDirectoryEntries();
+
+	std::unique_ptr<MtpNode> Clone();
+
+	void mkdir(const std::string& name);
+	void Remove();
+	void CreateFile(const std::string& name);
+	void Rename(MtpNode& newParent, const std::string& newName);
+	MtpNodeMetadata getMetadata();
+
+	void statfs(struct statvfs *stat);
+};
+
+#endif /* MTPCONTROLFOLDER_H_ */
@@ -0,0 +1,79 @@
+/*
+ * MtpDentryCache.cpp
+ *
+ * This software is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 3 as published by the Free Software Foundation.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02111-1301, USA.
+ * licensing@fsf.org
+ */
+#include "MtpDentryCache.h"
+#include "MtpStats.h"
+
+const size_t MtpDentryCache::MaxEntries;
+
+MtpDentryCache::MtpDentryCache(time_t ttl) : m_mutex(MtpStats::LockDentryCache), m_ttl(ttl)
+{
+
+}
+
+std::unique_ptr<MtpNode> MtpDentryCache::lookup(const std::string& path)
+{
+	LockMutex lock(m_mutex);
+
+	entry_map_type::iterator i = m_entries.find(path);
+	if (i == m_entries.end())
+		return std::unique_ptr<MtpNode>();
+	if ((m_ttl != MtpCacheSettings::NeverExpire) && ((time(0) - i->second.whenCreated) > m_ttl))
+	{
+		m_entries.erase(i);
+		return std::unique_ptr<MtpNode>();
+	}
+	return i->second.node->Clone();
+}
+
+void MtpDentryCache::insert(const std::string& path, MtpNode& node)
+{
+	std::unique_ptr<MtpNode> copy(node.Clone());
+
+	LockMutex lock(m_mutex);
+
+	// Simpler than keeping track of which entries are least recently used,
+	// and the entries are cheap to recreate.
+	if (m_entries.size() >= MaxEntries)
+		m_entries.clear();
+	Entry& entry = m_entries[path];
+	entry.node = std::move(copy);
+	entry.whenCreated = time(0);
+}
+
+void MtpDentryCache::remove(const std::string& path)
+{
+	LockMutex lock(m_mutex);
+
+	m_entries.erase(path);
+}
+
+void MtpDentryCache::removeTree(const std::string& path)
+{
+	LockMutex lock(m_mutex);
+
+	std::string prefix = path + "/";
+	m_entries.erase(path);
+	for(entry_map_type::iterator i = m_entries.begin(); i != m_entries.end();)
+	{
+		if (i->first.compare(0, prefix.size(), prefix) == 0)
+			i = m_entries.erase(i);
+		else
+			i++;
+	}
+}
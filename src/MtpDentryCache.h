@@ -0,0 +1,69 @@
+/*
+ * MtpDentryCache.h
+ *
+ * This software is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 3 as published by the Free Software Foundation.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02111-1301, USA.
+ * licensing@fsf.org
+ */
+
+#ifndef MTPDENTRYCACHE_H_
+#define MTPDENTRYCACHE_H_
+
+#include "MtpNode.h"
+#include "Mutex.h"
+
+#include <memory>
+#include <string>
+#include <time.h>
+#include <unordered_map>
+
+/*
+ * Remembers which node a full path resolved to, so that resolving a path
+ * that was seen recently is a single hash lookup instead of a walk from
+ * the root. Nodes only hold the storage id, object id, and kind of object,
+ * so a copy of the cached node is as good as a freshly walked one.
+ * Anything that changes what a path refers to has to call remove or
+ * removeTree.
+ */
+class MtpDentryCache
+{
+public:
+	MtpDentryCache(time_t ttl);
+
+	// Returns null if the path isn't cached
+	std::unique_ptr<MtpNode> lookup(const std::string& path);
+	void insert(const std::string& path, MtpNode& node);
+
+	void remove(const std::string& path);
+	// Removes the path and everything below it
+	void removeTree(const std::string& path);
+
+private:
+	struct Entry
+	{
+		std::unique_ptr<MtpNode>	node;
+		time_t						whenCreated;
+	};
+
+	typedef std::unordered_map<std::string, Entry> entry_map_type;
+
+	static const size_t	MaxEntries = 100000;
+
+	RecursiveMutex	m_mutex;
+	time_t			m_ttl;
+	entry_map_type	m_entries;
+};
+
+
+#endif /* MTPDENTRYCACHE_H_ */
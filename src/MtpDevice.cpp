@@ -19,11 +19,12 @@
  * licensing@fsf.org
  */
 #include "MtpDevice.h"
-#include "MtpLibLock.h"
-#include "ConnectedMtpDevices.h"
+#include "mtpFilesystemErrors.h"
+#include "MtpStats.h"
 #include <sys/stat.h>
 #include <unistd.h>
 #include <algorithm>
+#include <errno.h>
 #include <magic.h>
 
 
@@ -58,16 +59,8 @@ NewLIBMTPFile::operator LIBMTP_file_t*()
 	return m_fileInfo;
 }
 
-MtpDevice::MtpDevice(LIBMTP_raw_device_t& rawDevice)
+MtpDevice::MtpDevice() : m_supportsPartialObject(false), m_supportsEditObjects(false)
 {
-MtpLibLock	lock;
-
-	m_mtpdevice = LIBMTP_Open_Raw_Device_Uncached(&rawDevice);
-	if (m_mtpdevice == 0)
-		throw MtpErrorCantOpenDevice();
-	m_busLocation = rawDevice.bus_location;
-	m_devnum = rawDevice.devnum;
-	LIBMTP_Clear_Errorstack(m_mtpdevice);
 	m_magicCookie = magic_open(MAGIC_MIME_TYPE);
 	if (m_magicCookie == 0)
 		throw std::runtime_error("Couldn't init magic");
@@ -78,53 +71,37 @@ MtpLibLock	lock;
 
 MtpDevice::~MtpDevice()
 {
-MtpLibLock	lock;
-
-	LIBMTP_Release_Device(m_mtpdevice);
+	magic_close(m_magicCookie);
 }
 
 std::string MtpDevice::Get_Modelname()
 {
-MtpLibLock	lock;
+MtpStatsDeviceTimer timer(MtpStats::DeviceGetModelname);
+MtpDeviceCommand command(m_queue, MtpDeviceQueue::Metadata);
 
-	char* fn = LIBMTP_Get_Modelname(m_mtpdevice);
-	if (fn)
-	{
-		std::string result(fn);
-		free(fn);
-		return result;
-	}
-	else
-	{
-		CheckErrors(false);
-		return "";
-	}
+	return DoGetModelname();
 }
 
-
-std::vector<MtpStorageInfo> MtpDevice::GetStorageDevices()
+std::string MtpDevice::Get_Serialnumber()
 {
-MtpLibLock	lock;
+MtpStatsDeviceTimer timer(MtpStats::DeviceGetSerialnumber);
+MtpDeviceCommand command(m_queue, MtpDeviceQueue::Metadata);
 
-	if (LIBMTP_Get_Storage(m_mtpdevice, LIBMTP_STORAGE_SORTBY_NOTSORTED))
-	{
-		CheckErrors(true);
-	}
+	return DoGetSerialnumber();
+}
 
-	LIBMTP_devicestorage_t* storage = m_mtpdevice->storage;
-	std::vector<MtpStorageInfo> result;
-	while(storage)
-	{
-		result.push_back(MtpStorageInfo(storage->id, storage->StorageDescription,
-				storage->FreeSpaceInBytes, storage->MaxCapacity));
-		storage = storage->next;
-	}
-	return result;
 
+std::vector<MtpStorageInfo> MtpDevice::GetStorageDevices()
+{
+MtpStatsDeviceTimer timer(MtpStats::DeviceGetStorageDevices);
+MtpDeviceCommand command(m_queue, MtpDeviceQueue::Metadata);
+
+	return DoGetStorageDevices();
 }
 
 MtpStorageInfo MtpDevice::GetStorageInfo(uint32_t storageId)
 {
+MtpStatsDeviceTimer timer(MtpStats::DeviceGetStorageInfo);
 	std::vector<MtpStorageInfo> storages = GetStorageDevices();
 	for(std::vector<MtpStorageInfo>::iterator i = storages.begin(); i != storages.end(); i++)
 		if (i->id == storageId)
@@ -134,96 +111,248 @@ MtpStorageInfo MtpDevice::GetStorageInfo(uint32_t storageId)
 
 std::vector<MtpFileInfo> MtpDevice::GetFolderContents(uint32_t storageId, uint32_t folderId)
 {
-MtpLibLock lock;
+MtpStatsDeviceTimer timer(MtpStats::DeviceGetFolderContents);
+MtpDeviceCommand command(m_queue, MtpDeviceQueue::Metadata);
 
-	std::vector<MtpFileInfo> result;
-	LIBMTP_file_t* files = LIBMTP_Get_Files_And_Folders(m_mtpdevice, storageId, folderId);
-	if (files == 0)
-	{
-		CheckErrors(false);
-		return result;
-	}
-	LIBMTP_file_t* filesWalk = files;
-	while(filesWalk)
-	{
-		MtpFileInfo fileInfo(MtpFileInfo(filesWalk->item_id, filesWalk->parent_id, filesWalk->storage_id, filesWalk->filename,
-					filesWalk->filetype, filesWalk->filesize));
-		result.push_back(fileInfo);
-		filesWalk = filesWalk->next;
-	}
-	if (files)
-		LIBMTP_destroy_file_t(files);
-	return result;
+	return DoGetFolderContents(storageId, folderId);
 }
 
 
 
 MtpFileInfo MtpDevice::GetFileInfo(uint32_t id)
 {
-MtpLibLock lock;
+MtpStatsDeviceTimer timer(MtpStats::DeviceGetFileInfo);
+MtpDeviceCommand command(m_queue, MtpDeviceQueue::Metadata);
+
+	return DoGetFileInfo(id);
+}
 
-	LIBMTP_file_t* fileInfoP = LIBMTP_Get_Filemetadata(m_mtpdevice, id);
-	if (fileInfoP==0)
+
+void MtpDevice::GetFile(uint32_t id, int fd)
+{
+MtpStatsDeviceTimer timer(MtpStats::DeviceGetFile);
+	if (m_supportsPartialObject)
 	{
-		CheckErrors(true);
+		// Fetch the file a chunk at a time so metadata commands can run in between
+		MtpFileInfo info = GetFileInfo(id);
+		std::vector<char> chunk(TRANSFER_CHUNK_SIZE);
+		uint64_t offset = 0;
+		while(offset < info.filesize)
+		{
+			size_t got = GetPartialObject(id, offset, std::min<uint64_t>(chunk.size(), info.filesize - offset), &chunk[0]);
+			// A copy shorter than the object would pass for the whole file
+			if (got == 0)
+				throw ReadError(EIO);
+			size_t written = 0;
+			while(written < got)
+			{
+				ssize_t n = write(fd, &chunk[written], got - written);
+				if ((n < 0) && (errno == EINTR))
+					continue;
+				if (n < 0)
+					throw WriteError(errno);
+				written += n;
+			}
+			offset += got;
+		}
+		timer.addBytes(offset);
+		return;
 	}
-	MtpFileInfo fileInfo(*fileInfoP);
-	LIBMTP_destroy_file_t(fileInfoP);
-	return fileInfo;
 
+MtpDeviceCommand command(m_queue, MtpDeviceQueue::Bulk);
+
+	DoGetFile(id, fd);
+	struct stat fileStat;
+	if (fstat(fd, &fileStat) == 0)
+	{
+		MtpStats::Add(MtpStats::DeviceBytesRead, fileStat.st_size);
+		timer.addBytes(fileStat.st_size);
+	}
 }
 
+bool MtpDevice::SupportsPartialObject()
+{
+	return m_supportsPartialObject;
+}
 
-void MtpDevice::GetFile(uint32_t id, int fd)
+size_t MtpDevice::GetPartialObject(uint32_t id, uint64_t offset, uint32_t maxBytes, void* buffer)
 {
-MtpLibLock lock;
+MtpStatsDeviceTimer timer(MtpStats::DeviceGetPartialObject);
 
-	if (LIBMTP_Get_File_To_File_Descriptor(m_mtpdevice, id, fd,0,0))
-		CheckErrors(true);
+	// One command per chunk, so metadata commands never wait for more than one
+	size_t got = 0;
+	while(got < maxBytes)
+	{
+		uint32_t want = std::min<uint32_t>(TRANSFER_CHUNK_SIZE, maxBytes - got);
+		size_t n;
+		{
+			MtpDeviceCommand command(m_queue, MtpDeviceQueue::Bulk);
+			n = DoGetPartialObject(id, offset + got, want, (char*) buffer + got);
+		}
+		got += n;
+		// Short means the end of the object
+		if (n < want)
+			break;
+	}
+	MtpStats::Add(MtpStats::DeviceBytesRead, got);
+	timer.addBytes(got);
+	return got;
 }
 
 void MtpDevice::CreateFolder(const std::string& name, uint32_t parentId, uint32_t storageId)
 {
-MtpLibLock lock;
+MtpStatsDeviceTimer timer(MtpStats::DeviceCreateFolder);
+MtpDeviceCommand command(m_queue, MtpDeviceQueue::Metadata);
 
-	if (LIBMTP_Create_Folder(m_mtpdevice, (char*) name.c_str(), parentId, storageId)==0)
-		CheckErrors(true);
+	DoCreateFolder(name, parentId, storageId);
 }
 
-void MtpDevice::CheckErrors(bool throwEvenWithNoError)
+void MtpDevice::DeleteObject(uint32_t id)
 {
-MtpLibLock lock;
+MtpStatsDeviceTimer timer(MtpStats::DeviceDeleteObject);
+MtpDeviceCommand command(m_queue, MtpDeviceQueue::Metadata);
+
+	DoDeleteObject(id);
+}
 
-	LIBMTP_error_t* errors = LIBMTP_Get_Errorstack(m_mtpdevice);
-	if (errors)
+void MtpDevice::SendFile(LIBMTP_file_t* destination, int fd)
+{
+MtpStatsDeviceTimer timer(MtpStats::DeviceSendFile);
+	SetFileTypeFromContents(destination, fd);
+
+	if (m_supportsEditObjects && (destination->filesize > 4 * TRANSFER_CHUNK_SIZE))
+	{
+		SendFileInChunks(destination, fd);
+		timer.addBytes(destination->filesize);
+		return;
+	}
+
+MtpDeviceCommand command(m_queue, MtpDeviceQueue::Bulk);
+
+	DoSendFile(destination, fd);
+	MtpStats::Add(MtpStats::DeviceBytesWritten, destination->filesize);
+	timer.addBytes(destination->filesize);
+}
+
+void MtpDevice::SendStream(LIBMTP_file_t* destination, int fd, const std::atomic<bool>& cancel)
+{
+MtpStatsDeviceTimer timer(MtpStats::DeviceSendStream);
+	// The data isn't there yet, so there is nothing to guess the type from, and
+	// the whole object has to go in one SendObject.
+MtpDeviceCommand command(m_queue, MtpDeviceQueue::Bulk);
+
+	DoSendStream(destination, fd, cancel);
+	MtpStats::Add(MtpStats::DeviceBytesWritten, destination->filesize);
+	timer.addBytes(destination->filesize);
+}
+
+void MtpDevice::SendFileInChunks(LIBMTP_file_t* destination, int fd)
+{
+	// A SendObject can't be split up, so create the object empty and then fill
+	// it in with the Android edit extensions, one chunk per command.
+	uint64_t size = destination->filesize;
+	destination->filesize = 0;
+	try
+	{
+		MtpDeviceCommand command(m_queue, MtpDeviceQueue::Bulk);
+		DoSendFile(destination, fd);
+		destination->filesize = size;
+	}
+	catch(...)
+	{
+		destination->filesize = size;
+		throw;
+	}
+
+	uint32_t id = destination->item_id;
+	try
 	{
-		LIBMTP_error_number_t errorCode = errors->errornumber;
-		std::string errorText(errors->error_text);
-		LIBMTP_Clear_Errorstack(m_mtpdevice);
-		switch(errorCode)
 		{
-		case LIBMTP_ERROR_NO_DEVICE_ATTACHED:
-			throw MtpDeviceDisconnected(errorText);
-		default:
-			throw MtpError(errorText, errorCode);
+			MtpDeviceCommand command(m_queue, MtpDeviceQueue::Bulk);
+			DoBeginEditObject(id);
 		}
+		SendRangeInChunks(id, fd, 0, size);
+		{
+			MtpDeviceCommand command(m_queue, MtpDeviceQueue::Bulk);
+			DoEndEditObject(id);
+		}
+	}
+	catch(...)
+	{
+		// Don't leave a partial file behind
+		try
+		{
+			DeleteObject(id);
+		}
+		catch(MtpError&)
+		{
+		}
+		throw;
+	}
+}
 
+void MtpDevice::SendRangeInChunks(uint32_t id, int fd, uint64_t offset, uint64_t length)
+{
+	std::vector<unsigned char> chunk(std::min<uint64_t>(TRANSFER_CHUNK_SIZE, length));
+	uint64_t end = offset + length;
+	while(offset < end)
+	{
+		ssize_t bytesRead = pread(fd, &chunk[0], std::min<uint64_t>(chunk.size(), end - offset), offset);
+		if (bytesRead < 0)
+			throw ReadError(errno);
+		if (bytesRead == 0)
+			throw ReadError(EIO);
+		MtpDeviceCommand command(m_queue, MtpDeviceQueue::Bulk);
+		DoSendPartialObject(id, offset, &chunk[0], bytesRead);
+		MtpStats::Add(MtpStats::DeviceBytesWritten, bytesRead);
+		offset += bytesRead;
 	}
-	LIBMTP_Clear_Errorstack(m_mtpdevice);
-	if (throwEvenWithNoError)
-		throw ExpectedMtpErrorNotFound();
 }
 
-void MtpDevice::DeleteObject(uint32_t id)
+bool MtpDevice::SupportsEditObjects()
 {
-MtpLibLock lock;
-	if (LIBMTP_Delete_Object(m_mtpdevice, id))
-		CheckErrors(true);
+	return m_supportsEditObjects;
 }
 
-void MtpDevice::SendFile(LIBMTP_file_t* destination, int fd)
+void MtpDevice::EditObject(uint32_t id, int fd, const MtpByteRanges& changed, uint64_t size, bool resize)
+{
+MtpStatsDeviceTimer timer(MtpStats::DeviceEditObject);
+	{
+		MtpDeviceCommand command(m_queue, MtpDeviceQueue::Bulk);
+		DoBeginEditObject(id);
+	}
+	try
+	{
+		if (resize)
+		{
+			MtpDeviceCommand command(m_queue, MtpDeviceQueue::Bulk);
+			DoTruncateObject(id, size);
+		}
+		const MtpByteRanges::range_map_type& ranges = changed.ranges();
+		for(MtpByteRanges::range_map_type::const_iterator i = ranges.begin(); i != ranges.end(); i++)
+			SendRangeInChunks(id, fd, i->first, i->second - i->first);
+		MtpDeviceCommand command(m_queue, MtpDeviceQueue::Bulk);
+		DoEndEditObject(id);
+	}
+	catch(...)
+	{
+		// Don't leave the object open for editing
+		try
+		{
+			MtpDeviceCommand command(m_queue, MtpDeviceQueue::Bulk);
+			DoEndEditObject(id);
+		}
+		catch(MtpError&)
+		{
+		}
+		throw;
+	}
+	timer.addBytes(changed.bytes());
+}
+
+void MtpDevice::SetFileTypeFromContents(LIBMTP_file_t* destination, int fd)
 {
-MtpLibLock lock;
+LockMutex lock(m_magicMutex);
 
 const char* mimeType = 0;
 	if (destination->filesize > 0)
@@ -245,32 +374,26 @@ const char* mimeType = 0;
 	}
 	if (mimeType)
 		destination->filetype = PropertyTypeFromMimeType(mimeType);
+}
 
 
-	if (LIBMTP_Send_File_From_File_Descriptor(m_mtpdevice, fd, destination, 0,0))
-		CheckErrors(true);
+MtpDeviceQueueStats MtpDevice::GetQueueStats(MtpDeviceQueue::CommandClass commandClass)
+{
+	return m_queue.GetStats(commandClass);
 }
 
-
 void MtpDevice::RenameFile(uint32_t id, const std::string& newName)
 {
-	MtpLibLock lock;
-	LIBMTP_file_t* fileInfo = LIBMTP_Get_Filemetadata(m_mtpdevice, id);
-	if (fileInfo==0)
-	{
-		CheckErrors(true);
-	}
-	int result = LIBMTP_Set_File_Name(m_mtpdevice, fileInfo, newName.c_str());
-	LIBMTP_destroy_file_t(fileInfo);
-	if (result)
-		CheckErrors(true);
+MtpStatsDeviceTimer timer(MtpStats::DeviceRenameFile);
+	MtpDeviceCommand command(m_queue, MtpDeviceQueue::Metadata);
+	DoRenameFile(id, newName);
 }
 
 void MtpDevice::SetObjectProperty(uint32_t id, LIBMTP_property_t property, const std::string& value)
 {
-	MtpLibLock lock;
-	if (LIBMTP_Set_Object_String(m_mtpdevice, id, property, value.c_str()))
-		CheckErrors(true);
+MtpStatsDeviceTimer timer(MtpStats::DeviceSetObjectProperty);
+	MtpDeviceCommand command(m_queue, MtpDeviceQueue::Metadata);
+	DoSetObjectProperty(id, property, value);
 }
 
 LIBMTP_filetype_t MtpDevice::PropertyTypeFromMimeType(const std::string& mimeType)
@@ -23,14 +23,21 @@
 #define MTPDEVICE_H_
 
 #include "libmtp.h"
+#include "MtpDeviceQueue.h"
+#include "MtpByteRanges.h"
 #include <string>
 #include <vector>
+#include <atomic>
 #include <stdexcept>
 #include <string.h>
 #include <magic.h>
 
 #define MAGIC_BUFFER_SIZE 8192
 
+// Bulk transfers are split into chunks of this size where the device allows
+// it, so that other commands don't have to wait for the whole transfer.
+#define TRANSFER_CHUNK_SIZE (1024*1024)
+
 class MtpError : public std::runtime_error
 {
 public:
@@ -119,33 +126,83 @@ private:
 	NewLIBMTPFile& operator=(const NewLIBMTPFile&);
 };
 
+/*
+ * The interface the rest of jmtpfs uses to talk to a device. The public
+ * methods take care of scheduling commands on the device queue, splitting
+ * up large transfers, and working out file types. The protected Do methods
+ * are the actual device operations, implemented by MtpLibmtpDevice for real
+ * devices and by MtpSimulatedDevice for testing and benchmarking without one.
+ */
 class MtpDevice
 {
 public:
-	MtpDevice(LIBMTP_raw_device_t& rawDevice);
-	~MtpDevice();
+	MtpDevice();
+	virtual ~MtpDevice();
 
 	std::string Get_Modelname();
+	std::string Get_Serialnumber();
 	std::vector<MtpStorageInfo> GetStorageDevices();
 	MtpStorageInfo GetStorageInfo(uint32_t storageId);
 	std::vector<MtpFileInfo> GetFolderContents(uint32_t storageId, uint32_t folderId);
 	MtpFileInfo GetFileInfo(uint32_t id);
 	void GetFile(uint32_t id, int fd);
+	bool SupportsPartialObject();
+	size_t GetPartialObject(uint32_t id, uint64_t offset, uint32_t maxBytes, void* buffer);
 	void SendFile(LIBMTP_file_t* destination, int fd);
+	bool SupportsEditObjects();
+	// Changes an existing file in place with the Android edit extensions:
+	// sets its size to size if resize is set, then sends the changed ranges
+	// from fd. Only to be called if SupportsEditObjects is true.
+	void EditObject(uint32_t id, int fd, const MtpByteRanges& changed, uint64_t size, bool resize);
+	// Sends destination->filesize bytes read from fd as they arrive, for a file
+	// that is still being written. Setting cancel aborts the transfer.
+	void SendStream(LIBMTP_file_t* destination, int fd, const std::atomic<bool>& cancel);
 	void CreateFolder(const std::string& name, uint32_t parentId, uint32_t storageId);
 	void DeleteObject(uint32_t id);
 	void RenameFile(uint32_t id, const std::string& newName);
 	void SetObjectProperty(uint32_t id, LIBMTP_property_t property, const std::string& value);
 	static LIBMTP_filetype_t PropertyTypeFromMimeType(const std::string& mimeType);
 
+	MtpDeviceQueueStats GetQueueStats(MtpDeviceQueue::CommandClass commandClass);
 
 protected:
-	void CheckErrors(bool throwEvenIfNoError);
-	LIBMTP_mtpdevice_t* m_mtpdevice;
-	uint32_t		m_busLocation;
-	uint8_t			m_devnum;
+	virtual std::string DoGetModelname() = 0;
+	virtual std::string DoGetSerialnumber() = 0;
+	virtual std::vector<MtpStorageInfo> DoGetStorageDevices() = 0;
+	virtual std::vector<MtpFileInfo> DoGetFolderContents(uint32_t storageId, uint32_t folderId) = 0;
+	virtual MtpFileInfo DoGetFileInfo(uint32_t id) = 0;
+	virtual void DoGetFile(uint32_t id, int fd) = 0;
+	// Only called if m_supportsPartialObject is set
+	virtual size_t DoGetPartialObject(uint32_t id, uint64_t offset, uint32_t maxBytes, void* buffer) = 0;
+	// Sends filesize bytes from fd and sets destination->item_id
+	virtual void DoSendFile(LIBMTP_file_t* destination, int fd) = 0;
+	// Like DoSendFile but reads fd sequentially, so fd can be a pipe or socket
+	virtual void DoSendStream(LIBMTP_file_t* destination, int fd, const std::atomic<bool>& cancel) = 0;
+	// Only called if m_supportsEditObjects is set
+	virtual void DoBeginEditObject(uint32_t id) = 0;
+	virtual void DoSendPartialObject(uint32_t id, uint64_t offset, const unsigned char* data, uint32_t size) = 0;
+	virtual void DoTruncateObject(uint32_t id, uint64_t size) = 0;
+	virtual void DoEndEditObject(uint32_t id) = 0;
+	virtual void DoCreateFolder(const std::string& name, uint32_t parentId, uint32_t storageId) = 0;
+	virtual void DoDeleteObject(uint32_t id) = 0;
+	virtual void DoRenameFile(uint32_t id, const std::string& newName) = 0;
+	virtual void DoSetObjectProperty(uint32_t id, LIBMTP_property_t property, const std::string& value) = 0;
+
+	void SendFileInChunks(LIBMTP_file_t* destination, int fd);
+	// Sends part of fd one chunk per command. Only between begin and end edit.
+	void SendRangeInChunks(uint32_t id, int fd, uint64_t offset, uint64_t length);
+	void SetFileTypeFromContents(LIBMTP_file_t* destination, int fd);
+
+	MtpDeviceQueue	m_queue;
+	bool			m_supportsPartialObject;
+	bool			m_supportsEditObjects;
+	RecursiveMutex	m_magicMutex;
 	magic_t			m_magicCookie;
 	char			m_magicBuffer[MAGIC_BUFFER_SIZE];
+
+private:
+	MtpDevice(const MtpDevice&);
+	MtpDevice& operator=(const MtpDevice&);
 };
 
 
@@ -0,0 +1,129 @@
+/*
+ * MtpDeviceQueue.cpp
+ *
+ * This software is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 3 as published by the Free Software Foundation.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02111-1301, USA.
+ * licensing@fsf.org
+ */
+#include "MtpDeviceQueue.h"
+#include "MtpStats.h"
+
+#include <time.h>
+
+const int MtpDeviceQueue::NumCommandClasses;
+
+static __thread uint64_t threadCommands = 0;
+
+static uint64_t nowMicroseconds()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return ((uint64_t) now.tv_sec) * 1000000 + now.tv_nsec / 1000;
+}
+
+MtpDeviceQueue::MtpDeviceQueue() : m_mutex(MtpStats::LockDeviceQueue), m_owned(false), m_depth(0),
+	m_ownerClass(Metadata), m_grantedAt(0), m_ownerOp(MtpStats::FuseOpCount)
+{
+	for(int i = 0; i < NumCommandClasses; i++)
+	{
+		m_nextTicket[i] = 0;
+		m_nowServing[i] = 0;
+	}
+}
+
+bool MtpDeviceQueue::mayRun(CommandClass commandClass, uint64_t ticket)
+{
+	if (m_owned || (ticket != m_nowServing[commandClass]))
+		return false;
+	// Any waiting command of a higher priority class goes first
+	for(int c = 0; c < commandClass; c++)
+		if (m_nextTicket[c] != m_nowServing[c])
+			return false;
+	return true;
+}
+
+void MtpDeviceQueue::Acquire(CommandClass commandClass)
+{
+	LockMutex lock(m_mutex);
+
+	if (m_owned && pthread_equal(m_owner, pthread_self()))
+	{
+		m_depth++;
+		return;
+	}
+	uint64_t waitStart = nowMicroseconds();
+	int holderOp = m_owned ? m_ownerOp : MtpStats::FuseOpCount;
+	uint64_t ticket = m_nextTicket[commandClass]++;
+	while(!mayRun(commandClass, ticket))
+		m_condition.Wait(m_mutex);
+	m_nowServing[commandClass]++;
+	m_owned = true;
+	m_owner = pthread_self();
+	m_depth = 1;
+	m_ownerClass = commandClass;
+	m_grantedAt = nowMicroseconds();
+	threadCommands++;
+
+	uint64_t waited = m_grantedAt - waitStart;
+	MtpDeviceQueueStats& stats = m_stats[commandClass];
+	stats.commands++;
+	stats.waitMicroseconds += waited;
+	if (waited > stats.maxWaitMicroseconds)
+		stats.maxWaitMicroseconds = waited;
+	if (MtpStats::LockProfiling())
+	{
+		m_ownerOp = MtpStats::CurrentFuseOp();
+		MtpStats::LockWaited(MtpStats::LockDevice, waited, holderOp);
+	}
+	if (MtpTimeline::Enabled())
+		MtpTimeline::Span("lock", commandClass == Metadata ? "device queue (metadata)" : "device queue (bulk)",
+				waitStart, waited);
+}
+
+void MtpDeviceQueue::Release()
+{
+	LockMutex lock(m_mutex);
+
+	if (--m_depth == 0)
+	{
+		uint64_t busy = nowMicroseconds() - m_grantedAt;
+		m_stats[m_ownerClass].busyMicroseconds += busy;
+		if (MtpStats::LockProfiling())
+			MtpStats::LockHeld(MtpStats::LockDevice, busy);
+		m_owned = false;
+		m_condition.Broadcast();
+	}
+}
+
+MtpDeviceQueueStats MtpDeviceQueue::GetStats(CommandClass commandClass)
+{
+	LockMutex lock(m_mutex);
+
+	return m_stats[commandClass];
+}
+
+uint64_t MtpDeviceQueue::ThreadCommands()
+{
+	return threadCommands;
+}
+
+MtpDeviceCommand::MtpDeviceCommand(MtpDeviceQueue& queue, MtpDeviceQueue::CommandClass commandClass) : m_queue(queue)
+{
+	m_queue.Acquire(commandClass);
+}
+
+MtpDeviceCommand::~MtpDeviceCommand()
+{
+	m_queue.Release();
+}
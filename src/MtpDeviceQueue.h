@@ -0,0 +1,99 @@
+/*
+ * MtpDeviceQueue.h
+ *
+ * This software is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 3 as published by the Free Software Foundation.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02111-1301, USA.
+ * licensing@fsf.org
+ */
+
+#ifndef MTPDEVICEQUEUE_H_
+#define MTPDEVICEQUEUE_H_
+
+#include "Mutex.h"
+#include <stdint.h>
+
+struct MtpDeviceQueueStats
+{
+	MtpDeviceQueueStats() : commands(0), waitMicroseconds(0), maxWaitMicroseconds(0), busyMicroseconds(0) {}
+
+	uint64_t	commands;
+	uint64_t	waitMicroseconds;
+	uint64_t	maxWaitMicroseconds;
+	uint64_t	busyMicroseconds;
+};
+
+/*
+ * MTP only allows one transaction at a time, so every call into libmtp
+ * for a device has to go through that device's queue. Commands come in
+ * two classes. Metadata commands (listings, file info, deletes, etc) are
+ * always run before any waiting bulk transfer, so that browsing the
+ * device stays responsive while files are being copied. Within a class
+ * commands are run in the order they were issued. Bulk transfers are
+ * split into chunks by MtpDevice so a metadata command never has to wait
+ * for more than one chunk. A thread that already holds the queue can
+ * issue nested commands.
+ */
+class MtpDeviceQueue
+{
+public:
+	enum CommandClass
+	{
+		Metadata = 0,
+		Bulk = 1
+	};
+	static const int NumCommandClasses = 2;
+
+	MtpDeviceQueue();
+
+	void Acquire(CommandClass commandClass);
+	void Release();
+
+	MtpDeviceQueueStats GetStats(CommandClass commandClass);
+
+	// The number of commands (not counting nested ones) the calling thread
+	// has been granted on any queue, so a caller can see how many device
+	// transactions an operation took.
+	static uint64_t ThreadCommands();
+
+private:
+	MtpDeviceQueue(const MtpDeviceQueue&);
+	MtpDeviceQueue& operator=(const MtpDeviceQueue&);
+
+	bool mayRun(CommandClass commandClass, uint64_t ticket);
+
+	RecursiveMutex		m_mutex;
+	Condition			m_condition;
+	bool				m_owned;
+	pthread_t			m_owner;
+	unsigned			m_depth;
+	CommandClass		m_ownerClass;
+	uint64_t			m_grantedAt;
+	int					m_ownerOp;		// for lock profiling
+	uint64_t			m_nextTicket[NumCommandClasses];
+	uint64_t			m_nowServing[NumCommandClasses];
+	MtpDeviceQueueStats	m_stats[NumCommandClasses];
+};
+
+class MtpDeviceCommand
+{
+public:
+	MtpDeviceCommand(MtpDeviceQueue& queue, MtpDeviceQueue::CommandClass commandClass);
+	~MtpDeviceCommand();
+
+private:
+	MtpDeviceQueue&	m_queue;
+};
+
+
+#endif /* MTPDEVICEQUEUE_H_ */
@@ -22,7 +22,8 @@
 #include "mtpFilesystemErrors.h"
 #include <errno.h>
 
-MtpFile::MtpFile(MtpDevice& device,  MtpMetadataCache& cache, uint32_t id) : MtpNode(device, cache, id), m_opened(false)
+MtpFile::MtpFile(MtpDevice& device,  MtpMetadataCache& cache, uint32_t id) : MtpNode(device, cache, id), m_opened(false),
+		m_openedForWriting(false)
 {
 }
 
@@ -35,6 +36,57 @@ std::unique_ptr<MtpNode> MtpFile::getNode(const FilesystemPath& path)
 	throw FileNotFound(path.str());
 }
 
+uint32_t MtpFile::Id()
+{
+	FollowMove();
+	return m_id;
+}
+
+void MtpFile::FollowMove()
+{
+	m_id = m_cache.currentId(m_id);
+}
+
+uint32_t MtpFile::StorageId()
+{
+	return Info().storageId;
+}
+
+MtpFileInfo MtpFile::Info()
+{
+	FollowMove();
+	std::shared_ptr<MtpLocalFileCopy> localFile = m_cache.getOpenedFile(m_id);
+	if (localFile)
+		return localFile->info();
+	// A new file that was removed before it got to the device
+	if (m_cache.isPendingId(m_id))
+		throw FileNotFound("");
+	return m_cache.getItem(m_id, *this)->self;
+}
+
+uint32_t MtpFile::ParentId()
+{
+	MtpFileInfo info = Info();
+	if (info.parentId == 0)
+		return info.storageId;
+	else
+		return info.parentId;
+}
+
+std::shared_ptr<MtpLocalFileCopy> MtpFile::LocalCopy()
+{
+	FollowMove();
+	std::shared_ptr<MtpLocalFileCopy> localFile = m_cache.getOpenedFile(m_id);
+	if (localFile)
+		return localFile;
+	return m_cache.openFile(m_device, Info());
+}
+
+std::unique_ptr<MtpNode> MtpFile::Clone()
+{
+	return std::unique_ptr<MtpNode>(new MtpFile(m_device, m_cache, m_id));
+}
+
 MtpNodeMetadata MtpFile::getMetadata()
 {
 	MtpNodeMetadata md;
@@ -44,55 +96,98 @@ MtpNodeMetadata MtpFile::getMetadata()
 
 void MtpFile::getattr(struct stat& info)
 {
-	MtpNodeMetadata md = m_cache.getItem(m_id, *this);
+	FollowMove();
+	std::shared_ptr<MtpLocalFileCopy> localFile = m_cache.getOpenedFile(m_id);
+	MtpFileInfo self = localFile ? localFile->info() : Info();
 
+	info.st_ino = InodeNumber(self.storageId, m_cache.originalId(m_id));
 	info.st_mode = S_IFREG | 0644;
 	info.st_nlink = 1;
-	info.st_mtime = md.self.modificationdate;
-	MtpLocalFileCopy* localFile = m_cache.getOpenedFile(m_id);
+	info.st_mtime = self.modificationdate;
 	if (localFile)
 	{
 		info.st_size = localFile->getSize();
 	}
 	else
-		info.st_size = md.self.filesize;
+		info.st_size = self.filesize;
 }
 
 
-void MtpFile::Open()
+void MtpFile::Open(bool forWriting)
 {
-	m_cache.openFile(m_device, m_id);
+	// If the device can do partial reads there is no need to copy the whole
+	// file up front. A local copy gets made if and when the file is written to.
+	// Empty files and files in the content cache cost nothing to copy, and
+	// having the copy open is what lets a truncate before the first write
+	// start a streaming upload. With the content cache on, a file it would
+	// keep is copied whole, so the next open gets it from there.
+	MtpFileInfo info = Info();
+	if (!m_device.SupportsPartialObject() || m_cache.haveContents(info) || (info.filesize == 0) ||
+			m_cache.keepsContents(info))
+		m_cache.openFile(m_device, info);
+	m_cache.addOpen(m_id, forWriting);
+	m_opened = true;
+	m_openedForWriting = forWriting;
 }
 
 int MtpFile::Read(char *buf, size_t size, off_t offset)
 {
-	MtpLocalFileCopy* localFile = m_cache.openFile(m_device, m_id);
+	std::shared_ptr<MtpLocalFileCopy> localFile = OpenedCopy(false);
+	if (!localFile)
+		return ReadFromDevice(buf, size, offset);
+	return localFile->read(buf, size, offset);
+
+}
 
-	localFile->seek(offset);
-	return localFile->read(buf, size);
+std::shared_ptr<MtpLocalFileCopy> MtpFile::OpenedCopy(bool forWriting)
+{
+	// Reads go straight to the device when it can do partial reads and
+	// nothing has made a local copy yet
+	FollowMove();
+	std::shared_ptr<MtpLocalFileCopy> localFile = m_cache.getOpenedFile(m_id);
+	if (!localFile && (forWriting || !m_device.SupportsPartialObject()))
+		localFile = LocalCopy();
+	return localFile;
+}
 
+int MtpFile::ReadFromDevice(char *buf, size_t size, off_t offset)
+{
+	std::shared_ptr<const MtpNodeMetadata> md = m_cache.getItem(m_id, *this);
+	return m_cache.readRemoteFile(m_device, md->self, buf, size, offset);
 }
 
 int MtpFile::Write(const char* buf, size_t size, off_t offset)
 {
 
-	MtpLocalFileCopy* localFile = m_cache.openFile(m_device, m_id);
-	localFile->seek(offset);
-//	m_cache.clearItem(m_id);
-	return localFile->write(buf, size);
+	return LocalCopy()->write(buf, size, offset);
 }
 
 void MtpFile::Fsync()
 {
-	uint32_t parentId = GetParentNodeId();
-	m_cache.clearItem(m_id);
+	// If anything was sent the cache updates the file's and its folder's
+	// metadata itself.
+	FollowMove();
 	m_id = m_cache.closeFile(m_id);
-	m_cache.clearItem(parentId);
+}
+
+void MtpFile::Flush()
+{
+	// When the only writer closes its descriptor there is no need to wait
+	// for the release to start sending what it wrote.
+	FollowMove();
+	if (m_opened && m_openedForWriting && (m_cache.openWriters(m_id) == 1))
+		m_id = m_cache.closeFile(m_id, false);
 }
 
 void MtpFile::Close()
 {
-	Fsync();
+	// Changes may only be queued to be sent, in which case the id changes later
+	FollowMove();
+	if (!m_opened)
+		m_id = m_cache.closeFile(m_id, false);
+	else
+		m_id = m_cache.releaseFile(m_id, m_openedForWriting);
+	m_opened = false;
 }
 
 void MtpFile::Truncate(off_t length)
@@ -102,22 +197,42 @@ void MtpFile::Truncate(off_t length)
 	getattr(info);
 	if (info.st_size == length)
 		return;
-	uint32_t parentId = GetParentNodeId();
-	MtpLocalFileCopy* localFile = m_cache.openFile(m_device, m_id);
+	// Growing a new file that is open for writing says how big it is going
+	// to be, so it can be sent as it is written instead of at close.
+	std::shared_ptr<MtpLocalFileCopy> localFile = m_cache.getOpenedFile(m_id);
+	if (localFile && (info.st_size == 0) && localFile->startUpload(length))
+		return;
+	if (!localFile)
+		localFile = LocalCopy();
 	localFile->truncate(length);
-	m_id = m_cache.closeFile(m_id);
-	m_cache.clearItem(m_id);
-	m_cache.clearItem(parentId);
+	m_id = m_cache.closeFile(m_id, false);
 }
 
 
 
+void MtpFile::Allocate(off_t offset, off_t length)
+{
+	struct stat info;
+	getattr(info);
+	if (offset + length > info.st_size)
+		Truncate(offset + length);
+}
+
 void MtpFile::Remove()
 {
-	uint32_t parentId = GetParentNodeId();
-	m_device.DeleteObject(m_id);
+	uint32_t parentId = ParentId();
+	// Whatever was written to an open copy goes away with the file
+	uint32_t remoteId = m_cache.discardFile(m_id);
+	if (remoteId)
+		m_device.DeleteObject(remoteId);
 	m_cache.clearItem(parentId);
 	m_cache.clearItem(m_id);
+	m_cache.clearRemoteFileData(m_id);
+	if (remoteId && (remoteId != m_id))
+	{
+		m_cache.clearItem(remoteId);
+		m_cache.clearRemoteFileData(remoteId);
+	}
 
 }
 
@@ -126,26 +241,39 @@ void MtpFile::Rename(MtpNode& newParent, const std::string& newName)
 	if (newName.length() > MAX_MTP_NAME_LENGTH)
 		throw MtpNameTooLong();
 	Fsync();
-	MtpNodeMetadata md = m_cache.getItem(m_id, *this);
+	std::shared_ptr<const MtpNodeMetadata> md = m_cache.getItem(m_id, *this);
 	uint32_t parentId = GetParentNodeId();
 	/* This true in place rename seems to confuse apps on the android device. The Gallery app
 	 * for example, won't notice image files that have been renamed. So to prevent this strangeness
 	 * real rename is disabled, and instead we make a copy of the file and delete the original
-	if ((newParent.FolderId() == md.self.parentId) && (newParent.StorageId() == md.self.storageId))
+	if ((newParent.FolderId() == md->self.parentId) && (newParent.StorageId() == md->self.storageId))
 	{
 		// we can do a real rename
-		m_device.RenameFile(md.self.id, newName);
+		m_device.RenameFile(md->self.id, newName);
 	}
 	else
 	*/
 	{
 		//we have to do a copy and delete
-		MtpLocalFileCopy* localFile = m_cache.openFile(m_device, md.self.id);
+		// A copy made just for this mustn't stay open under the old id
+		bool wasOpen = (bool) m_cache.getOpenedFile(md->self.id);
+		std::shared_ptr<MtpLocalFileCopy> localFile = m_cache.openFile(m_device, md->self);
 		NewLIBMTPFile newFile(newName, newParent.FolderId(), newParent.StorageId(), localFile->getSize());
-		localFile->CopyTo(m_device, newFile);
-		m_cache.clearItem(md.self.id);
+		try
+		{
+			localFile->CopyTo(m_device, newFile);
+		}
+		catch(...)
+		{
+			if (!wasOpen)
+				m_cache.discardFile(md->self.id);
+			throw;
+		}
+		if (!wasOpen)
+			m_cache.discardFile(md->self.id);
+		m_cache.clearItem(md->self.id);
 		m_cache.clearItem(((LIBMTP_file_t*)newFile)->item_id);
-		m_device.DeleteObject(md.self.id);
+		m_device.DeleteObject(md->self.id);
 		m_id = ((LIBMTP_file_t*)newFile)->item_id;
 
 	}
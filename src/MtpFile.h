@@ -31,24 +31,43 @@ public:
 	MtpFile(MtpDevice& device,  MtpMetadataCache& cache, uint32_t id);
 	~MtpFile();
 
+	// Follows the file to its new id once it has been written back
+	uint32_t Id();
+
 	std::unique_ptr<MtpNode> getNode(const FilesystemPath& path);
 	void getattr(struct stat& info);
 
-	void Open();
+	void Open(bool forWriting);
+	void Flush();
 	void Close();
 	int Read(char *buf, size_t size, off_t offset);
 	int Write(const char* buf, size_t size, off_t offset);
+	std::shared_ptr<MtpLocalFileCopy> OpenedCopy(bool forWriting);
 	void Remove();
 
 	void Fsync();
 	void Truncate(off_t length);
+	void Allocate(off_t offset, off_t length);
 	void Rename(MtpNode& newParent, const std::string& newName);
 
 	MtpNodeMetadata getMetadata();
 
+	uint32_t StorageId();
+
+	std::unique_ptr<MtpNode> Clone();
+
 protected:
+	int ReadFromDevice(char *buf, size_t size, off_t offset);
+	void FollowMove();
+	// While the file is open the local copy knows about it, even when
+	// there is no object on the device for it at the moment.
+	MtpFileInfo Info();
+	uint32_t ParentId();
+	std::shared_ptr<MtpLocalFileCopy> LocalCopy();
+
 	MtpFileInfo	m_info;
 	bool		m_opened;
+	bool		m_openedForWriting;
 	FILE*		m_localFile;
 	bool		m_needWrite;
 };
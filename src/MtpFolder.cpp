@@ -23,6 +23,7 @@
 #include "MtpFile.h"
 #include "mtpFilesystemErrors.h"
 #include "TemporaryFile.h"
+#include <string.h>
 
 MtpFolder::MtpFolder(MtpDevice& device, MtpMetadataCache& cache, uint32_t storageId,
 		uint32_t folderId) : MtpNode(device, cache, folderId ? folderId : storageId),
@@ -31,6 +32,11 @@ MtpFolder::MtpFolder(MtpDevice& device, MtpMetadataCache& cache, uint32_t storag
 
 }
 
+std::unique_ptr<MtpNode> MtpFolder::Clone()
+{
+	return std::unique_ptr<MtpNode>(new MtpFolder(m_device, m_cache, m_storageId, m_folderId));
+}
+
 MtpNodeMetadata MtpFolder::getMetadata()
 {
 	MtpNodeMetadata md;
@@ -45,19 +51,31 @@ MtpNodeMetadata MtpFolder::getMetadata()
 	else
 	{
 		md.self = m_device.GetFileInfo(m_id);
+		MtpMetadataIndex* index = m_cache.getIndex();
+		if (index && index->lookup(m_storageId, m_folderId, md.self.modificationdate, md.children))
+		{
+			m_cache.seedFiles(md.children);
+			return md;
+		}
 	}
 	md.children = m_device.GetFolderContents(m_storageId, folderId);
+	if (m_folderId && m_cache.getIndex())
+		m_cache.getIndex()->store(m_storageId, m_folderId, md.self.modificationdate, md.children);
+	// The listing has everything a file's metadata does, so a getattr on
+	// each file (ls -l) doesn't need another trip to the device.
+	m_cache.seedFiles(md.children);
 
 	return md;
 }
 
 void MtpFolder::getattr(struct stat& info)
 {
-	MtpNodeMetadata md = m_cache.getItem(m_id, *this);
+	std::shared_ptr<const MtpNodeMetadata> md = m_cache.getItem(m_id, *this);
+	info.st_ino = InodeNumber(m_storageId, m_folderId);
 	info.st_mode = S_IFDIR | 0755;
 	info.st_nlink = 2;
-	info.st_mtime = md.self.modificationdate;
-	for(std::vector<MtpFileInfo>::iterator i = md.children.begin(); i!=md.children.end(); i++)
+	info.st_mtime = md->self.modificationdate;
+	for(std::vector<MtpFileInfo>::const_iterator i = md->children.begin(); i!=md->children.end(); i++)
 	{
 		if (i->filetype == LIBMTP_FILETYPE_FOLDER)
 			info.st_nlink++;
@@ -66,24 +84,34 @@ void MtpFolder::getattr(struct stat& info)
 
 std::unique_ptr<MtpNode> MtpFolder::getNode(const FilesystemPath& path)
 {
-	MtpNodeMetadata md = m_cache.getItem(m_id, *this);
+	std::shared_ptr<const MtpNodeMetadata> md = m_cache.getItem(m_id, *this);
 
-	std::string filename = path.Head();
-	for(std::vector<MtpFileInfo>::iterator i = md.children.begin(); i!=md.children.end(); i++)
+	// New files that aren't on the device yet, or are being replaced, win
+	// over whatever the device listing says.
+	pending_files_type pending = m_cache.pendingFiles(m_folderId, m_storageId);
+	for(pending_files_type::iterator i = pending.begin(); i != pending.end(); i++)
 	{
-		if (i->name == filename)
+		if ((*i)->info().name == path.Head())
 		{
-			if (i->filetype != LIBMTP_FILETYPE_FOLDER)
-				return std::unique_ptr<MtpNode>(new MtpFile(m_device, m_cache, i->id));
+			if (!path.Body().Empty())
+				throw NotADirectory();
+			return std::unique_ptr<MtpNode>(new MtpFile(m_device, m_cache, (*i)->info().id));
+		}
+	}
+
+	const MtpFileInfo* child = md->findChild(path.Head());
+	if (child)
+	{
+		if (child->filetype != LIBMTP_FILETYPE_FOLDER)
+			return std::unique_ptr<MtpNode>(new MtpFile(m_device, m_cache, child->id));
+		else
+		{
+			std::unique_ptr<MtpNode> n(new MtpFolder(m_device, m_cache, m_storageId, child->id));
+			FilesystemPath childPath = path.Body();
+			if (childPath.Empty())
+				return n;
 			else
-			{
-				std::unique_ptr<MtpNode> n(new MtpFolder(m_device, m_cache, m_storageId, i->id));
-				FilesystemPath childPath = path.Body();
-				if (childPath.Empty())
-					return n;
-				else
-					return n->getNode(childPath);
-			}
+				return n->getNode(childPath);
 		}
 	}
 	throw FileNotFound(path.str());
@@ -91,15 +119,74 @@ std::unique_ptr<MtpNode> MtpFolder::getNode(const FilesystemPath& path)
 
 std::vector<std::string> MtpFolder::readDirectory()
 {
-	MtpNodeMetadata md = m_cache.getItem(m_id, *this);
+	std::shared_ptr<const MtpNodeMetadata> md = m_cache.getItem(m_id, *this);
 
 	std::vector<std::string> result;
 
-	for(std::vector<MtpFileInfo>::iterator i = md.children.begin(); i != md.children.end(); i++)
-		result.push_back(i->name);
+	pending_files_type pending = m_cache.pendingFiles(m_folderId, m_storageId);
+	for(std::vector<MtpFileInfo>::const_iterator i = md->children.begin(); i != md->children.end(); i++)
+	{
+		if (!findPending(pending, i->name))
+			result.push_back(i->name);
+	}
+	for(pending_files_type::iterator i = pending.begin(); i != pending.end(); i++)
+		result.push_back((*i)->info().name);
+	return result;
+}
+
+std::vector<MtpDirectoryEntry> MtpFolder::readDirectoryEntries()
+{
+	std::shared_ptr<const MtpNodeMetadata> md = m_cache.getItem(m_id, *this);
+
+	pending_files_type pending = m_cache.pendingFiles(m_folderId, m_storageId);
+	std::vector<MtpDirectoryEntry> result(md->children.size() + pending.size());
+	size_t i = 0;
+	for(std::vector<MtpFileInfo>::const_iterator child = md->children.begin(); child != md->children.end(); child++)
+	{
+		if (findPending(pending, child->name))
+			continue;
+		result[i].name = child->name;
+		memset(&result[i].info, 0, sizeof(result[i].info));
+		result[i].info.st_ino = InodeNumber(m_storageId, m_cache.originalId(child->id));
+		result[i].info.st_mtime = child->modificationdate;
+		if (child->filetype == LIBMTP_FILETYPE_FOLDER)
+		{
+			// Getting the real link count would mean listing the folder
+			result[i].info.st_mode = S_IFDIR | 0755;
+			result[i].info.st_nlink = 2;
+		}
+		else
+		{
+			result[i].info.st_mode = S_IFREG | 0644;
+			result[i].info.st_nlink = 1;
+			result[i].info.st_size = child->filesize;
+		}
+		i++;
+	}
+	for(pending_files_type::iterator p = pending.begin(); p != pending.end(); p++, i++)
+	{
+		const MtpFileInfo& info = (*p)->info();
+		result[i].name = info.name;
+		memset(&result[i].info, 0, sizeof(result[i].info));
+		result[i].info.st_ino = InodeNumber(m_storageId, m_cache.originalId(info.id));
+		result[i].info.st_mtime = info.modificationdate;
+		result[i].info.st_mode = S_IFREG | 0644;
+		result[i].info.st_nlink = 1;
+		result[i].info.st_size = (*p)->getSize();
+	}
+	result.resize(i);
 	return result;
 }
 
+bool MtpFolder::findPending(const pending_files_type& pending, const std::string& name)
+{
+	for(pending_files_type::const_iterator i = pending.begin(); i != pending.end(); i++)
+	{
+		if ((*i)->info().name == name)
+			return true;
+	}
+	return false;
+}
 
 void MtpFolder::Remove()
 {
@@ -128,6 +215,10 @@ void MtpFolder::CreateFile(const std::string& name)
 	if (name.length() > MAX_MTP_NAME_LENGTH)
 		throw MtpNameTooLong();
 
+	// Nothing goes to the device until the file is closed
+	if (m_cache.createFile(m_device, name, m_folderId, m_storageId))
+		return;
+
 	NewLIBMTPFile newFile(name, m_folderId, m_storageId);
 	TemporaryFile empty;
 	m_device.SendFile(newFile, empty.FileNo());
@@ -150,10 +241,10 @@ void MtpFolder::Rename(MtpNode& newParent, const std::string& newName)
 	if (newName.length() > MAX_MTP_NAME_LENGTH)
 		throw MtpNameTooLong();
 
-	MtpNodeMetadata md = m_cache.getItem(m_id, *this);
+	std::shared_ptr<const MtpNodeMetadata> md = m_cache.getItem(m_id, *this);
 
 	uint32_t parentId = GetParentNodeId();
-	if ((newParent.FolderId() == md.self.parentId) && (newParent.StorageId() == m_storageId))
+	if ((newParent.FolderId() == md->self.parentId) && (newParent.StorageId() == m_storageId))
 	{
 		// we can do a real rename
 		m_device.RenameFile(m_id, newName);
@@ -33,6 +33,7 @@ public:
 	void getattr(struct stat& info);
 
 	std::vector<std::string> readDirectory();
+	std::vector<MtpDirectoryEntry> readDirectoryEntries();
 	void Remove();
 
 	void mkdir(const std::string& name);
@@ -45,8 +46,12 @@ public:
 
 	MtpNodeMetadata getMetadata();
 
+	std::unique_ptr<MtpNode> Clone();
+
 protected:
+	typedef std::vector<std::shared_ptr<MtpLocalFileCopy> > pending_files_type;
 
+	static bool findPending(const pending_files_type& pending, const std::string& name);
 
 	std::vector<MtpFileInfo> m_files;
 	uint32_t m_storageId, m_folderId;
@@ -21,22 +21,93 @@
 #include "MtpFuseContext.h"
 #include "mtpFilesystemErrors.h"
 #include "MtpRoot.h"
+#include "MtpStats.h"
+#include <iostream>
 
-MtpFuseContext::MtpFuseContext(std::unique_ptr<MtpDevice> device,  uid_t uid, gid_t gid) :
-	m_device(std::move(device)), m_uid(uid), m_gid(gid)
+MtpFuseContext::MtpFuseContext(std::unique_ptr<MtpDevice> device,  uid_t uid, gid_t gid, const MtpCacheSettings& cacheSettings,
+		const std::string& indexDirectory) :
+	m_device(std::move(device)), m_uid(uid), m_gid(gid), m_cache(cacheSettings),
+	m_dentries(cacheSettings.metadataTtl), m_modifyLock(MtpStats::LockModify)
 {
+	if (!indexDirectory.empty())
+	{
+		std::string serial = m_device->Get_Serialnumber();
+		if (serial.empty())
+			std::cerr << "Device has no serial number, not using the metadata index" << std::endl;
+		else
+		{
+			m_index.reset(new MtpMetadataIndex(indexDirectory, serial));
+			m_cache.setIndex(m_index.get());
+		}
+	}
+	if (cacheSettings.contentCacheBytes && !cacheSettings.contentCacheDirectory.empty())
+	{
+		std::string serial = m_device->Get_Serialnumber();
+		if (serial.empty())
+			std::cerr << "Device has no serial number, not using the content cache" << std::endl;
+		else
+		{
+			try
+			{
+				m_contentCache.reset(new MtpContentCache(cacheSettings.contentCacheDirectory, serial,
+						cacheSettings.contentCacheBytes));
+				m_cache.setContentCache(m_contentCache.get());
+			}
+			catch(std::exception& e)
+			{
+				std::cerr << "Unable to use the content cache: " << e.what() << std::endl;
+			}
+		}
+	}
+}
 
+MtpFuseContext::~MtpFuseContext()
+{
+	// Unmounting waits for files that were closed but not yet sent
+	m_cache.waitForWriteBacks();
+	if (m_index)
+	{
+		try
+		{
+			m_index->save();
+		}
+		catch(std::exception& e)
+		{
+			std::cerr << "Unable to save the metadata index: " << e.what() << std::endl;
+		}
+	}
 }
 
 std::unique_ptr<MtpNode> MtpFuseContext::getNode(const FilesystemPath& path)
 {
-	std::unique_ptr<MtpNode> root(new MtpRoot(*m_device, m_cache));
 	if (path.Head()!="/")
 		throw FileNotFound(path.str());
 	if (path.str()=="/")
-		return root;
-	else
-		return root->getNode(path.Body());
+		return std::unique_ptr<MtpNode>(new MtpRoot(*m_device, m_cache));
+
+	std::unique_ptr<MtpNode> node = m_dentries.lookup(path.str());
+	if (node)
+		return node;
+
+	// Resolve the parent the same way, so only the uncached part of the
+	// path has to be walked.
+	std::unique_ptr<MtpNode> parent = getNode(path.AllButTail());
+	std::string name = path.Tail();
+	if (name.empty())
+		return parent;
+	node = parent->getNode(FilesystemPath(name.c_str()));
+	m_dentries.insert(path.str(), *node);
+	return node;
+}
+
+void MtpFuseContext::forgetPath(const FilesystemPath& path)
+{
+	m_dentries.remove(path.str());
+}
+
+void MtpFuseContext::forgetTree(const FilesystemPath& path)
+{
+	m_dentries.removeTree(path.str());
 }
 
 uid_t MtpFuseContext::uid() const
@@ -48,3 +119,8 @@ gid_t MtpFuseContext::gid() const
 {
 	return m_gid;
 }
+
+RecursiveMutex& MtpFuseContext::modifyLock()
+{
+	return m_modifyLock;
+}
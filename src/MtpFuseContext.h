@@ -24,6 +24,9 @@
 
 #include "MtpDevice.h"
 #include "MtpMetadataCache.h"
+#include "MtpMetadataIndex.h"
+#include "MtpContentCache.h"
+#include "MtpDentryCache.h"
 #include "MtpNode.h"
 #include <memory>
 #include <sys/types.h>
@@ -31,18 +34,34 @@
 class MtpFuseContext
 {
 public:
-	MtpFuseContext(std::unique_ptr<MtpDevice> device,  uid_t uid, gid_t gid);
+	MtpFuseContext(std::unique_ptr<MtpDevice> device,  uid_t uid, gid_t gid, const MtpCacheSettings& cacheSettings,
+			const std::string& indexDirectory);
+	~MtpFuseContext();
 
 	std::unique_ptr<MtpNode> getNode(const FilesystemPath& path);
 
+	// Must be called when what a path refers to changes
+	void forgetPath(const FilesystemPath& path);
+	void forgetTree(const FilesystemPath& path);
+
 	uid_t uid() const;
 	gid_t gid() const;
 
+	// Operations that change the structure of the filesystem (mkdir, create, unlink, rename, etc) are made
+	// up of several device operations and cache invalidations that have to be kept together, so they are
+	// still serialized with this lock. Everything else only relies on the locking in the metadata cache and
+	// the device command queue, so a getattr that hits the cache doesn't have to wait behind a long transfer.
+	RecursiveMutex& modifyLock();
+
 protected:
 	uid_t						m_uid;
 	gid_t						m_gid;
 	std::unique_ptr<MtpDevice>	m_device;
+	std::unique_ptr<MtpMetadataIndex>	m_index;
+	std::unique_ptr<MtpContentCache>	m_contentCache;
 	MtpMetadataCache 		  	m_cache;
+	MtpDentryCache				m_dentries;
+	RecursiveMutex				m_modifyLock;
 };
 
 
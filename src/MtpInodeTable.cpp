@@ -0,0 +1,91 @@
+/*
+ * MtpInodeTable.cpp
+ *
+ * This software is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 3 as published by the Free Software Foundation.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02111-1301, USA.
+ * licensing@fsf.org
+ */
+#include "MtpInodeTable.h"
+#include "mtpFilesystemErrors.h"
+#include "MtpStats.h"
+
+#include <sstream>
+
+MtpInodeTable::MtpInodeTable(std::unique_ptr<MtpNode> root) : m_mutex(MtpStats::LockInodeTable)
+{
+	// The root is never forgotten
+	Entry& entry = m_inodes[MTP_ROOT_INODE];
+	entry.node = std::move(root);
+	entry.lookups = 1;
+}
+
+std::unique_ptr<MtpNode> MtpInodeTable::getNode(uint64_t inode)
+{
+	LockMutex lock(m_mutex);
+
+	inode_map_type::iterator i = m_inodes.find(inode);
+	if (i == m_inodes.end())
+	{
+		std::ostringstream name;
+		name << "inode " << inode;
+		throw FileNotFound(name.str());
+	}
+	return i->second.node->Clone();
+}
+
+void MtpInodeTable::add(uint64_t inode, MtpNode& node)
+{
+	std::unique_ptr<MtpNode> copy(node.Clone());
+
+	LockMutex lock(m_mutex);
+
+	inode_map_type::iterator i = m_inodes.find(inode);
+	if (i == m_inodes.end())
+	{
+		Entry& entry = m_inodes[inode];
+		entry.node = std::move(copy);
+		entry.lookups = 1;
+	}
+	else
+	{
+		i->second.node = std::move(copy);
+		i->second.lookups++;
+	}
+}
+
+void MtpInodeTable::replace(uint64_t inode, MtpNode& node)
+{
+	std::unique_ptr<MtpNode> copy(node.Clone());
+
+	LockMutex lock(m_mutex);
+
+	inode_map_type::iterator i = m_inodes.find(inode);
+	if (i != m_inodes.end())
+		i->second.node = std::move(copy);
+}
+
+void MtpInodeTable::forget(uint64_t inode, uint64_t lookups)
+{
+	LockMutex lock(m_mutex);
+
+	if (inode == MTP_ROOT_INODE)
+		return;
+	inode_map_type::iterator i = m_inodes.find(inode);
+	if (i == m_inodes.end())
+		return;
+	if (i->second.lookups <= lookups)
+		m_inodes.erase(i);
+	else
+		i->second.lookups -= lookups;
+}
@@ -0,0 +1,64 @@
+/*
+ * MtpInodeTable.h
+ *
+ * This software is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 3 as published by the Free Software Foundation.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02111-1301, USA.
+ * licensing@fsf.org
+ */
+
+#ifndef MTPINODETABLE_H_
+#define MTPINODETABLE_H_
+
+#include "MtpNode.h"
+#include "Mutex.h"
+
+#include <memory>
+#include <unordered_map>
+
+/*
+ * The nodes the kernel currently knows about by inode number, for the
+ * low level FUSE interface. An inode is added (or its lookup count raised)
+ * each time it's handed to the kernel, and removed when the kernel forgets
+ * it as many times. A node is kept rather than just its ids so it can be
+ * replaced when the object behind an inode changes, for example when a
+ * file that has been written to gets sent back to the device under a new
+ * object id.
+ */
+class MtpInodeTable
+{
+public:
+	MtpInodeTable(std::unique_ptr<MtpNode> root);
+
+	// Throws FileNotFound if the kernel has already forgotten the inode
+	std::unique_ptr<MtpNode> getNode(uint64_t inode);
+
+	void add(uint64_t inode, MtpNode& node);
+	void replace(uint64_t inode, MtpNode& node);
+	void forget(uint64_t inode, uint64_t lookups);
+
+private:
+	struct Entry
+	{
+		std::unique_ptr<MtpNode>	node;
+		uint64_t					lookups;
+	};
+
+	typedef std::unordered_map<uint64_t, Entry> inode_map_type;
+
+	RecursiveMutex	m_mutex;
+	inode_map_type	m_inodes;
+};
+
+
+#endif /* MTPINODETABLE_H_ */
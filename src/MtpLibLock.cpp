@@ -19,7 +19,8 @@
  * licensing@fsf.org
  */
 #include "MtpLibLock.h"
-RecursiveMutex MtpLibLock::m_mutex;
+#include "MtpStats.h"
+RecursiveMutex MtpLibLock::m_mutex(MtpStats::LockLibmtp);
 
 MtpLibLock::MtpLibLock()
 {
@@ -0,0 +1,286 @@
+/*
+ * MtpLibmtpDevice.cpp
+ *
+ * This software is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 3 as published by the Free Software Foundation.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02111-1301, USA.
+ * licensing@fsf.org
+ */
+#include "MtpLibmtpDevice.h"
+#include "MtpLibLock.h"
+#include "MtpStats.h"
+#include <stdlib.h>
+
+namespace
+{
+
+// Throughput samples for the timeline, taken from libmtp's progress callbacks
+struct TransferProgress
+{
+	TransferProgress(const char* n, const std::atomic<bool>* c = 0) :
+		name(n), cancel(c), lastTime(MtpStats::NowMicroseconds()), lastBytes(0) {}
+
+	const char*					name;
+	const std::atomic<bool>*	cancel;
+	uint64_t					lastTime;
+	uint64_t					lastBytes;
+};
+
+int transferProgress(uint64_t const sent, uint64_t const total, void const * const data)
+{
+	TransferProgress& progress = *(TransferProgress*) data;
+	// Non zero makes libmtp abort the transfer
+	if (progress.cancel && *progress.cancel)
+		return 1;
+	if (!MtpTimeline::Enabled())
+		return 0;
+	uint64_t now = MtpStats::NowMicroseconds();
+	// libmtp calls back for every USB packet, which is more often than is useful
+	if ((now - progress.lastTime >= 10000) || (sent == total))
+	{
+		if (now > progress.lastTime)
+			MtpTimeline::Counter(progress.name, "KB/s", (sent - progress.lastBytes) * 1000 / (now - progress.lastTime));
+		progress.lastTime = now;
+		progress.lastBytes = sent;
+	}
+	return 0;
+}
+
+}
+
+MtpLibmtpDevice::MtpLibmtpDevice(LIBMTP_raw_device_t& rawDevice)
+{
+MtpLibLock	lock;
+
+	m_mtpdevice = LIBMTP_Open_Raw_Device_Uncached(&rawDevice);
+	if (m_mtpdevice == 0)
+		throw MtpErrorCantOpenDevice();
+	m_busLocation = rawDevice.bus_location;
+	m_devnum = rawDevice.devnum;
+	LIBMTP_Clear_Errorstack(m_mtpdevice);
+	m_supportsPartialObject = LIBMTP_Check_Capability(m_mtpdevice, LIBMTP_DEVICECAP_GetPartialObject) != 0;
+	m_supportsEditObjects = LIBMTP_Check_Capability(m_mtpdevice, LIBMTP_DEVICECAP_EditObjects) != 0;
+}
+
+MtpLibmtpDevice::~MtpLibmtpDevice()
+{
+MtpLibLock	lock;
+MtpDeviceCommand command(m_queue, MtpDeviceQueue::Metadata);
+
+	LIBMTP_Release_Device(m_mtpdevice);
+}
+
+std::string MtpLibmtpDevice::DoGetModelname()
+{
+	char* fn = LIBMTP_Get_Modelname(m_mtpdevice);
+	if (fn)
+	{
+		std::string result(fn);
+		free(fn);
+		return result;
+	}
+	else
+	{
+		CheckErrors(false);
+		return "";
+	}
+}
+
+std::string MtpLibmtpDevice::DoGetSerialnumber()
+{
+	char* serial = LIBMTP_Get_Serialnumber(m_mtpdevice);
+	if (serial)
+	{
+		std::string result(serial);
+		free(serial);
+		return result;
+	}
+	else
+	{
+		CheckErrors(false);
+		return "";
+	}
+}
+
+std::vector<MtpStorageInfo> MtpLibmtpDevice::DoGetStorageDevices()
+{
+	if (LIBMTP_Get_Storage(m_mtpdevice, LIBMTP_STORAGE_SORTBY_NOTSORTED))
+	{
+		CheckErrors(true);
+	}
+
+	LIBMTP_devicestorage_t* storage = m_mtpdevice->storage;
+	std::vector<MtpStorageInfo> result;
+	while(storage)
+	{
+		result.push_back(MtpStorageInfo(storage->id, storage->StorageDescription,
+				storage->FreeSpaceInBytes, storage->MaxCapacity));
+		storage = storage->next;
+	}
+	return result;
+
+}
+
+std::vector<MtpFileInfo> MtpLibmtpDevice::DoGetFolderContents(uint32_t storageId, uint32_t folderId)
+{
+	std::vector<MtpFileInfo> result;
+	LIBMTP_file_t* files = LIBMTP_Get_Files_And_Folders(m_mtpdevice, storageId, folderId);
+	if (files == 0)
+	{
+		CheckErrors(false);
+		return result;
+	}
+	LIBMTP_file_t* filesWalk = files;
+	while(filesWalk)
+	{
+		result.push_back(MtpFileInfo(*filesWalk));
+		filesWalk = filesWalk->next;
+	}
+	if (files)
+		LIBMTP_destroy_file_t(files);
+	return result;
+}
+
+MtpFileInfo MtpLibmtpDevice::DoGetFileInfo(uint32_t id)
+{
+	LIBMTP_file_t* fileInfoP = LIBMTP_Get_Filemetadata(m_mtpdevice, id);
+	if (fileInfoP==0)
+	{
+		CheckErrors(true);
+	}
+	MtpFileInfo fileInfo(*fileInfoP);
+	LIBMTP_destroy_file_t(fileInfoP);
+	return fileInfo;
+
+}
+
+void MtpLibmtpDevice::DoGetFile(uint32_t id, int fd)
+{
+	TransferProgress progress("GetFile throughput");
+	if (LIBMTP_Get_File_To_File_Descriptor(m_mtpdevice, id, fd,
+			MtpTimeline::Enabled() ? transferProgress : 0, &progress))
+		CheckErrors(true);
+}
+
+size_t MtpLibmtpDevice::DoGetPartialObject(uint32_t id, uint64_t offset, uint32_t maxBytes, void* buffer)
+{
+	// libmtp picks GetPartialObject64 by itself when the device offers it, so
+	// offsets past 4GB work on devices that support them.
+	unsigned char* data = 0;
+	unsigned int size = 0;
+	if (LIBMTP_GetPartialObject(m_mtpdevice, id, offset, maxBytes, &data, &size))
+	{
+		free(data);
+		CheckErrors(true);
+	}
+	if (size > maxBytes)
+		size = maxBytes;
+	if (size)
+		memcpy(buffer, data, size);
+	free(data);
+	return size;
+}
+
+void MtpLibmtpDevice::DoSendFile(LIBMTP_file_t* destination, int fd)
+{
+	TransferProgress progress("SendFile throughput");
+	if (LIBMTP_Send_File_From_File_Descriptor(m_mtpdevice, fd, destination,
+			MtpTimeline::Enabled() ? transferProgress : 0, &progress))
+		CheckErrors(true);
+}
+
+void MtpLibmtpDevice::DoSendStream(LIBMTP_file_t* destination, int fd, const std::atomic<bool>& cancel)
+{
+	// libmtp reads the descriptor front to back, so a pipe works as long as the
+	// writer keeps it fed. The callback is also how the transfer gets cancelled.
+	TransferProgress progress("SendStream throughput", &cancel);
+	if (LIBMTP_Send_File_From_File_Descriptor(m_mtpdevice, fd, destination, transferProgress, &progress))
+		CheckErrors(true);
+}
+
+void MtpLibmtpDevice::DoBeginEditObject(uint32_t id)
+{
+	if (LIBMTP_BeginEditObject(m_mtpdevice, id))
+		CheckErrors(true);
+}
+
+void MtpLibmtpDevice::DoSendPartialObject(uint32_t id, uint64_t offset, const unsigned char* data, uint32_t size)
+{
+	if (LIBMTP_SendPartialObject(m_mtpdevice, id, offset, (unsigned char*) data, size))
+		CheckErrors(true);
+}
+
+void MtpLibmtpDevice::DoTruncateObject(uint32_t id, uint64_t size)
+{
+	if (LIBMTP_TruncateObject(m_mtpdevice, id, size))
+		CheckErrors(true);
+}
+
+void MtpLibmtpDevice::DoEndEditObject(uint32_t id)
+{
+	if (LIBMTP_EndEditObject(m_mtpdevice, id))
+		CheckErrors(true);
+}
+
+void MtpLibmtpDevice::DoCreateFolder(const std::string& name, uint32_t parentId, uint32_t storageId)
+{
+	if (LIBMTP_Create_Folder(m_mtpdevice, (char*) name.c_str(), parentId, storageId)==0)
+		CheckErrors(true);
+}
+
+void MtpLibmtpDevice::CheckErrors(bool throwEvenWithNoError)
+{
+	LIBMTP_error_t* errors = LIBMTP_Get_Errorstack(m_mtpdevice);
+	if (errors)
+	{
+		LIBMTP_error_number_t errorCode = errors->errornumber;
+		std::string errorText(errors->error_text);
+		LIBMTP_Clear_Errorstack(m_mtpdevice);
+		switch(errorCode)
+		{
+		case LIBMTP_ERROR_NO_DEVICE_ATTACHED:
+			throw MtpDeviceDisconnected(errorText);
+		default:
+			throw MtpError(errorText, errorCode);
+		}
+
+	}
+	LIBMTP_Clear_Errorstack(m_mtpdevice);
+	if (throwEvenWithNoError)
+		throw ExpectedMtpErrorNotFound();
+}
+
+void MtpLibmtpDevice::DoDeleteObject(uint32_t id)
+{
+	if (LIBMTP_Delete_Object(m_mtpdevice, id))
+		CheckErrors(true);
+}
+
+void MtpLibmtpDevice::DoRenameFile(uint32_t id, const std::string& newName)
+{
+	LIBMTP_file_t* fileInfo = LIBMTP_Get_Filemetadata(m_mtpdevice, id);
+	if (fileInfo==0)
+	{
+		CheckErrors(true);
+	}
+	int result = LIBMTP_Set_File_Name(m_mtpdevice, fileInfo, newName.c_str());
+	LIBMTP_destroy_file_t(fileInfo);
+	if (result)
+		CheckErrors(true);
+}
+
+void MtpLibmtpDevice::DoSetObjectProperty(uint32_t id, LIBMTP_property_t property, const std::string& value)
+{
+	if (LIBMTP_Set_Object_String(m_mtpdevice, id, property, value.c_str()))
+		CheckErrors(true);
+}
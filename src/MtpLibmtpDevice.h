@@ -0,0 +1,59 @@
+/*
+ * MtpLibmtpDevice.h
+ *
+ * This software is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 3 as published by the Free Software Foundation.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02111-1301, USA.
+ * licensing@fsf.org
+ */
+
+#ifndef MTPLIBMTPDEVICE_H_
+#define MTPLIBMTPDEVICE_H_
+
+#include "MtpDevice.h"
+
+// A real device, accessed through libmtp
+class MtpLibmtpDevice : public MtpDevice
+{
+public:
+	MtpLibmtpDevice(LIBMTP_raw_device_t& rawDevice);
+	~MtpLibmtpDevice();
+
+protected:
+	std::string DoGetModelname();
+	std::string DoGetSerialnumber();
+	std::vector<MtpStorageInfo> DoGetStorageDevices();
+	std::vector<MtpFileInfo> DoGetFolderContents(uint32_t storageId, uint32_t folderId);
+	MtpFileInfo DoGetFileInfo(uint32_t id);
+	void DoGetFile(uint32_t id, int fd);
+	size_t DoGetPartialObject(uint32_t id, uint64_t offset, uint32_t maxBytes, void* buffer);
+	void DoSendFile(LIBMTP_file_t* destination, int fd);
+	void DoSendStream(LIBMTP_file_t* destination, int fd, const std::atomic<bool>& cancel);
+	void DoBeginEditObject(uint32_t id);
+	void DoSendPartialObject(uint32_t id, uint64_t offset, const unsigned char* data, uint32_t size);
+	void DoTruncateObject(uint32_t id, uint64_t size);
+	void DoEndEditObject(uint32_t id);
+	void DoCreateFolder(const std::string& name, uint32_t parentId, uint32_t storageId);
+	void DoDeleteObject(uint32_t id);
+	void DoRenameFile(uint32_t id, const std::string& newName);
+	void DoSetObjectProperty(uint32_t id, LIBMTP_property_t property, const std::string& value);
+
+	void CheckErrors(bool throwEvenIfNoError);
+
+	LIBMTP_mtpdevice_t* m_mtpdevice;
+	uint32_t		m_busLocation;
+	uint8_t			m_devnum;
+};
+
+
+#endif /* MTPLIBMTPDEVICE_H_ */
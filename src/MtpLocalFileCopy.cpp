@@ -20,112 +20,587 @@
  */
 #include "MtpLocalFileCopy.h"
 #include "mtpFilesystemErrors.h"
+#include "MtpStats.h"
 #include <sys/stat.h>
-#include <iostream>
 #include <unistd.h>
+#include <errno.h>
+#include <algorithm>
+#include <vector>
 
-MtpLocalFileCopy::MtpLocalFileCopy(MtpDevice& device, uint32_t id) :
-	m_device(device), m_remoteId(id), m_needWriteBack(false)
+// A transfer reads the copy through a descriptor of its own, which stays
+// on the same file if the staging area moves the copy to disk meanwhile.
+class TransferDescriptor
 {
-	m_localFile = tmpfile();
-	if (m_localFile == 0)
-		throw CantCreateTempFile(errno);
-	m_device.GetFile(m_remoteId, fileno(m_localFile));
+public:
+	TransferDescriptor(int fd) : m_fd(dup(fd))
+	{
+		if (m_fd < 0)
+			throw ReadError(errno);
+	}
+	~TransferDescriptor() { close(m_fd); }
+
+	int fd() { return m_fd; }
+
+private:
+	TransferDescriptor(const TransferDescriptor&);
+	TransferDescriptor& operator=(const TransferDescriptor&);
+
+	int	m_fd;
+};
+
+const uint32_t MtpLocalFileCopy::FetchBytes;
+
+static void WriteAll(int fd, const char* ptr, size_t size, off_t offset)
+{
+	while(size)
+	{
+		ssize_t result = pwrite(fd, ptr, size, offset);
+		if ((result < 0) && (errno == EINTR))
+			continue;
+		if (result <= 0)
+			throw WriteError(result < 0 ? errno : EIO);
+		ptr += result;
+		size -= result;
+		offset += result;
+	}
+}
+
+MtpLocalFileCopy::MtpLocalFileCopy(MtpDevice& device, MtpStagingArea& staging, const MtpFileInfo& remoteInfo,
+		bool remoteExists, MtpContentCache* contentCache) :
+	m_transferMutex(MtpStats::LockLocalFileTransfer), m_mutex(MtpStats::LockLocalFile), m_device(device), m_info(remoteInfo), m_sentInfo(remoteInfo),
+	m_remoteId(remoteInfo.id), m_remoteSize(remoteInfo.filesize), m_remoteExists(remoteExists),
+	m_needWriteBack(!remoteExists), m_generation(0), m_sending(false)
+{
+	m_staged = staging.create(m_remoteExists ? m_info.filesize : 0);
+	// Newly created files are empty, so there is nothing to fetch
+	if (!m_remoteExists || (m_info.filesize == 0))
+		return;
+	MtpTimelineSpan span("cache", "local copy fill");
+	if (contentCache && contentCache->fetch(m_info, m_staged->fd()))
+		return;
+	// Only what is read has to be fetched, and only what is written sent.
+	// The content cache wants whole files, so it still gets one.
+	if (!contentCache && m_device.SupportsEditObjects() && m_device.SupportsPartialObject())
+	{
+		if (ftruncate(m_staged->fd(), m_info.filesize))
+			throw WriteError(errno);
+		m_missing.add(0, m_info.filesize);
+		return;
+	}
+	m_device.GetFile(m_remoteId, m_staged->fd());
+	if (contentCache)
+		contentCache->store(m_info, m_staged->fd());
 
 }
 
 MtpLocalFileCopy::~MtpLocalFileCopy()
 {
-	close();
+	try
+	{
+		close();
+	}
+	catch(std::exception&)
+	{
+		// Nobody is left to tell
+	}
 }
 
+// Holds m_mutex, and m_transferMutex as well if there is a streaming upload.
+// m_upload is only fed, finished or dropped with m_transferMutex held, so
+// once m_mutex has been let go it stays put until this is destroyed.
+class MtpLocalFileCopy::UploadLock
+{
+public:
+	UploadLock(MtpLocalFileCopy& copy) : m_lock(new LockMutex(copy.m_mutex))
+	{
+		if (copy.m_upload)
+		{
+			// m_transferMutex has to be taken first
+			m_lock.reset();
+			m_transferLock.reset(new LockMutex(copy.m_transferMutex));
+			m_lock.reset(new LockMutex(copy.m_mutex));
+		}
+	}
+
+	void unlock()
+	{
+		m_lock.reset();
+	}
+
+private:
+	std::unique_ptr<LockMutex>	m_transferLock;
+	std::unique_ptr<LockMutex>	m_lock;
+};
+
+bool MtpLocalFileCopy::sync()
+{
+	LockMutex transferLock(m_transferMutex);
+
+	bool sent = finishUpload();
+	WriteBackState state;
+	{
+		LockMutex lock(m_mutex);
+
+		// Discarded while it was waiting to be sent
+		if (!m_staged)
+			return false;
+		if (!m_needWriteBack)
+			return sent;
+		rewind();
+		state.fd = m_staged->fd();
+		state.size = localSize();
+		state.changed = m_changed;
+		state.generation = m_generation;
+		state.remoteId = m_remoteId;
+		state.remoteSize = m_remoteSize;
+		state.remoteExists = m_remoteExists;
+		state.sentInfo = m_sentInfo;
+		m_sending = true;
+	}
+
+	try
+	{
+		TransferDescriptor descriptor(state.fd);
+		state.fd = descriptor.fd();
+		writeBack(state);
+	}
+	catch(...)
+	{
+		LockMutex lock(m_mutex);
+		wroteBack(state, false);
+		throw;
+	}
+	LockMutex lock(m_mutex);
+	wroteBack(state, true);
+	return true;
+}
+
+bool MtpLocalFileCopy::needsSync()
+{
+	LockMutex lock(m_mutex);
+
+	return m_needWriteBack || m_upload;
+}
+
+uint32_t MtpLocalFileCopy::remoteId()
+{
+	LockMutex lock(m_mutex);
+
+	return m_remoteId;
+}
 
 uint32_t MtpLocalFileCopy::close()
 {
-	if (m_localFile)
+	LockMutex transferLock(m_transferMutex);
+
+	try
+	{
+		sync();
+	}
+	catch(...)
+	{
+		LockMutex lock(m_mutex);
+		closeLocal();
+		throw;
+	}
+	LockMutex lock(m_mutex);
+	closeLocal();
+	return m_remoteId;
+}
+
+void MtpLocalFileCopy::closeLocal()
+{
+	m_staged.reset();
+}
+
+// Waits for the device to take the streaming upload, if there is one,
+// which is done without m_mutex. Returns whether it sent the file.
+bool MtpLocalFileCopy::finishUpload()
+{
+	bool complete;
+	{
+		LockMutex lock(m_mutex);
+
+		if (!m_staged || !m_upload)
+			return false;
+		complete = (m_upload->written() == m_upload->size()) && ((uint64_t) localSize() == m_upload->size());
+	}
+	if (!complete)
+	{
+		cancelUpload();
+		return false;
+	}
+	uint32_t id;
+	try
+	{
+		id = m_upload->finish();
+	}
+	catch(std::exception&)
+	{
+		// Fall back to sending the local copy
+		LockMutex lock(m_mutex);
+		endUpload();
+		return false;
+	}
+	LockMutex lock(m_mutex);
+	m_remoteId = id;
+	m_remoteExists = true;
+	m_remoteSize = m_upload->size();
+	m_needWriteBack = false;
+	m_changed.clear();
+	m_sentInfo.id = m_remoteId;
+	m_sentInfo.filesize = m_remoteSize;
+	m_sentInfo.modificationdate = time(0);
+	m_upload.reset();
+	return true;
+}
+
+// Once the upload has finished or been cancelled
+void MtpLocalFileCopy::endUpload()
+{
+	// It may not have got as far as deleting the file it was replacing
+	if (m_upload->replacing())
+		m_remoteExists = true;
+	m_upload.reset();
+}
+
+bool MtpLocalFileCopy::discard()
+{
+	// If it is being sent, what is on the device afterwards is what goes
+	LockMutex transferLock(m_transferMutex);
+	{
+		LockMutex lock(m_mutex);
+
+		m_needWriteBack = false;
+		closeLocal();
+		if (!m_upload)
+			return m_remoteExists;
+	}
+	m_upload->cancel();
+	LockMutex lock(m_mutex);
+	endUpload();
+	return m_remoteExists;
+}
+
+// Runs without m_mutex, so only looks at state
+void MtpLocalFileCopy::writeBack(WriteBackState& state)
+{
+	MtpTimelineSpan span("cache", "local copy write back");
+	if (state.remoteExists && m_device.SupportsEditObjects())
 	{
-		if (m_needWriteBack)
+		// Only the parts that changed need to go to the device
+		try
+		{
+			m_device.EditObject(state.remoteId, state.fd, state.changed, state.size,
+					(uint64_t) state.size != state.remoteSize);
+			state.remoteSize = state.size;
+			state.sentInfo.filesize = state.size;
+			state.sentInfo.modificationdate = time(0);
+			return;
+		}
+		catch(MtpDeviceDisconnected&)
+		{
+			throw;
+		}
+		catch(MtpError&)
 		{
-			m_needWriteBack = false;
-			try
-			{
-				fflush(m_localFile);
-				if (fseek(m_localFile, 0, SEEK_SET))
-					throw WriteError(errno);
-				struct stat tempInfo;
-				if (fstat(fileno(m_localFile), &tempInfo))
-					throw ReadError(errno);
-				MtpFileInfo remoteInfo = m_device.GetFileInfo(m_remoteId);
-				NewLIBMTPFile newFile(remoteInfo.name, remoteInfo.parentId, remoteInfo.storageId, tempInfo.st_size);
-				m_device.DeleteObject(m_remoteId);
-				std::cout << "************ sending file" << std::endl;
-				m_device.SendFile(newFile, fileno(m_localFile));
-				m_remoteId = ((LIBMTP_file_t*)newFile)->item_id;
-			}
-			catch(...)
-			{
-				fclose(m_localFile);
-				m_localFile=0;
-				throw;
-			}
+			// Replace the whole file instead
 		}
+	}
+	// Replacing the file sends all of it, so it all has to be here
+	fetch(0, state.size);
+	MtpFileInfo remoteInfo = state.remoteExists ? m_device.GetFileInfo(state.remoteId) : m_info;
+	NewLIBMTPFile newFile(remoteInfo.name, remoteInfo.parentId, remoteInfo.storageId, state.size);
+	if (state.remoteExists)
+	{
+		m_device.DeleteObject(state.remoteId);
+		state.remoteExists = false;
+	}
+	m_device.SendFile(newFile, state.fd);
+	state.remoteId = ((LIBMTP_file_t*)newFile)->item_id;
+	state.remoteExists = true;
+	state.remoteSize = state.size;
+	state.sentInfo = MtpFileInfo(*(LIBMTP_file_t*)newFile);
+	state.sentInfo.modificationdate = time(0);
+}
 
-		fclose(m_localFile);
-		m_localFile = 0;
+void MtpLocalFileCopy::wroteBack(const WriteBackState& state, bool sent)
+{
+	m_sending = false;
+	// Even a failed transfer may have deleted the old object
+	m_remoteId = state.remoteId;
+	m_remoteExists = state.remoteExists;
+	m_remoteSize = state.remoteSize;
+	if (!sent)
+		return;
+	m_sentInfo = state.sentInfo;
+	// Anything written while it was being sent still has to go, along
+	// with what was sent, which may have been caught half changed.
+	if (m_generation == state.generation)
+	{
+		m_needWriteBack = false;
+		m_changed.clear();
 	}
-	return m_remoteId;
+}
+
+bool MtpLocalFileCopy::startUpload(off_t size)
+{
+	LockMutex lock(m_mutex);
+
+	checkOpen();
+	if (m_upload || m_sending || (size <= 0) || (localSize() != 0))
+		return false;
+	m_staged->resize(size);
+	if (ftruncate(m_staged->fd(), size))
+		throw WriteError(errno);
+	// The upload deletes the empty file it replaces once it starts, so
+	// that doesn't happen here with the copy and the caller's locks held.
+	// Until then the copy is what gets listed.
+	m_upload.reset(new MtpStreamingUpload(m_device, m_info.name, m_info.parentId, m_info.storageId, size,
+			m_remoteExists ? m_remoteId : 0));
+	m_remoteExists = false;
+	m_needWriteBack = true;
+	m_generation++;
+	return true;
+}
+
+// With m_transferMutex held but not m_mutex, as cancelling waits for the device
+void MtpLocalFileCopy::cancelUpload()
+{
+	// The local copy has everything, so it gets sent at close instead
+	m_upload->cancel();
+	LockMutex lock(m_mutex);
+	endUpload();
+	m_needWriteBack = true;
+	m_generation++;
+}
+
+// Sends what was just written on to the streaming upload, if there is one,
+// or gives up on the upload if the write doesn't carry on from where it
+// is. Lets go of m_mutex first, since sending can block.
+void MtpLocalFileCopy::passOn(UploadLock& lock, const void* ptr, size_t size, off_t offset, size_t wroteBytes)
+{
+	if (!m_upload)
+		return;
+	bool next = (wroteBytes == size) && ((uint64_t) offset == m_upload->written()) &&
+			(m_upload->written() + size <= m_upload->size());
+	lock.unlock();
+	if (!next || !m_upload->write(ptr, size))
+		cancelUpload();
 }
 
 off_t MtpLocalFileCopy::getSize()
 {
-	fflush(m_localFile);
+	LockMutex lock(m_mutex);
+
+	checkOpen();
+	return localSize();
+}
+
+off_t MtpLocalFileCopy::localSize()
+{
 	struct stat tempInfo;
-	if (fstat(fileno(m_localFile), &tempInfo))
-			throw ReadError(errno);
+	if (fstat(m_staged->fd(), &tempInfo))
+		throw ReadError(errno);
 	return tempInfo.st_size;
 }
 
-void MtpLocalFileCopy::seek(long offset)
+void MtpLocalFileCopy::checkOpen()
 {
-	if (fseek(m_localFile, offset, SEEK_SET))
+	if (!m_staged)
+		throw MtpFilesystemErrorWithErrorCode(EBADF, "local copy already closed");
+}
+
+// The device calls read and write the descriptor from where it is
+void MtpLocalFileCopy::rewind()
+{
+	if (lseek(m_staged->fd(), 0, SEEK_SET) < 0)
 		throw MtpFilesystemErrorWithErrorCode(errno, "seek failed");
 }
 
-size_t MtpLocalFileCopy::write(const void* ptr, size_t size)
+size_t MtpLocalFileCopy::write(const void* ptr, size_t size, off_t offset)
 {
-	size_t wroteBytes = fwrite(ptr, 1, size, m_localFile);
-	m_needWriteBack = true;
-	if (wroteBytes!= size)
-		if (ferror(m_localFile))
-			throw WriteError(errno);
+	UploadLock lock(*this);
+
+	checkOpen();
+	if (offset + size > m_staged->size())
+		m_staged->resize(offset + size);
+	size_t wroteBytes = 0;
+	while(wroteBytes < size)
+	{
+		ssize_t result = pwrite(m_staged->fd(), (const char*) ptr + wroteBytes, size - wroteBytes,
+				offset + wroteBytes);
+		if ((result < 0) && (errno == EINTR))
+			continue;
+		if (result <= 0)
+		{
+			int error = errno;
+			wrote(offset, wroteBytes);
+			passOn(lock, ptr, size, offset, wroteBytes);
+			throw WriteError(result < 0 ? error : EIO);
+		}
+		wroteBytes += result;
+	}
+	wrote(offset, wroteBytes);
+	passOn(lock, ptr, size, offset, wroteBytes);
 	return wroteBytes;
 }
 
-size_t MtpLocalFileCopy::read(void* ptr, size_t size)
+size_t MtpLocalFileCopy::writeWith(size_t size, off_t offset, const transfer_type& transfer)
 {
+	UploadLock lock(*this);
 
-	size_t readBytes = fread(ptr, 1, size, m_localFile);
-	if (readBytes!= size)
-		if (ferror(m_localFile))
+	checkOpen();
+	if (offset + size > m_staged->size())
+		m_staged->resize(offset + size);
+	size_t wroteBytes = transfer(m_staged->fd(), size);
+	wrote(offset, wroteBytes);
+	if (!m_upload)
+		return wroteBytes;
+	// The upload needs the data too, which the page cache still has
+	std::vector<char> data(wroteBytes);
+	passOn(lock, data.data(), size, offset, readLocal(data.data(), wroteBytes, offset));
+	return wroteBytes;
+}
+
+void MtpLocalFileCopy::wrote(off_t offset, size_t wroteBytes)
+{
+	m_needWriteBack = true;
+	m_generation++;
+	m_changed.add(offset, offset + wroteBytes);
+	m_missing.remove(offset, offset + wroteBytes);
+}
+
+size_t MtpLocalFileCopy::read(void* ptr, size_t size, off_t offset)
+{
+	fetch(offset, offset + size);
+
+	LockMutex lock(m_mutex);
+
+	checkOpen();
+	return readLocal(ptr, size, offset);
+}
+
+size_t MtpLocalFileCopy::readLocal(void* ptr, size_t size, off_t offset)
+{
+	size_t readBytes = 0;
+	while(readBytes < size)
+	{
+		ssize_t result = pread(m_staged->fd(), (char*) ptr + readBytes, size - readBytes, offset + readBytes);
+		if ((result < 0) && (errno == EINTR))
+			continue;
+		if (result < 0)
 			throw ReadError(errno);
+		if (result == 0)
+			break;
+		readBytes += result;
+	}
 	return readBytes;
 }
 
+size_t MtpLocalFileCopy::readWith(size_t size, off_t offset, const transfer_type& transfer)
+{
+	fetch(offset, offset + size);
+
+	LockMutex lock(m_mutex);
+
+	checkOpen();
+	off_t fileSize = localSize();
+	if (offset >= fileSize)
+		return 0;
+	return transfer(m_staged->fd(), std::min<uint64_t>(size, fileSize - offset));
+}
+
 void MtpLocalFileCopy::truncate(off_t length)
 {
-	if (ftruncate(fileno(m_localFile), length))
+	UploadLock lock(*this);
+
+	checkOpen();
+	off_t oldSize = localSize();
+	m_staged->resize(length);
+	if (ftruncate(m_staged->fd(), length))
 		throw WriteError(errno);
 	m_needWriteBack = true;
+	m_generation++;
+	m_changed.clip(length);
+	m_missing.clip(length);
+	// Growing the file again after shrinking it has to clear whatever the
+	// device still has in between. What is on the device isn't known yet
+	// while it is being sent.
+	if (m_sending && (length > oldSize))
+		m_changed.add(oldSize, length);
+	else if ((length > oldSize) && ((uint64_t) oldSize < m_remoteSize))
+		m_changed.add(oldSize, std::min<uint64_t>(length, m_remoteSize));
+	if (m_upload)
+	{
+		lock.unlock();
+		cancelUpload();
+	}
+}
+
+// Fills in what of start to end is still only on the device. The device
+// is used without m_mutex, which mustn't be held by the caller.
+void MtpLocalFileCopy::fetch(uint64_t start, uint64_t end)
+{
+	// Usually there is nothing to fetch, which shouldn't wait for a transfer
+	{
+		LockMutex lock(m_mutex);
+
+		checkOpen();
+		if (m_missing.within(start, end).empty())
+			return;
+	}
+
+	LockMutex transferLock(m_transferMutex);
+
+	MtpByteRanges wanted;
+	uint32_t id;
+	{
+		LockMutex lock(m_mutex);
+
+		checkOpen();
+		wanted = m_missing.within(start, end);
+		id = m_remoteId;
+	}
+	MtpTimelineSpan span("cache", "local copy fetch", "bytes");
+	span.setArg(wanted.bytes());
+	std::vector<char> data;
+	for(MtpByteRanges::range_map_type::const_iterator r = wanted.ranges().begin(); r != wanted.ranges().end(); r++)
+	{
+		uint64_t offset = r->first;
+		while(offset < r->second)
+		{
+			data.resize(std::min<uint64_t>(r->second - offset, FetchBytes));
+			size_t got = m_device.GetPartialObject(id, offset, data.size(), &data[0]);
+			if (got == 0)
+				throw ReadError(EIO);
+
+			LockMutex lock(m_mutex);
+
+			checkOpen();
+			// Anything written meanwhile is newer than what the device has
+			MtpByteRanges fill = m_missing.within(offset, offset + got);
+			for(MtpByteRanges::range_map_type::const_iterator f = fill.ranges().begin(); f != fill.ranges().end(); f++)
+				WriteAll(m_staged->fd(), &data[f->first - offset], f->second - f->first, f->first);
+			m_missing.remove(offset, offset + got);
+			offset += got;
+		}
+	}
 }
 
 void MtpLocalFileCopy::CopyTo(MtpDevice& device, NewLIBMTPFile& destination)
 {
-	fflush(m_localFile);
-	if (fseek(m_localFile, 0, SEEK_SET))
-		throw WriteError(errno);
-	struct stat tempInfo;
-	if (fstat(fileno(m_localFile), &tempInfo))
-			throw ReadError(errno);
+	fetch(0, getSize());
+
+	LockMutex transferLock(m_transferMutex);
 
-	device.SendFile(destination, fileno(m_localFile));
+	std::unique_ptr<TransferDescriptor> descriptor;
+	{
+		LockMutex lock(m_mutex);
+
+		checkOpen();
+		rewind();
+		descriptor.reset(new TransferDescriptor(m_staged->fd()));
+	}
+	device.SendFile(destination, descriptor->fd());
 }
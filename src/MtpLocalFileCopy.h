@@ -23,26 +23,79 @@
 #define MTPLOCALFILECOPY_H_
 
 #include "MtpDevice.h"
+#include "MtpStreamingUpload.h"
+#include "MtpByteRanges.h"
+#include "MtpContentCache.h"
+#include "MtpStagingArea.h"
+#include "Mutex.h"
+#include <atomic>
+#include <functional>
+#include <memory>
 
 class MtpLocalFileCopy
 {
 public:
-	MtpLocalFileCopy(MtpDevice& device, uint32_t id);
+	// With remoteExists false the file is new, and only gets created on
+	// the device when the copy is closed. The copy is kept in staging, and
+	// its contents are taken from contentCache if it has them, and kept
+	// there if not. Otherwise, on a device that can edit files in place,
+	// the contents are only fetched as they are read, so changing part of
+	// a big file doesn't mean copying all of it first.
+	MtpLocalFileCopy(MtpDevice& device, MtpStagingArea& staging, const MtpFileInfo& remoteInfo,
+			bool remoteExists = true, MtpContentCache* contentCache = 0);
 	~MtpLocalFileCopy();
 
+	/*
+	 * Write changes back to the remote if needed, keeping the local copy
+	 * open. Returns true if anything was sent, in which case sentInfo says
+	 * what the file now is on the device. The remote id may have changed.
+	 * The copy can be read and written while it is being sent, and
+	 * whatever that changes is left for the next sync.
+	 */
+	bool sync();
+	// Whether there is anything for sync to send
+	bool needsSync();
+	uint32_t remoteId();
 	/*
 	 * Close the local copy and write changes back to the remote if needed.
 	 * The return value is the id for the remote file, which may have
 	 * changed if we had to write back changes.
 	 */
 	uint32_t close();
+	// Close without writing anything back. Returns false if there is no
+	// remote file.
+	bool discard();
 
 	off_t getSize();
+	// The remote file as it was when the copy was made
+	const MtpFileInfo& info() { return m_info; }
+	bool hasRemote() { return m_remoteExists; }
+	// Only to be looked at by whoever called sync
+	const MtpFileInfo& sentInfo() { return m_sentInfo; }
+
+	/*
+	 * Called when the final size of a file that is still empty becomes
+	 * known. Replaces the remote file with one that is sent as it is
+	 * written, as long as the writes come in order. Returns false if
+	 * the file doesn't qualify.
+	 */
+	bool startUpload(off_t size);
 
-	void seek(long offset);
-	size_t write(const void* ptr, size_t size);
+	size_t write(const void* ptr, size_t size, off_t offset);
 	void truncate(off_t length);
-	size_t read(void* ptr, size_t size);
+	size_t read(void* ptr, size_t size, off_t offset);
+
+	/*
+	 * For moving data between the local copy and another descriptor
+	 * (FUSE's, for splicing) without copying it through a buffer of ours.
+	 * transfer is called with the local copy locked, and with its
+	 * descriptor and how many bytes to move at offset, cut short at the
+	 * end of the file when reading. It returns how many it moved, and
+	 * throws if that failed.
+	 */
+	typedef std::function<size_t (int fd, size_t size)> transfer_type;
+	size_t readWith(size_t size, off_t offset, const transfer_type& transfer);
+	size_t writeWith(size_t size, off_t offset, const transfer_type& transfer);
 
 	void CopyTo(MtpDevice& device, NewLIBMTPFile& destination);
 
@@ -50,10 +103,60 @@ private:
 	MtpLocalFileCopy(const MtpLocalFileCopy&);
 	MtpLocalFileCopy& operator=(const MtpLocalFileCopy&);
 
+	void checkOpen();
+	void closeLocal();
+	off_t localSize();
+	void rewind();
+	size_t readLocal(void* ptr, size_t size, off_t offset);
+	void fetch(uint64_t start, uint64_t end);
+
+	static const uint32_t FetchBytes = 1024 * 1024;	// fetched with each GetPartialObject
+	void wrote(off_t offset, size_t wroteBytes);
+	class UploadLock;
+	void passOn(UploadLock& lock, const void* ptr, size_t size, off_t offset, size_t wroteBytes);
+	void cancelUpload();
+	void endUpload();
+	bool finishUpload();
+
+	// What sync sends, taken with m_mutex held so that the transfer can
+	// go on without it
+	struct WriteBackState
+	{
+		int				fd;
+		off_t			size;
+		MtpByteRanges	changed;
+		uint64_t		generation;
+		uint32_t		remoteId;
+		uint64_t		remoteSize;
+		bool			remoteExists;
+		MtpFileInfo		sentInfo;
+	};
+	void writeBack(WriteBackState& state);
+	void wroteBack(const WriteBackState& state, bool sent);
+
+	// Held for the whole of a transfer to or from the device, which
+	// m_mutex isn't, so that reads, writes and getSize aren't held up
+	// by one. Taken before m_mutex.
+	RecursiveMutex		m_transferMutex;
+	// Reads and writes use pread and pwrite, so only the copy's state
+	// and the descriptor's lifetime need guarding. Never held across a
+	// device call, a streaming upload's included.
+	RecursiveMutex		m_mutex;
 	MtpDevice&			m_device;
-	FILE*				m_localFile;
+	std::unique_ptr<MtpStagedFile>	m_staged;	// 0 once closed
+	MtpFileInfo			m_info;
+	MtpFileInfo			m_sentInfo;
 	uint32_t			m_remoteId;
+	uint64_t			m_remoteSize;
+	std::atomic<bool>	m_remoteExists;
 	bool				m_needWriteBack;
+	uint64_t			m_generation;	// changes whenever the contents do
+	bool				m_sending;		// sync is sending the copy
+	// What has to be sent if the file can be edited in place
+	MtpByteRanges		m_changed;
+	// What is still only on the device, for a copy fetched as it is read
+	MtpByteRanges		m_missing;
+	std::unique_ptr<MtpStreamingUpload>	m_upload;
 };
 
 
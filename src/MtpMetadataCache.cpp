@@ -19,99 +19,575 @@
  * licensing@fsf.org
  */
 #include "MtpMetadataCache.h"
+#include "MtpStats.h"
 
+#include <iostream>
 #include <time.h>
 #include <assert.h>
+#include <algorithm>
+#include <functional>
 
 MtpMetadataCacheFiller::~MtpMetadataCacheFiller()
 {
 
 }
 
-MtpMetadataCache::MtpMetadataCache()
+MtpCacheSettings::MtpCacheSettings() : readCacheBytes(32*1024*1024), metadataCacheBytes(64*1024*1024),
+		metadataTtl(5), adaptiveTtl(false), writeBack(true),
+		contentCacheBytes(0), stagingBytes(0), stagingMemoryBytes(32*1024*1024)
 {
 
 }
+
+const time_t MtpCacheSettings::NeverExpire;
+const time_t MtpMetadataCache::MaxAdaptiveTtl;
+const uint32_t MtpMetadataCache::FirstPendingId;
+const uint32_t MtpMetadataCache::LastPendingId;
+const size_t MtpMetadataCache::MaxMovedIds;
+
+MtpMetadataCache::MtpMetadataCache(const MtpCacheSettings& settings) : m_mutex(MtpStats::LockMetadataCache), m_settings(settings),
+		m_staging(settings.stagingDirectory, settings.stagingBytes, settings.stagingMemoryBytes), m_cacheBytes(0),
+		m_nextPendingId(FirstPendingId), m_devicePendingIds(false), m_blockCache(settings.readCacheBytes), m_index(0),
+		m_contentCache(0)
+{
+	if (settings.writeBack)
+		m_writeBackQueue.reset(new MtpWriteBackQueue(*this));
+}
 MtpMetadataCache::~MtpMetadataCache()
 {
-	for(local_file_cache_type::iterator i = m_localFileCache.begin(); i != m_localFileCache.end(); i++)
-	{
-		delete i->second;
-	}
+	// Finishes sending whatever is queued while the rest of the cache is still here
+	m_writeBackQueue.reset();
 }
 
 
 
-MtpNodeMetadata MtpMetadataCache::getItem(uint32_t id, MtpMetadataCacheFiller& source)
+std::shared_ptr<const MtpNodeMetadata> MtpMetadataCache::getItem(uint32_t id, MtpMetadataCacheFiller& source)
 {
+	bool refresh = false;
+	time_t previousTtl = 0;
+	size_t previousSignature = 0;
+	{
+		LockMutex lock(m_mutex);
 
-	clearOld();
-	cache_lookup_type::iterator i = m_cacheLookup.find(id);
-	if (i != m_cacheLookup.end())
-		return i->second->data;
+		cache_lookup_type::iterator i = m_cacheLookup.find(id);
+		if (i != m_cacheLookup.end())
+		{
+			if (!expired(*i->second, time(0)))
+			{
+				m_cache.splice(m_cache.end(), m_cache, i->second);
+				MtpStats::Add(MtpStats::MetadataCacheHits);
+				return i->second->data;
+			}
+			refresh = true;
+			previousTtl = i->second->ttl;
+			previousSignature = i->second->signature;
+		}
+	}
+
+	MtpStats::Add(refresh ? MtpStats::MetadataCacheExpired : MtpStats::MetadataCacheMisses);
+
+	// Fetch from the device without holding the lock, so other threads can
+	// use the cache in the meantime.
+	MtpTimelineSpan span("cache", refresh ? "metadata refresh" : "metadata fill");
+	std::shared_ptr<MtpNodeMetadata> metadata(new MtpNodeMetadata(source.getMetadata()));
+	assert(metadata->self.id == id);
+	metadata->indexChildren();
 	CacheEntry newData;
-	newData.data = source.getMetadata();
-	assert(newData.data.self.id == id);
+	newData.data = metadata;
 	newData.whenCreated = time(0);
+	newData.signature = Signature(*metadata);
+	newData.bytes = Bytes(*metadata);
+	newData.ttl = m_settings.metadataTtl;
+	if (m_settings.adaptiveTtl && refresh && (newData.signature == previousSignature))
+	{
+		// Nothing changed since we last looked, so check less often
+		newData.ttl = std::max(newData.ttl, std::min(std::max(previousTtl, (time_t) 1) * 2, MaxAdaptiveTtl));
+	}
+
+	LockMutex lock(m_mutex);
+	checkDeviceId(id);
+	for(std::vector<MtpFileInfo>::const_iterator c = metadata->children.begin(); c != metadata->children.end(); c++)
+		checkDeviceId(c->id);
+	cache_lookup_type::iterator i = m_cacheLookup.find(id);
+	if (i != m_cacheLookup.end())
+		erase(i);
 	m_cacheLookup[id] = m_cache.insert(m_cache.end(), newData);
+	m_cacheBytes += newData.bytes;
+	trim();
 	return newData.data;
 }
 
 void MtpMetadataCache::clearItem(uint32_t id)
 {
+	LockMutex lock(m_mutex);
 
 	cache_lookup_type::iterator i = m_cacheLookup.find(id);
 	if (i != m_cacheLookup.end())
+		erase(i);
+	// Not every device updates a folder's modification date when its
+	// contents change, so don't rely on that to catch our own changes.
+	if (m_index)
+		m_index->invalidate(id);
+}
+
+void MtpMetadataCache::seedFiles(const std::vector<MtpFileInfo>& files)
+{
+	time_t now = time(0);
+	std::vector<CacheEntry> entries;
+	entries.reserve(files.size());
+	for(std::vector<MtpFileInfo>::const_iterator i = files.begin(); i != files.end(); i++)
+	{
+		if (i->filetype == LIBMTP_FILETYPE_FOLDER)
+			continue;
+		std::shared_ptr<MtpNodeMetadata> metadata(new MtpNodeMetadata);
+		metadata->self = *i;
+		CacheEntry entry;
+		entry.data = metadata;
+		entry.whenCreated = now;
+		entry.signature = Signature(*metadata);
+		entry.bytes = Bytes(*metadata);
+		entry.ttl = m_settings.metadataTtl;
+		entries.push_back(entry);
+	}
+
+	LockMutex lock(m_mutex);
+	for(std::vector<CacheEntry>::iterator e = entries.begin(); e != entries.end(); e++)
 	{
-		m_cache.erase(i->second);
-		m_cacheLookup.erase(i);
+		uint32_t id = e->data->self.id;
+		checkDeviceId(id);
+		cache_lookup_type::iterator i = m_cacheLookup.find(id);
+		if (i != m_cacheLookup.end())
+			erase(i);
+		m_cacheLookup[id] = m_cache.insert(m_cache.end(), *e);
+		m_cacheBytes += e->bytes;
 	}
+	trim();
 }
 
-void MtpMetadataCache::clearOld()
+void MtpMetadataCache::setIndex(MtpMetadataIndex* index)
 {
+	m_index = index;
+}
 
-	time_t now = time(0);
-	for(cache_type::iterator i = m_cache.begin(); i != m_cache.end();)
+MtpMetadataIndex* MtpMetadataCache::getIndex()
+{
+	return m_index;
+}
+
+void MtpMetadataCache::setContentCache(MtpContentCache* contentCache)
+{
+	m_contentCache = contentCache;
+}
+
+bool MtpMetadataCache::haveContents(const MtpFileInfo& info)
+{
+	return getOpenedFile(info.id) || (m_contentCache && m_contentCache->contains(info));
+}
+
+bool MtpMetadataCache::keepsContents(const MtpFileInfo& info)
+{
+	return m_contentCache && m_contentCache->fits(info);
+}
+
+bool MtpMetadataCache::expired(const CacheEntry& entry, time_t now) const
+{
+	if (entry.ttl == MtpCacheSettings::NeverExpire)
+		return false;
+	return (now - entry.whenCreated) > entry.ttl;
+}
+
+void MtpMetadataCache::erase(cache_lookup_type::iterator i)
+{
+	m_cacheBytes -= i->second->bytes;
+	m_cache.erase(i->second);
+	m_cacheLookup.erase(i);
+}
+
+void MtpMetadataCache::trim()
+{
+	// Expired entries are only dropped when they're next asked for (so we
+	// still know what they looked like for the adaptive ttl), this keeps
+	// the total bounded.
+	while((m_cacheBytes > m_settings.metadataCacheBytes) && (m_cache.size() > 1))
+		erase(m_cacheLookup.find(m_cache.front().data->self.id));
+}
+
+size_t MtpMetadataCache::Signature(const MtpNodeMetadata& data)
+{
+	std::hash<std::string> hashString;
+	std::hash<uint64_t> hashNumber;
+	size_t result = 0;
+	for(std::vector<MtpFileInfo>::const_iterator i = data.children.begin(); i != data.children.end(); i++)
 	{
-		if ((now - i->whenCreated) > 5)
-		{
-			m_cacheLookup.erase(m_cacheLookup.find(i->data.self.id));
-			i = m_cache.erase(i);
-		}
-		else
-			return;
+		result = result * 31 + i->id;
+		result = result * 31 + hashString(i->name);
+		result = result * 31 + hashNumber(i->filesize);
+		result = result * 31 + hashNumber(i->modificationdate);
+	}
+	for(std::vector<MtpStorageInfo>::const_iterator i = data.storages.begin(); i != data.storages.end(); i++)
+	{
+		result = result * 31 + i->id;
+		result = result * 31 + hashNumber(i->freeSpaceInBytes);
 	}
+	result = result * 31 + hashString(data.self.name);
+	result = result * 31 + hashNumber(data.self.filesize);
+	result = result * 31 + hashNumber(data.self.modificationdate);
+	return result;
+}
+
+size_t MtpMetadataCache::Bytes(const MtpNodeMetadata& data)
+{
+	size_t result = sizeof(CacheEntry) + sizeof(cache_lookup_type::value_type) + data.self.name.capacity();
+	result += data.children.capacity() * sizeof(MtpFileInfo);
+	// Each name is also copied into the by name index
+	for(std::vector<MtpFileInfo>::const_iterator i = data.children.begin(); i != data.children.end(); i++)
+		result += 2 * i->name.capacity() + sizeof(std::pair<std::string, size_t>) + 2 * sizeof(void*);
+	result += data.storages.capacity() * sizeof(MtpStorageInfo);
+	for(std::vector<MtpStorageInfo>::const_iterator i = data.storages.begin(); i != data.storages.end(); i++)
+		result += i->description.capacity();
+	return result;
 }
 
-MtpLocalFileCopy* MtpMetadataCache::openFile(MtpDevice& device, uint32_t id)
+std::shared_ptr<MtpLocalFileCopy> MtpMetadataCache::openFile(MtpDevice& device, const MtpFileInfo& info)
 {
+	uint32_t id = info.id;
+	std::shared_ptr<MtpLocalFileCopy> opened = getOpenedFile(id);
+	if (opened)
+		return opened;
+
+	// Copying the file from the device can take a long time, so do it
+	// without holding the lock.
+	std::shared_ptr<MtpLocalFileCopy> newFile(new MtpLocalFileCopy(device, m_staging, info, true, m_contentCache));
+
+	LockMutex lock(m_mutex);
 	local_file_cache_type::iterator i = m_localFileCache.find(id);
 	if (i != m_localFileCache.end())
 		return i->second;
-	MtpLocalFileCopy* newFile = new MtpLocalFileCopy(device, id);
 	m_localFileCache[id] = newFile;
 	return newFile;
 }
 
-MtpLocalFileCopy* MtpMetadataCache::getOpenedFile(uint32_t id)
+std::shared_ptr<MtpLocalFileCopy> MtpMetadataCache::getOpenedFile(uint32_t id)
 {
+	LockMutex lock(m_mutex);
+
 	local_file_cache_type::iterator i = m_localFileCache.find(id);
 	if (i != m_localFileCache.end())
 		return i->second;
 	else
-		return 0;
+		return std::shared_ptr<MtpLocalFileCopy>();
 }
 
-uint32_t MtpMetadataCache::closeFile(uint32_t id)
+void MtpMetadataCache::addOpen(uint32_t id, bool writer)
+{
+	LockMutex lock(m_mutex);
+
+	OpenCount& count = m_openFiles[currentId(id)];
+	count.opens++;
+	if (writer)
+		count.writers++;
+}
+
+uint32_t MtpMetadataCache::releaseFile(uint32_t id, bool writer)
 {
-	local_file_cache_type::iterator i = m_localFileCache.find(id);
-	if (i != m_localFileCache.end())
 	{
-		uint32_t newId = i->second->close();
-		delete i->second;
+		LockMutex lock(m_mutex);
+
+		// The file may have been sent since the caller looked
+		id = currentId(id);
+		open_file_table_type::iterator i = m_openFiles.find(id);
+		if (i != m_openFiles.end())
+		{
+			if (i->second.opens)
+				i->second.opens--;
+			if (writer && i->second.writers)
+				i->second.writers--;
+			bool lastWriter = writer && (i->second.writers == 0);
+			if (i->second.opens == 0)
+				m_openFiles.erase(i);
+			else if (!lastWriter)
+				return id;
+		}
+	}
+	return closeFile(id, false);
+}
+
+unsigned MtpMetadataCache::openWriters(uint32_t id)
+{
+	LockMutex lock(m_mutex);
+
+	open_file_table_type::iterator i = m_openFiles.find(id);
+	return (i == m_openFiles.end()) ? 0 : i->second.writers;
+}
+
+uint32_t MtpMetadataCache::closeFile(uint32_t id, bool wait)
+{
+	std::shared_ptr<MtpLocalFileCopy> localFile = getOpenedFile(id);
+	if (!localFile)
+		return id;
+
+	// A queued copy stays where reads, listings and a reopen can find it
+	// until it has been sent.
+	if (m_writeBackQueue && (wait || localFile->needsSync()))
+	{
+		uint64_t ticket = m_writeBackQueue->add(id, localFile);
+		if (!wait)
+			return id;
+		m_writeBackQueue->waitFor(ticket);
+		return currentId(id);
+	}
+
+	// If sending fails the copy is kept, changed, for the next close to retry
+	uint32_t newId = id;
+	if (localFile->sync())
+	{
+		fileSent(id, *localFile);
+		newId = localFile->remoteId();
+	}
+	releaseCopy(newId, localFile);
+	return newId;
+}
+
+bool MtpMetadataCache::writeBack(uint32_t id, const std::shared_ptr<MtpLocalFileCopy>& localFile)
+{
+	bool sent;
+	try
+	{
+		sent = localFile->sync();
+	}
+	catch(std::exception& e)
+	{
+		// The copy stays open and changed, so the next close tries again
+		std::cerr << "Unable to write back " << localFile->info().name << ": " << e.what() << std::endl;
+		return false;
+	}
+
+	LockMutex lock(m_mutex);
+	uint32_t newId = id;
+	if (sent)
+	{
+		fileSent(id, *localFile);
+		newId = localFile->remoteId();
+	}
+	releaseCopy(newId, localFile);
+	return true;
+}
+
+void MtpMetadataCache::releaseCopy(uint32_t id, const std::shared_ptr<MtpLocalFileCopy>& localFile)
+{
+	LockMutex lock(m_mutex);
+
+	// Still needed if the file is open, or was written to again while it
+	// was being sent. Otherwise the copy goes once the last reader is done with it.
+	local_file_cache_type::iterator i = m_localFileCache.find(id);
+	if ((i != m_localFileCache.end()) && (i->second == localFile) && !m_openFiles.count(id) &&
+			!localFile->needsSync())
 		m_localFileCache.erase(i);
-		return newId;
+}
+
+void MtpMetadataCache::waitForWriteBacks()
+{
+	if (m_writeBackQueue)
+		m_writeBackQueue->waitForAll();
+}
+
+void MtpMetadataCache::fileSent(uint32_t oldId, MtpLocalFileCopy& localFile)
+{
+	clearRemoteFileData(oldId);
+	clearItem(oldId);
+	// We know what was sent, so the folder listing can be patched
+	// rather than fetched again.
+	const MtpFileInfo& sent = localFile.sentInfo();
+	seedFiles(std::vector<MtpFileInfo>(1, sent));
+	updateChild(sent.parentId ? sent.parentId : sent.storageId, oldId, sent);
+	if (sent.id != oldId)
+	{
+		LockMutex lock(m_mutex);
+
+		checkDeviceId(sent.id);
+		moved(oldId, sent.id);
+		// Whoever has the file open follows it to the new id
+		open_file_table_type::iterator o = m_openFiles.find(oldId);
+		if (o != m_openFiles.end())
+		{
+			OpenCount count = o->second;
+			m_openFiles.erase(o);
+			m_openFiles[sent.id] = count;
+		}
+		local_file_cache_type::iterator i = m_localFileCache.find(oldId);
+		if ((i != m_localFileCache.end()) && (i->second.get() == &localFile))
+		{
+			std::shared_ptr<MtpLocalFileCopy> moved = i->second;
+			m_localFileCache.erase(i);
+			m_localFileCache[sent.id] = moved;
+		}
+	}
+}
+
+uint32_t MtpMetadataCache::currentId(uint32_t id)
+{
+	LockMutex lock(m_mutex);
+
+	// A file can have been sent more than once since the id was handed out
+	for(size_t n = 0; n < m_movedIds.size(); n++)
+	{
+		moved_id_map_type::iterator i = m_movedIds.find(id);
+		if (i == m_movedIds.end())
+			break;
+		m_movedOrder.splice(m_movedOrder.end(), m_movedOrder, i->second.order);
+		id = i->second.newId;
 	}
 	return id;
 }
+
+uint32_t MtpMetadataCache::originalId(uint32_t id)
+{
+	LockMutex lock(m_mutex);
+
+	original_id_map_type::iterator i = m_originalIds.find(id);
+	return (i == m_originalIds.end()) ? id : i->second;
+}
+
+void MtpMetadataCache::moved(uint32_t oldId, uint32_t newId)
+{
+	uint32_t original = originalId(oldId);
+	moved_id_map_type::iterator i = m_movedIds.find(oldId);
+	if (i != m_movedIds.end())
+	{
+		m_originalIds.erase(i->second.newId);
+		m_originalIds[newId] = original;
+		i->second.newId = newId;
+		m_movedOrder.splice(m_movedOrder.end(), m_movedOrder, i->second.order);
+		return;
+	}
+	// Whatever still has an old id looks it up now and then, so the ones
+	// that haven't been looked up for longest are the ones to forget
+	if (m_movedIds.size() >= MaxMovedIds)
+	{
+		moved_id_map_type::iterator oldest = m_movedIds.find(m_movedOrder.front());
+		m_originalIds.erase(oldest->second.newId);
+		m_movedIds.erase(oldest);
+		m_movedOrder.pop_front();
+	}
+	m_originalIds[newId] = original;
+	MovedId& entry = m_movedIds[oldId];
+	entry.newId = newId;
+	entry.order = m_movedOrder.insert(m_movedOrder.end(), oldId);
+}
+
+void MtpMetadataCache::checkDeviceId(uint32_t id)
+{
+	if (m_devicePendingIds || !InPendingRange(id))
+		return;
+	// New files made from now on go straight to the device
+	std::cerr << "Device object id " << id << " is in jmtpfs's range for new files, "
+			"which won't be kept local until closed from now on" << std::endl;
+	m_devicePendingIds = true;
+}
+
+bool MtpMetadataCache::isPendingId(uint32_t id)
+{
+	LockMutex lock(m_mutex);
+
+	return InPendingRange(id) && !m_devicePendingIds;
+}
+
+void MtpMetadataCache::updateChild(uint32_t folderId, uint32_t oldId, const MtpFileInfo& child)
+{
+	LockMutex lock(m_mutex);
+
+	if (m_index)
+		m_index->invalidate(folderId);
+	cache_lookup_type::iterator i = m_cacheLookup.find(folderId);
+	if (i == m_cacheLookup.end())
+		return;
+	CacheEntry& entry = *i->second;
+	std::shared_ptr<MtpNodeMetadata> metadata(new MtpNodeMetadata);
+	metadata->self = entry.data->self;
+	metadata->storages = entry.data->storages;
+	metadata->children.reserve(entry.data->children.size() + 1);
+	bool replaced = false;
+	for(std::vector<MtpFileInfo>::const_iterator c = entry.data->children.begin(); c != entry.data->children.end(); c++)
+	{
+		if ((c->id != oldId) && (c->id != child.id) && (c->name != child.name))
+			metadata->children.push_back(*c);
+		else if (!replaced)
+		{
+			metadata->children.push_back(child);
+			replaced = true;
+		}
+	}
+	if (!replaced)
+		metadata->children.push_back(child);
+	metadata->indexChildren();
+	m_cacheBytes -= entry.bytes;
+	entry.data = metadata;
+	entry.bytes = Bytes(*metadata);
+	m_cacheBytes += entry.bytes;
+}
+
+uint32_t MtpMetadataCache::createFile(MtpDevice& device, const std::string& name, uint32_t parentId, uint32_t storageId)
+{
+	MtpFileInfo info(0, parentId, storageId, name, LIBMTP_FILETYPE_UNKNOWN, 0);
+	info.modificationdate = time(0);
+
+	{
+		LockMutex lock(m_mutex);
+		if (m_devicePendingIds)
+			return 0;
+		if (m_nextPendingId >= LastPendingId)
+			m_nextPendingId = FirstPendingId;
+		info.id = m_nextPendingId++;
+	}
+	// Making the copy can wait for room in staging, so not under the lock
+	std::shared_ptr<MtpLocalFileCopy> newFile(new MtpLocalFileCopy(device, m_staging, info, false));
+
+	LockMutex lock(m_mutex);
+	m_localFileCache[info.id] = newFile;
+	return info.id;
+}
+
+std::vector<std::shared_ptr<MtpLocalFileCopy> > MtpMetadataCache::pendingFiles(uint32_t parentId, uint32_t storageId)
+{
+	std::vector<std::shared_ptr<MtpLocalFileCopy> > result;
+
+	LockMutex lock(m_mutex);
+	for(local_file_cache_type::iterator i = m_localFileCache.begin(); i != m_localFileCache.end(); i++)
+	{
+		const MtpFileInfo& info = i->second->info();
+		// Until the queue gets to it, a new file is still only listed here
+		bool pending = !i->second->hasRemote() || isPendingId(i->first);
+		if (pending && (info.parentId == parentId) && (info.storageId == storageId))
+			result.push_back(i->second);
+	}
+	return result;
+}
+
+uint32_t MtpMetadataCache::discardFile(uint32_t id)
+{
+	std::shared_ptr<MtpLocalFileCopy> localFile;
+	{
+		LockMutex lock(m_mutex);
+
+		local_file_cache_type::iterator i = m_localFileCache.find(id);
+		if (i == m_localFileCache.end())
+			return isPendingId(id) ? 0 : id;
+		localFile = i->second;
+		m_localFileCache.erase(i);
+	}
+
+	// If the queue was sending it, what is on the device now is what goes
+	return localFile->discard() ? localFile->remoteId() : 0;
+}
+
+size_t MtpMetadataCache::readRemoteFile(MtpDevice& device, const MtpFileInfo& info, char* buf, size_t size, off_t offset)
+{
+	return m_blockCache.read(device, info, buf, size, offset);
+}
+
+void MtpMetadataCache::clearRemoteFileData(uint32_t id)
+{
+	m_blockCache.clearObject(id);
+	if (m_contentCache)
+		m_contentCache->invalidate(id);
+}
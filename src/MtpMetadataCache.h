@@ -24,8 +24,15 @@
 
 #include "MtpNodeMetadata.h"
 #include "MtpLocalFileCopy.h"
+#include "MtpBlockCache.h"
+#include "MtpMetadataIndex.h"
+#include "MtpContentCache.h"
+#include "MtpWriteBackQueue.h"
+
+#include "Mutex.h"
 
 #include <list>
+#include <memory>
 #include <unordered_map>
 
 class MtpMetadataCacheFiller
@@ -36,36 +43,165 @@ public:
 	virtual MtpNodeMetadata getMetadata()=0;
 };
 
+struct MtpCacheSettings
+{
+	MtpCacheSettings();
+
+	static const time_t	NeverExpire = -1;
+
+	size_t	readCacheBytes;
+	size_t	metadataCacheBytes;
+	time_t	metadataTtl;	// seconds, or NeverExpire
+	bool	adaptiveTtl;	// lengthen the ttl of listings that don't change
+	bool	writeBack;		// send closed files in the background
+	// Where and how much whole file contents to keep on disk, 0 for none
+	std::string	contentCacheDirectory;
+	uint64_t	contentCacheBytes;
+	// Where local copies of open files go (empty for the temporary
+	// directory), how much they may take in all (0 for no limit) and how
+	// much of that may be in memory
+	std::string	stagingDirectory;
+	uint64_t	stagingBytes;
+	uint64_t	stagingMemoryBytes;
+};
+
 class MtpMetadataCache
 {
 public:
-	MtpMetadataCache();
+	MtpMetadataCache(const MtpCacheSettings& settings);
 	~MtpMetadataCache();
 
-	MtpNodeMetadata getItem(uint32_t id, MtpMetadataCacheFiller& source);
+	// The returned metadata is shared with the cache and must not be changed
+	std::shared_ptr<const MtpNodeMetadata> getItem(uint32_t id, MtpMetadataCacheFiller& source);
 	void clearItem(uint32_t id);
+	// Caches the metadata of the files (not folders) in a folder listing
+	void seedFiles(const std::vector<MtpFileInfo>& files);
+
+	// The persistent folder index, or null if it isn't enabled
+	void setIndex(MtpMetadataIndex* index);
+	MtpMetadataIndex* getIndex();
+	// The on disk file contents cache, or null if it isn't enabled
+	void setContentCache(MtpContentCache* contentCache);
+	// Whether opening the file would cost nothing from the device
+	bool haveContents(const MtpFileInfo& info);
+	// Whether a whole copy of the file would be kept in the content cache
+	bool keepsContents(const MtpFileInfo& info);
+
+	std::shared_ptr<MtpLocalFileCopy> openFile(MtpDevice& device, const MtpFileInfo& info);
+	std::shared_ptr<MtpLocalFileCopy> getOpenedFile(uint32_t id);
+
+	/*
+	 * The open file table. A local copy is shared by everything that has
+	 * the file open and kept until the last of them releases it. What was
+	 * written is sent once the last writer releases the file. releaseFile
+	 * returns the file's id afterwards, like closeFile.
+	 */
+	void addOpen(uint32_t id, bool writer);
+	uint32_t releaseFile(uint32_t id, bool writer);
+	unsigned openWriters(uint32_t id);
+
+	/*
+	 * Sends the local copy to the device if it was changed, and returns the
+	 * file's id afterwards. With background write back the copy is only
+	 * queued unless wait is set, and the id changes later on. The copy is
+	 * dropped once it has been sent, unless the file is still open.
+	 */
+	uint32_t closeFile(uint32_t id, bool wait = true);
+	// Closes the local copy without writing it back. Returns the id of
+	// what that left on the device for the file, or 0 if nothing.
+	uint32_t discardFile(uint32_t id);
+	// Run by the write back queue. Returns false if sending failed.
+	bool writeBack(uint32_t id, const std::shared_ptr<MtpLocalFileCopy>& localFile);
+	void waitForWriteBacks();
+	// The id a file has now, given one it had before it was sent
+	uint32_t currentId(uint32_t id);
+	// The other way round: the id a file had before it was first sent back
+	// under a new one, which its inode number stays based on
+	uint32_t originalId(uint32_t id);
 
-	MtpLocalFileCopy* openFile(MtpDevice& device, uint32_t id);
-	MtpLocalFileCopy* getOpenedFile(uint32_t id);
+	// A new file is only a local copy, under an id from the pending range,
+	// until it is first closed. That saves creating an empty object, listing
+	// the folder again to find it, and fetching it back. Returns 0 if the
+	// device has been seen using ids from that range, in which case the
+	// file has to be created on the device straight away.
+	uint32_t createFile(MtpDevice& device, const std::string& name, uint32_t parentId, uint32_t storageId);
+	// Open copies in the folder that have no object on the device
+	std::vector<std::shared_ptr<MtpLocalFileCopy> > pendingFiles(uint32_t parentId, uint32_t storageId);
+	bool isPendingId(uint32_t id);
 
-	uint32_t closeFile(uint32_t id);
+	size_t readRemoteFile(MtpDevice& device, const MtpFileInfo& info, char* buf, size_t size, off_t offset);
+	void clearRemoteFileData(uint32_t id);
 
 private:
-	void clearOld();
 	struct CacheEntry
 	{
-		MtpNodeMetadata data;
+		std::shared_ptr<const MtpNodeMetadata>	data;
 		time_t			whenCreated;
+		time_t			ttl;
+		size_t			signature;
+		size_t			bytes;
 	};
 
 	typedef std::list<CacheEntry> cache_type;
 	typedef std::unordered_map<uint32_t, cache_type::iterator> cache_lookup_type;
-	typedef std::unordered_map<uint32_t, MtpLocalFileCopy*> local_file_cache_type;
+	typedef std::unordered_map<uint32_t, std::shared_ptr<MtpLocalFileCopy> > local_file_cache_type;
 
-	cache_type				m_cache;
+	struct OpenCount
+	{
+		OpenCount() : opens(0), writers(0) {}
+
+		unsigned	opens;
+		unsigned	writers;
+	};
+	typedef std::unordered_map<uint32_t, OpenCount> open_file_table_type;
+
+	typedef std::list<uint32_t> moved_order_type;	// old ids, least recently used first
+	struct MovedId
+	{
+		uint32_t					newId;
+		moved_order_type::iterator	order;
+	};
+	typedef std::unordered_map<uint32_t, MovedId> moved_id_map_type;
+	typedef std::unordered_map<uint32_t, uint32_t> original_id_map_type;
+
+	bool expired(const CacheEntry& entry, time_t now) const;
+	void updateChild(uint32_t folderId, uint32_t oldId, const MtpFileInfo& child);
+	void fileSent(uint32_t oldId, MtpLocalFileCopy& localFile);
+	void moved(uint32_t oldId, uint32_t newId);
+	void checkDeviceId(uint32_t id);
+	static bool InPendingRange(uint32_t id) { return (id >= FirstPendingId) && (id < LastPendingId); }
+	void releaseCopy(uint32_t id, const std::shared_ptr<MtpLocalFileCopy>& localFile);
+	void erase(cache_lookup_type::iterator i);
+	void trim();
+	static size_t Signature(const MtpNodeMetadata& data);
+	static size_t Bytes(const MtpNodeMetadata& data);
+
+	static const time_t	MaxAdaptiveTtl = 300;
+	// Above anything devices hand out, and below the ids of the root and
+	// the .jmtpfs files
+	static const uint32_t	FirstPendingId = 0xF0000000;
+	static const uint32_t	LastPendingId = 0xFFFFF000;
+	static const size_t		MaxMovedIds = 65536;
+
+	// Only held while looking at or changing the maps, never across
+	// a device operation.
+	RecursiveMutex			m_mutex;
+	MtpCacheSettings		m_settings;
+	MtpStagingArea			m_staging;	// outlives the local copies
+	cache_type				m_cache;	// least recently used first
+	size_t					m_cacheBytes;
 	cache_lookup_type		m_cacheLookup;
 	local_file_cache_type	m_localFileCache;
-
+	open_file_table_type	m_openFiles;
+	moved_id_map_type		m_movedIds;
+	moved_order_type		m_movedOrder;
+	original_id_map_type	m_originalIds;	// new ids of the moved ones
+	uint32_t				m_nextPendingId;
+	bool					m_devicePendingIds;	// the device uses the pending range itself
+	MtpBlockCache			m_blockCache;
+	MtpMetadataIndex*		m_index;
+	MtpContentCache*		m_contentCache;
+	std::unique_ptr<MtpWriteBackQueue>	m_writeBackQueue;
 };
 
 
@@ -0,0 +1,372 @@
+/*
+ * MtpMetadataIndex.cpp
+ *
+ * This software is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 3 as published by the Free Software Foundation.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02111-1301, USA.
+ * licensing@fsf.org
+ */
+#include "MtpMetadataIndex.h"
+#include "mtpFilesystemErrors.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <sstream>
+#include <iomanip>
+
+/*
+ * Index file layout. All values are in host byte order, the byte order
+ * marker in the header lets us reject a file written on another machine.
+ *
+ * header:  char magic[8], uint32 version, uint32 storageId,
+ *          uint32 listingCount, uint32 byteOrderMarker
+ * listing: uint32 folderId, uint32 childCount, int64 modificationDate,
+ *          uint32 childBytes, followed by childCount children
+ * child:   uint32 id, uint32 parentId, uint32 filetype, uint64 filesize,
+ *          int64 modificationdate, uint16 nameLength, char name[nameLength]
+ */
+static const char		indexMagic[8] = {'J','M','T','P','I','D','X','\0'};
+static const uint32_t	indexVersion = 1;
+static const uint32_t	byteOrderMarker = 0x01020304;
+static const size_t		headerSize = 8 + 4 * 4;
+static const size_t		listingHeaderSize = 4 + 4 + 8 + 4;
+
+namespace
+{
+	class IndexReader
+	{
+	public:
+		IndexReader(const char* data, size_t length, size_t offset) : m_data(data), m_length(length), m_offset(offset) {}
+
+		template<typename T> bool get(T& value)
+		{
+			if (m_length - m_offset < sizeof(T))
+				return false;
+			memcpy(&value, m_data + m_offset, sizeof(T));
+			m_offset += sizeof(T);
+			return true;
+		}
+
+		bool getString(size_t length, std::string& value)
+		{
+			if (m_length - m_offset < length)
+				return false;
+			value.assign(m_data + m_offset, length);
+			m_offset += length;
+			return true;
+		}
+
+		bool skip(size_t length)
+		{
+			if (m_length - m_offset < length)
+				return false;
+			m_offset += length;
+			return true;
+		}
+
+		size_t offset() const { return m_offset; }
+
+	private:
+		const char*	m_data;
+		size_t		m_length;
+		size_t		m_offset;
+	};
+
+	template<typename T> void put(std::string& buffer, T value)
+	{
+		buffer.append((const char*) &value, sizeof(T));
+	}
+}
+
+MtpMetadataIndex::MtpMetadataIndex(const std::string& directory, const std::string& deviceSerial) :
+		m_directory(directory)
+{
+	// The serial number ends up in a filename, so only keep the harmless characters
+	for(std::string::const_iterator i = deviceSerial.begin(); i != deviceSerial.end(); i++)
+	{
+		if (isalnum(*i) || (*i == '-') || (*i == '_'))
+			m_deviceSerial.push_back(*i);
+	}
+}
+
+MtpMetadataIndex::~MtpMetadataIndex()
+{
+	for(storage_map_type::iterator i = m_storages.begin(); i != m_storages.end(); i++)
+		unmap(*i->second);
+}
+
+std::string MtpMetadataIndex::DefaultDirectory()
+{
+	const char* cacheHome = getenv("XDG_CACHE_HOME");
+	if (cacheHome && *cacheHome)
+		return std::string(cacheHome) + "/jmtpfs";
+	const char* home = getenv("HOME");
+	if (home && *home)
+		return std::string(home) + "/.cache/jmtpfs";
+	return "";
+}
+
+std::string MtpMetadataIndex::fileName(uint32_t storageId)
+{
+	std::ostringstream name;
+	name << m_directory << "/" << m_deviceSerial << "-" << std::hex << std::setfill('0') << std::setw(8) << storageId << ".idx";
+	return name.str();
+}
+
+MtpMetadataIndex::StorageIndex& MtpMetadataIndex::getStorage(uint32_t storageId)
+{
+	storage_map_type::iterator i = m_storages.find(storageId);
+	if (i != m_storages.end())
+		return *i->second;
+	std::unique_ptr<StorageIndex> storage(new StorageIndex);
+	load(storageId, *storage);
+	StorageIndex& result = *storage;
+	m_storages[storageId] = std::move(storage);
+	return result;
+}
+
+void MtpMetadataIndex::load(uint32_t storageId, StorageIndex& storage)
+{
+	if (m_deviceSerial.empty() || m_directory.empty())
+		return;
+	int fd = open(fileName(storageId).c_str(), O_RDONLY);
+	if (fd < 0)
+		return;
+	struct stat info;
+	if ((fstat(fd, &info) != 0) || (info.st_size < (off_t) headerSize))
+	{
+		close(fd);
+		return;
+	}
+	void* mapped = mmap(0, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (mapped == MAP_FAILED)
+		return;
+	storage.mapped = (const char*) mapped;
+	storage.mappedLength = info.st_size;
+
+	IndexReader reader(storage.mapped, storage.mappedLength, 0);
+	uint32_t version, fileStorageId, listingCount, marker;
+	bool ok = (memcmp(storage.mapped, indexMagic, sizeof(indexMagic)) == 0) && reader.skip(sizeof(indexMagic)) &&
+			reader.get(version) && reader.get(fileStorageId) && reader.get(listingCount) && reader.get(marker) &&
+			(version == indexVersion) && (fileStorageId == storageId) && (marker == byteOrderMarker);
+
+	// Only the listing headers are read here, the children are decoded
+	// straight from the mapping when a listing is used.
+	for(uint32_t l = 0; ok && (l < listingCount); l++)
+	{
+		MappedListing listing;
+		uint32_t folderId, childBytes;
+		int64_t modificationDate;
+		listing.offset = reader.offset();
+		ok = reader.get(folderId) && reader.get(listing.childCount) && reader.get(modificationDate) &&
+				reader.get(childBytes) && reader.skip(childBytes);
+		listing.modificationDate = modificationDate;
+		listing.length = reader.offset() - listing.offset;
+		if (ok)
+			storage.mappedListings[folderId] = listing;
+	}
+	if (!ok)
+	{
+		// Damaged or from an incompatible version. Just start over.
+		unmap(storage);
+		storage.mappedListings.clear();
+		storage.dirty = true;
+	}
+}
+
+void MtpMetadataIndex::unmap(StorageIndex& storage)
+{
+	if (storage.mapped)
+		munmap((void*) storage.mapped, storage.mappedLength);
+	storage.mapped = 0;
+	storage.mappedLength = 0;
+}
+
+bool MtpMetadataIndex::decode(const StorageIndex& storage, const MappedListing& listing, std::vector<MtpFileInfo>& children)
+{
+	IndexReader reader(storage.mapped, listing.offset + listing.length, listing.offset + listingHeaderSize);
+	std::vector<MtpFileInfo> result;
+	result.reserve(listing.childCount);
+	for(uint32_t c = 0; c < listing.childCount; c++)
+	{
+		MtpFileInfo child;
+		uint32_t filetype;
+		int64_t modificationdate;
+		uint16_t nameLength;
+		if (!(reader.get(child.id) && reader.get(child.parentId) && reader.get(filetype) &&
+				reader.get(child.filesize) && reader.get(modificationdate) && reader.get(nameLength) &&
+				reader.getString(nameLength, child.name)))
+			return false;
+		child.filetype = (LIBMTP_filetype_t) filetype;
+		child.modificationdate = modificationdate;
+		result.push_back(child);
+	}
+	children.swap(result);
+	return true;
+}
+
+bool MtpMetadataIndex::lookup(uint32_t storageId, uint32_t folderId, time_t folderModificationDate,
+		std::vector<MtpFileInfo>& children)
+{
+	LockMutex lock(m_mutex);
+
+	// A device that doesn't report folder modification dates gives us
+	// nothing to validate against.
+	if (folderModificationDate == 0)
+		return false;
+	StorageIndex& storage = getStorage(storageId);
+
+	std::map<uint32_t, Listing>::iterator updated = storage.updatedListings.find(folderId);
+	if (updated != storage.updatedListings.end())
+	{
+		if (updated->second.modificationDate != folderModificationDate)
+			return false;
+		children = updated->second.children;
+		return true;
+	}
+
+	std::unordered_map<uint32_t, MappedListing>::iterator mapped = storage.mappedListings.find(folderId);
+	if ((mapped == storage.mappedListings.end()) || (mapped->second.modificationDate != folderModificationDate))
+		return false;
+	if (!decode(storage, mapped->second, children))
+		return false;
+	for(std::vector<MtpFileInfo>::iterator i = children.begin(); i != children.end(); i++)
+		i->storageId = storageId;
+	return true;
+}
+
+void MtpMetadataIndex::store(uint32_t storageId, uint32_t folderId, time_t folderModificationDate,
+		const std::vector<MtpFileInfo>& children)
+{
+	LockMutex lock(m_mutex);
+
+	if (folderModificationDate == 0)
+		return;
+	StorageIndex& storage = getStorage(storageId);
+	storage.mappedListings.erase(folderId);
+	storage.dirty = true;
+	Listing& listing = storage.updatedListings[folderId];
+	listing.modificationDate = folderModificationDate;
+	listing.children = children;
+}
+
+void MtpMetadataIndex::invalidate(uint32_t folderId)
+{
+	LockMutex lock(m_mutex);
+
+	for(storage_map_type::iterator i = m_storages.begin(); i != m_storages.end(); i++)
+	{
+		// A listing dropped from the file has to be dropped on disk too, or
+		// the next mount would use it again
+		if (i->second->mappedListings.erase(folderId) || i->second->updatedListings.erase(folderId))
+			i->second->dirty = true;
+	}
+}
+
+void MtpMetadataIndex::save()
+{
+	LockMutex lock(m_mutex);
+
+	if (m_deviceSerial.empty() || m_directory.empty())
+		return;
+
+	// Create the directory, and any missing parents
+	for(size_t p = m_directory.find('/', 1); ; p = m_directory.find('/', p + 1))
+	{
+		std::string dir = m_directory.substr(0, p);
+		if ((mkdir(dir.c_str(), 0700) != 0) && (errno != EEXIST))
+			throw WriteError(errno);
+		if (p == std::string::npos)
+			break;
+	}
+
+	for(storage_map_type::iterator i = m_storages.begin(); i != m_storages.end(); i++)
+		saveStorage(i->first, *i->second);
+}
+
+void MtpMetadataIndex::saveStorage(uint32_t storageId, StorageIndex& storage)
+{
+	if (!storage.dirty)
+		return;
+
+	std::string buffer(indexMagic, sizeof(indexMagic));
+	put<uint32_t>(buffer, indexVersion);
+	put<uint32_t>(buffer, storageId);
+	put<uint32_t>(buffer, storage.mappedListings.size() + storage.updatedListings.size());
+	put<uint32_t>(buffer, byteOrderMarker);
+
+	// Listings we haven't touched are copied over as is
+	for(std::unordered_map<uint32_t, MappedListing>::iterator i = storage.mappedListings.begin();
+			i != storage.mappedListings.end(); i++)
+		buffer.append(storage.mapped + i->second.offset, i->second.length);
+
+	for(std::map<uint32_t, Listing>::iterator i = storage.updatedListings.begin(); i != storage.updatedListings.end(); i++)
+	{
+		std::string children;
+		for(std::vector<MtpFileInfo>::iterator c = i->second.children.begin(); c != i->second.children.end(); c++)
+		{
+			put<uint32_t>(children, c->id);
+			put<uint32_t>(children, c->parentId);
+			put<uint32_t>(children, c->filetype);
+			put<uint64_t>(children, c->filesize);
+			put<int64_t>(children, c->modificationdate);
+			put<uint16_t>(children, c->name.size());
+			children.append(c->name);
+		}
+		put<uint32_t>(buffer, i->first);
+		put<uint32_t>(buffer, i->second.children.size());
+		put<int64_t>(buffer, i->second.modificationDate);
+		put<uint32_t>(buffer, children.size());
+		buffer.append(children);
+	}
+
+	// Write to a temporary file and rename it into place, so a crash
+	// part way through never leaves a truncated index behind.
+	std::string name = fileName(storageId);
+	std::string tempName = name + ".tmp";
+	int fd = open(tempName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0)
+		throw WriteError(errno);
+	size_t written = 0;
+	while(written < buffer.size())
+	{
+		ssize_t n = write(fd, buffer.data() + written, buffer.size() - written);
+		if (n < 0)
+		{
+			int err = errno;
+			close(fd);
+			unlink(tempName.c_str());
+			throw WriteError(err);
+		}
+		written += n;
+	}
+	close(fd);
+	if (rename(tempName.c_str(), name.c_str()) != 0)
+	{
+		int err = errno;
+		unlink(tempName.c_str());
+		throw WriteError(err);
+	}
+
+	unmap(storage);
+	storage.mappedListings.clear();
+	storage.updatedListings.clear();
+	storage.dirty = false;
+	load(storageId, storage);
+}
@@ -0,0 +1,103 @@
+/*
+ * MtpMetadataIndex.h
+ *
+ * This software is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 3 as published by the Free Software Foundation.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02111-1301, USA.
+ * licensing@fsf.org
+ */
+
+#ifndef MTPMETADATAINDEX_H_
+#define MTPMETADATAINDEX_H_
+
+#include "MtpDevice.h"
+#include "Mutex.h"
+
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/*
+ * An on disk copy of folder listings that survives between mounts, so that
+ * a fresh mount doesn't have to enumerate every folder on the device again.
+ * There is one index file per device serial number and storage id. At
+ * startup the file is memory mapped and only the location of each folder
+ * listing is read. A listing is only used if the folder's modification date
+ * on the device still matches the date recorded with the listing, which
+ * costs a single GetFileInfo instead of a full folder enumeration.
+ */
+class MtpMetadataIndex
+{
+public:
+	MtpMetadataIndex(const std::string& directory, const std::string& deviceSerial);
+	~MtpMetadataIndex();
+
+	bool lookup(uint32_t storageId, uint32_t folderId, time_t folderModificationDate,
+			std::vector<MtpFileInfo>& children);
+	void store(uint32_t storageId, uint32_t folderId, time_t folderModificationDate,
+			const std::vector<MtpFileInfo>& children);
+	void invalidate(uint32_t folderId);
+
+	void save();
+
+	static std::string DefaultDirectory();
+
+private:
+	MtpMetadataIndex(const MtpMetadataIndex&);
+	MtpMetadataIndex& operator=(const MtpMetadataIndex&);
+
+	struct Listing
+	{
+		time_t						modificationDate;
+		std::vector<MtpFileInfo>	children;
+	};
+
+	struct MappedListing
+	{
+		time_t		modificationDate;
+		size_t		offset;
+		size_t		length;
+		uint32_t	childCount;
+	};
+
+	struct StorageIndex
+	{
+		StorageIndex() : mapped(0), mappedLength(0), dirty(false) {}
+
+		const char*									mapped;
+		size_t										mappedLength;
+		std::unordered_map<uint32_t, MappedListing>	mappedListings;
+		std::map<uint32_t, Listing>					updatedListings;
+		// Listings were added, changed or dropped since the file was written
+		bool										dirty;
+	};
+
+	StorageIndex& getStorage(uint32_t storageId);
+	std::string fileName(uint32_t storageId);
+	void load(uint32_t storageId, StorageIndex& storage);
+	void unmap(StorageIndex& storage);
+	bool decode(const StorageIndex& storage, const MappedListing& listing, std::vector<MtpFileInfo>& children);
+	void saveStorage(uint32_t storageId, StorageIndex& storage);
+
+	typedef std::unordered_map<uint32_t, std::unique_ptr<StorageIndex> > storage_map_type;
+
+	RecursiveMutex		m_mutex;
+	std::string			m_directory;
+	std::string			m_deviceSerial;
+	storage_map_type	m_storages;
+};
+
+
+#endif /* MTPMETADATAINDEX_H_ */
@@ -36,32 +36,32 @@ uint32_t MtpNode::Id()
 
 uint32_t MtpNode::GetParentNodeId()
 {
-	MtpNodeMetadata md = m_cache.getItem(m_id, *this);
+	std::shared_ptr<const MtpNodeMetadata> md = m_cache.getItem(m_id, *this);
 
-	if (md.self.parentId == 0)
-		return md.self.storageId;
+	if (md->self.parentId == 0)
+		return md->self.storageId;
 	else
-		return md.self.parentId;
+		return md->self.parentId;
 }
 
 
-std::vector<std::string> MtpNode::readdir()
+std::vector<std::string> MtpNode::readDirectory()
 {
-	std::vector<std::string> result;
-	result.push_back(".");
-	result.push_back("..");
-	std::vector<std::string> entries = readDirectory();
-	result.insert(result.end(), entries.begin(), entries.end());
-	return result;
+	throw NotADirectory();
 }
 
-std::vector<std::string> MtpNode::readDirectory()
+std::vector<MtpDirectoryEntry> MtpNode::readDirectoryEntries()
 {
 	throw NotADirectory();
 }
 
+ino_t MtpNode::InodeNumber(uint32_t storageId, uint32_t objectId)
+{
+	return (((uint64_t) storageId) << 32) | objectId;
+}
 
-void MtpNode::Open()
+
+void MtpNode::Open(bool forWriting)
 {
 	throw NotImplemented("Open");
 }
@@ -71,6 +71,15 @@ void MtpNode::Close()
 	throw NotImplemented("Close");
 }
 
+void MtpNode::Flush()
+{
+}
+
+void MtpNode::Fsync()
+{
+	// Only files hold on to anything
+}
+
 int MtpNode::Read(char *buf, size_t size, off_t offset)
 {
 	throw NotImplemented("Read");
@@ -97,11 +106,21 @@ int MtpNode::Write(const char* buf, size_t size, off_t offset)
 	throw NotImplemented("Write");
 }
 
+std::shared_ptr<MtpLocalFileCopy> MtpNode::OpenedCopy(bool forWriting)
+{
+	return std::shared_ptr<MtpLocalFileCopy>();
+}
+
 void MtpNode::Truncate(off_t length)
 {
 	throw NotImplemented("Truncate");
 }
 
+void MtpNode::Allocate(off_t offset, off_t length)
+{
+	throw NotImplemented("Allocate");
+}
+
 void MtpNode::Rename(MtpNode& newParent, const std::string& newName)
 {
 	throw NotImplemented("Rename");
@@ -119,8 +138,8 @@ uint32_t MtpNode::StorageId()
 
 MtpStorageInfo MtpNode::GetStorageInfo()
 {
-	MtpNodeMetadata md = m_cache.getItem(m_id, *this);
-	return m_device.GetStorageInfo(md.self.storageId);
+	std::shared_ptr<const MtpNodeMetadata> md = m_cache.getItem(m_id, *this);
+	return m_device.GetStorageInfo(md->self.storageId);
 }
 
 void MtpNode::statfs(struct statvfs *stat)
@@ -30,6 +30,23 @@
 #include <vector>
 #include <string>
 #include <memory>
+#include <atomic>
+
+// The inode number of the device root. Everything else is numbered
+// (storage id << 32) | object id, with object id 0 for a storage area.
+// A file that has been sent back under a new object id keeps the number
+// it had before.
+#define MTP_ROOT_INODE 1
+// The /.jmtpfs folder and the files in it, which come from jmtpfs rather than the device
+#define MTP_CONTROL_FOLDER_INODE 2
+#define MTP_STATS_FILE_INODE 3
+#define MTP_TIMELINE_FILE_INODE 4
+
+struct MtpDirectoryEntry
+{
+	std::string	name;
+	struct stat	info;	// as much as the folder listing tells us
+};
 
 class MtpNode : public MtpMetadataCacheFiller
 {
@@ -37,19 +54,26 @@ public:
 	MtpNode(MtpDevice& device, MtpMetadataCache& cache, uint32_t id);
 	virtual ~MtpNode();
 
-	virtual std::vector<std::string> readdir();
-
 	virtual uint32_t Id();
 
 	virtual std::unique_ptr<MtpNode> getNode(const FilesystemPath& path)=0;
 
 	virtual std::vector<std::string> readDirectory();
+	virtual std::vector<MtpDirectoryEntry> readDirectoryEntries();
 	virtual void getattr(struct stat& info) = 0;
 
-	virtual void Open();
+	virtual void Open(bool forWriting);
+	// Called each time a descriptor for the open file is closed
+	virtual void Flush();
+	// Called once the file isn't open through this node any more
 	virtual void Close();
+	// Returns once everything written has reached the device
+	virtual void Fsync();
 	virtual int Read(char *buf, size_t size, off_t offset);
 	virtual int Write(const char* buf, size_t size, off_t offset);
+	// The local copy of the file, for moving data between it and the kernel
+	// directly. Empty if reads or writes have to go through Read and Write.
+	virtual std::shared_ptr<MtpLocalFileCopy> OpenedCopy(bool forWriting);
 
 	virtual void mkdir(const std::string& name);
 	virtual void Remove();
@@ -59,6 +83,8 @@ public:
 	virtual void Rename(MtpNode& newParent, const std::string& newName);
 
 	virtual void Truncate(off_t length);
+	// Makes sure the file is at least offset + length bytes long
+	virtual void Allocate(off_t offset, off_t length);
 
 	virtual MtpStorageInfo GetStorageInfo();
 
@@ -70,12 +96,15 @@ public:
 
 	virtual void statfs(struct statvfs *stat);
 
+	static ino_t InodeNumber(uint32_t storageId, uint32_t objectId);
+
 protected:
 	uint32_t GetParentNodeId();
 
 	MtpDevice&					m_device;
 	MtpMetadataCache&			m_cache;
-	uint32_t					m_id;
+	// An open file's node is shared by the FUSE threads working on it
+	std::atomic<uint32_t>		m_id;
 };
 
 
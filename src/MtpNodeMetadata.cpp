@@ -0,0 +1,46 @@
+/*
+ * MtpNodeMetadata.cpp
+ *
+ * This software is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 3 as published by the Free Software Foundation.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02111-1301, USA.
+ * licensing@fsf.org
+ */
+#include "MtpNodeMetadata.h"
+
+void MtpNodeMetadata::indexChildren()
+{
+	m_childrenByName.clear();
+	m_childrenByName.reserve(children.size());
+	// If there are duplicate names the first one wins, same as a linear search would
+	for(size_t i = 0; i < children.size(); i++)
+		m_childrenByName.insert(std::make_pair(children[i].name, i));
+	m_indexed = true;
+}
+
+const MtpFileInfo* MtpNodeMetadata::findChild(const std::string& name) const
+{
+	if (!m_indexed)
+	{
+		for(std::vector<MtpFileInfo>::const_iterator i = children.begin(); i != children.end(); i++)
+		{
+			if (i->name == name)
+				return &(*i);
+		}
+		return 0;
+	}
+	std::unordered_map<std::string, size_t>::const_iterator i = m_childrenByName.find(name);
+	if (i == m_childrenByName.end())
+		return 0;
+	return &children[i->second];
+}
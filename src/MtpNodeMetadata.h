@@ -23,14 +23,27 @@
 #define MTPNODEMETADATA_H_
 
 #include "MtpDevice.h"
+#include <string>
+#include <unordered_map>
 #include <vector>
 
 class MtpNodeMetadata
 {
 public:
+	MtpNodeMetadata() : m_indexed(false) {}
+
 	MtpFileInfo					self;
 	std::vector<MtpFileInfo>	children;
 	std::vector<MtpStorageInfo>	storages;
+
+	// Builds the by name lookup used by findChild. The cache calls this
+	// once, before the metadata is shared, and it is read only after that.
+	void indexChildren();
+	const MtpFileInfo* findChild(const std::string& name) const;
+
+private:
+	bool									m_indexed;
+	std::unordered_map<std::string, size_t>	m_childrenByName;
 };
 
 
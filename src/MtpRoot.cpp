@@ -21,14 +21,22 @@
 #include "MtpRoot.h"
 #include "mtpFilesystemErrors.h"
 #include "MtpStorage.h"
+#include "MtpControlFolder.h"
 #include <limits>
+#include <string.h>
 
 MtpRoot::MtpRoot(MtpDevice& device, MtpMetadataCache& cache) : MtpNode(device, cache, std::numeric_limits<uint32_t>::max())
 {
 }
 
+std::unique_ptr<MtpNode> MtpRoot::Clone()
+{
+	return std::unique_ptr<MtpNode>(new MtpRoot(m_device, m_cache));
+}
+
 void MtpRoot::getattr(struct stat& info)
 {
+	info.st_ino = MTP_ROOT_INODE;
 	info.st_mode = S_IFDIR | 0755;
 	info.st_nlink = 2 + readDirectory().size();
 
@@ -36,12 +44,21 @@ void MtpRoot::getattr(struct stat& info)
 
 std::unique_ptr<MtpNode> MtpRoot::getNode(const FilesystemPath& path)
 {
-	MtpNodeMetadata md = m_cache.getItem(m_id, *this);
-
 	if (path.Empty())
 		throw FileNotFound(path.str());
 	std::string storageName = path.Head();
-	for(std::vector<MtpStorageInfo>::iterator i = md.storages.begin(); i != md.storages.end(); i++)
+	if (storageName == MtpControlFolder::Name)
+	{
+		std::unique_ptr<MtpNode> controlFolder(new MtpControlFolder(m_device, m_cache));
+		FilesystemPath childPath = path.Body();
+		if (childPath.Empty())
+			return controlFolder;
+		else
+			return controlFolder->getNode(childPath);
+	}
+
+	std::shared_ptr<const MtpNodeMetadata> md = m_cache.getItem(m_id, *this);
+	for(std::vector<MtpStorageInfo>::const_iterator i = md->storages.begin(); i != md->storages.end(); i++)
 	{
 		if (i->description == storageName)
 		{
@@ -60,14 +77,29 @@ std::unique_ptr<MtpNode> MtpRoot::getNode(const FilesystemPath& path)
 
 std::vector<std::string> MtpRoot::readDirectory()
 {
-	MtpNodeMetadata md = m_cache.getItem(m_id, *this);
+	std::shared_ptr<const MtpNodeMetadata> md = m_cache.getItem(m_id, *this);
 
 	std::vector<std::string> result;
-	for(std::vector<MtpStorageInfo>::iterator i = md.storages.begin(); i != md.storages.end(); i++)
+	for(std::vector<MtpStorageInfo>::const_iterator i = md->storages.begin(); i != md->storages.end(); i++)
 		result.push_back(i->description);
 	return result;
 }
 
+std::vector<MtpDirectoryEntry> MtpRoot::readDirectoryEntries()
+{
+	std::shared_ptr<const MtpNodeMetadata> md = m_cache.getItem(m_id, *this);
+
+	std::vector<MtpDirectoryEntry> result(md->storages.size());
+	for(size_t i = 0; i < md->storages.size(); i++)
+	{
+		result[i].name = md->storages[i].description;
+		memset(&result[i].info, 0, sizeof(result[i].info));
+		result[i].info.st_ino = InodeNumber(md->storages[i].id, 0);
+		result[i].info.st_mode = S_IFDIR | 0755;
+		result[i].info.st_nlink = 2;
+	}
+	return result;
+}
 
 void MtpRoot::mkdir(const std::string& name)
 {
@@ -33,6 +33,9 @@ public:
 	void getattr(struct stat& info);
 
 	std::vector<std::string> readDirectory();
+	std::vector<MtpDirectoryEntry> readDirectoryEntries();
+
+	std::unique_ptr<MtpNode> Clone();
 
 	void mkdir(const std::string& name);
 	void Remove();
@@ -0,0 +1,448 @@
+/*
+ * MtpSimulatedDevice.cpp
+ *
+ * This software is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 3 as published by the Free Software Foundation.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02111-1301, USA.
+ * licensing@fsf.org
+ */
+#include "MtpSimulatedDevice.h"
+#include "mtpFilesystemErrors.h"
+
+#include <errno.h>
+#include <unistd.h>
+#include <algorithm>
+#include <sstream>
+#include <stdexcept>
+
+// All the generated files get the same modification date
+static const time_t generatedModificationDate = 1356998400;
+
+const uint32_t MtpSimulatedDevice::StorageId;
+const uint64_t MtpSimulatedDevice::Capacity;
+
+MtpSimulatedDeviceSettings::MtpSimulatedDeviceSettings() : latencyMicroseconds(2000), bandwidthKBps(20000),
+		folders(10), filesPerFolder(100), fileSize(256*1024), partialObject(true), editObjects(true),
+		storageName("Simulated Storage")
+{
+
+}
+
+MtpSimulatedDeviceSettings MtpSimulatedDeviceSettings::Parse(const std::string& settingsStr)
+{
+	MtpSimulatedDeviceSettings settings;
+	std::istringstream input(settingsStr);
+	std::string item;
+	while(std::getline(input, item, ','))
+	{
+		size_t p = item.find('=');
+		if (p == std::string::npos)
+			throw std::invalid_argument("Expected name=value: " + item);
+		std::string name = item.substr(0, p);
+		std::istringstream valueStr(item.substr(p + 1));
+		unsigned value;
+		valueStr >> value;
+		if (valueStr.fail() || !valueStr.eof())
+			throw std::invalid_argument("Invalid value for " + name);
+
+		if (name == "latency")
+			settings.latencyMicroseconds = value;
+		else if (name == "bandwidth")
+			settings.bandwidthKBps = value;
+		else if (name == "folders")
+			settings.folders = value;
+		else if (name == "files")
+			settings.filesPerFolder = value;
+		else if (name == "filesize")
+			settings.fileSize = value;
+		else if (name == "partial")
+			settings.partialObject = value != 0;
+		else if (name == "edit")
+			settings.editObjects = value != 0;
+		else
+			throw std::invalid_argument("Unknown setting " + name);
+	}
+	return settings;
+}
+
+MtpSimulatedDevice::MtpSimulatedDevice(const MtpSimulatedDeviceSettings& settings) :
+		m_settings(settings), m_nextId(1)
+{
+	m_supportsPartialObject = settings.partialObject;
+	m_supportsEditObjects = settings.editObjects;
+
+	if (settings.storageName.empty())
+		return;
+	m_storages[StorageId] = settings.storageName;
+	for(unsigned f = 0; f < settings.folders; f++)
+	{
+		std::ostringstream folderName;
+		folderName << "folder" << f;
+		uint32_t folderId = AddObject(folderName.str(), 0, StorageId, LIBMTP_FILETYPE_FOLDER, 0);
+		for(unsigned i = 0; i < settings.filesPerFolder; i++)
+		{
+			std::ostringstream fileName;
+			fileName << "file" << i << ".jpg";
+			uint32_t id = AddObject(fileName.str(), folderId, StorageId, LIBMTP_FILETYPE_JPEG, settings.fileSize);
+			m_objects[id].generated = true;
+		}
+	}
+}
+
+uint32_t MtpSimulatedDevice::AddStorage(const std::string& description)
+{
+	LockMutex lock(m_mutex);
+
+	for(std::map<uint32_t, std::string>::iterator i = m_storages.begin(); i != m_storages.end(); i++)
+		if (i->second == description)
+			return i->first;
+	// Storage ids have the physical storage number in the top half
+	uint32_t id = StorageId;
+	if (!m_storages.empty())
+		id = m_storages.rbegin()->first + 0x00010000;
+	m_storages[id] = description;
+	return id;
+}
+
+uint32_t MtpSimulatedDevice::AddPath(uint32_t storageId, const std::string& path, bool folder, uint64_t size)
+{
+	LockMutex lock(m_mutex);
+
+	if (m_storages.find(storageId) == m_storages.end())
+		throw MtpError("Invalid storage id", LIBMTP_ERROR_GENERAL);
+	uint32_t parentId = 0;
+	size_t start = 0;
+	while(start < path.size())
+	{
+		size_t end = path.find('/', start);
+		if (end == std::string::npos)
+			end = path.size();
+		std::string name = path.substr(start, end - start);
+		start = end + 1;
+		if (name.empty())
+			continue;
+		bool last = start >= path.size();
+		uint32_t id = FindChild(storageId, parentId, name);
+		if (id == 0)
+		{
+			if (last && !folder)
+			{
+				id = AddObject(name, parentId, storageId, LIBMTP_FILETYPE_UNKNOWN, size);
+				m_objects[id].generated = true;
+			}
+			else
+				id = AddObject(name, parentId, storageId, LIBMTP_FILETYPE_FOLDER, 0);
+		}
+		parentId = id;
+	}
+	return parentId;
+}
+
+uint32_t MtpSimulatedDevice::FindChild(uint32_t storageId, uint32_t parentId, const std::string& name)
+{
+	std::set<uint32_t>& children = m_children[parentId];
+	for(std::set<uint32_t>::iterator i = children.begin(); i != children.end(); i++)
+	{
+		MtpFileInfo& info = m_objects[*i].info;
+		if ((info.storageId == storageId) && (info.name == name))
+			return *i;
+	}
+	return 0;
+}
+
+uint32_t MtpSimulatedDevice::AddObject(const std::string& name, uint32_t parentId, uint32_t storageId,
+		LIBMTP_filetype_t type, uint64_t size)
+{
+	uint32_t id = m_nextId++;
+	Object& object = m_objects[id];
+	object.info = MtpFileInfo(id, parentId, storageId, name, type, size);
+	object.info.modificationdate = generatedModificationDate;
+	m_children[parentId].insert(id);
+	return id;
+}
+
+MtpSimulatedDevice::Object& MtpSimulatedDevice::GetObject(uint32_t id)
+{
+	std::map<uint32_t, Object>::iterator i = m_objects.find(id);
+	if (i == m_objects.end())
+		throw MtpError("Invalid object handle", LIBMTP_ERROR_GENERAL);
+	return i->second;
+}
+
+size_t MtpSimulatedDevice::ReadObject(Object& object, uint64_t offset, size_t size, char* buffer)
+{
+	if (offset >= object.info.filesize)
+		return 0;
+	size = std::min<uint64_t>(size, object.info.filesize - offset);
+	if (object.generated)
+	{
+		for(size_t i = 0; i < size; i++)
+			buffer[i] = (char) ((object.info.id * 31 + offset + i) & 0xFF);
+	}
+	else
+		memcpy(buffer, &object.data[offset], size);
+	return size;
+}
+
+void MtpSimulatedDevice::Transaction(size_t bytes)
+{
+	uint64_t delay = m_settings.latencyMicroseconds;
+	if (m_settings.bandwidthKBps)
+		delay += ((uint64_t) bytes) * 1000000 / (((uint64_t) m_settings.bandwidthKBps) * 1024);
+	if (delay)
+		usleep(delay);
+}
+
+std::string MtpSimulatedDevice::DoGetModelname()
+{
+	Transaction(0);
+	return "Simulated device";
+}
+
+std::string MtpSimulatedDevice::DoGetSerialnumber()
+{
+	Transaction(0);
+	return "jmtpfs-simulated";
+}
+
+std::vector<MtpStorageInfo> MtpSimulatedDevice::DoGetStorageDevices()
+{
+	Transaction(0);
+	LockMutex lock(m_mutex);
+
+	std::map<uint32_t, uint64_t> used;
+	for(std::map<uint32_t, Object>::iterator i = m_objects.begin(); i != m_objects.end(); i++)
+		used[i->second.info.storageId] += i->second.info.filesize;
+	std::vector<MtpStorageInfo> result;
+	for(std::map<uint32_t, std::string>::iterator i = m_storages.begin(); i != m_storages.end(); i++)
+		result.push_back(MtpStorageInfo(i->first, i->second, Capacity - std::min(used[i->first], Capacity), Capacity));
+	return result;
+}
+
+std::vector<MtpFileInfo> MtpSimulatedDevice::DoGetFolderContents(uint32_t storageId, uint32_t folderId)
+{
+	LockMutex lock(m_mutex);
+
+	if (folderId == 0xFFFFFFFF)
+		folderId = 0;
+	std::vector<MtpFileInfo> result;
+	std::set<uint32_t>& children = m_children[folderId];
+	for(std::set<uint32_t>::iterator i = children.begin(); i != children.end(); i++)
+	{
+		// The roots of all the storages share parent 0
+		MtpFileInfo& info = m_objects[*i].info;
+		if (info.storageId == storageId)
+			result.push_back(info);
+	}
+	// Roughly what the object info for each entry would take on the wire
+	Transaction(result.size() * 128);
+	return result;
+}
+
+MtpFileInfo MtpSimulatedDevice::DoGetFileInfo(uint32_t id)
+{
+	Transaction(128);
+	LockMutex lock(m_mutex);
+
+	return GetObject(id).info;
+}
+
+void MtpSimulatedDevice::DoGetFile(uint32_t id, int fd)
+{
+	std::vector<char> contents;
+	{
+		LockMutex lock(m_mutex);
+
+		Object& object = GetObject(id);
+		contents.resize(object.info.filesize);
+		if (!contents.empty())
+			ReadObject(object, 0, contents.size(), &contents[0]);
+	}
+	Transaction(contents.size());
+	size_t written = 0;
+	while(written < contents.size())
+	{
+		ssize_t n = write(fd, &contents[written], contents.size() - written);
+		if (n < 0)
+			throw WriteError(errno);
+		written += n;
+	}
+}
+
+size_t MtpSimulatedDevice::DoGetPartialObject(uint32_t id, uint64_t offset, uint32_t maxBytes, void* buffer)
+{
+	size_t size;
+	{
+		LockMutex lock(m_mutex);
+
+		size = ReadObject(GetObject(id), offset, maxBytes, (char*) buffer);
+	}
+	Transaction(size);
+	return size;
+}
+
+void MtpSimulatedDevice::StoreSentObject(LIBMTP_file_t* destination, std::vector<char>& contents)
+{
+	Transaction(contents.size());
+
+	LockMutex lock(m_mutex);
+	if (m_storages.find(destination->storage_id) == m_storages.end())
+		throw MtpError("Invalid storage id", LIBMTP_ERROR_GENERAL);
+	if ((destination->parent_id != 0) && (GetObject(destination->parent_id).info.filetype != LIBMTP_FILETYPE_FOLDER))
+		throw MtpError("Parent is not a folder", LIBMTP_ERROR_GENERAL);
+	uint32_t id = AddObject(destination->filename, destination->parent_id, destination->storage_id,
+			destination->filetype, contents.size());
+	Object& object = m_objects[id];
+	object.info.modificationdate = time(0);
+	object.data.swap(contents);
+	destination->item_id = id;
+}
+
+void MtpSimulatedDevice::DoSendFile(LIBMTP_file_t* destination, int fd)
+{
+	std::vector<char> contents(destination->filesize);
+	size_t got = 0;
+	while(got < contents.size())
+	{
+		ssize_t n = pread(fd, &contents[got], contents.size() - got, got);
+		if (n < 0)
+			throw ReadError(errno);
+		if (n == 0)
+			throw ReadError(EIO);
+		got += n;
+	}
+	StoreSentObject(destination, contents);
+}
+
+void MtpSimulatedDevice::DoSendStream(LIBMTP_file_t* destination, int fd, const std::atomic<bool>& cancel)
+{
+	std::vector<char> contents(destination->filesize);
+	size_t got = 0;
+	while(got < contents.size())
+	{
+		if (cancel)
+			throw MtpError("Transfer cancelled", LIBMTP_ERROR_CANCELLED);
+		ssize_t n = read(fd, &contents[got], contents.size() - got);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			throw ReadError(errno);
+		}
+		if (n == 0)
+			throw ReadError(EIO);
+		got += n;
+	}
+	StoreSentObject(destination, contents);
+}
+
+void MtpSimulatedDevice::DoBeginEditObject(uint32_t id)
+{
+	Transaction(0);
+	LockMutex lock(m_mutex);
+
+	GetObject(id);
+}
+
+void MtpSimulatedDevice::DoSendPartialObject(uint32_t id, uint64_t offset, const unsigned char* data, uint32_t size)
+{
+	Transaction(size);
+	LockMutex lock(m_mutex);
+
+	Object& object = GetObject(id);
+	if (object.generated)
+	{
+		// Make the generated contents real before changing them
+		std::vector<char> contents(object.info.filesize);
+		if (!contents.empty())
+			ReadObject(object, 0, contents.size(), &contents[0]);
+		object.data.swap(contents);
+		object.generated = false;
+	}
+	if (offset + size > object.data.size())
+		object.data.resize(offset + size);
+	memcpy(&object.data[offset], data, size);
+	object.info.filesize = object.data.size();
+	object.info.modificationdate = time(0);
+}
+
+void MtpSimulatedDevice::DoTruncateObject(uint32_t id, uint64_t size)
+{
+	Transaction(0);
+	LockMutex lock(m_mutex);
+
+	Object& object = GetObject(id);
+	if (object.generated)
+	{
+		std::vector<char> contents(std::min<uint64_t>(object.info.filesize, size));
+		if (!contents.empty())
+			ReadObject(object, 0, contents.size(), &contents[0]);
+		object.data.swap(contents);
+		object.generated = false;
+	}
+	object.data.resize(size);
+	object.info.filesize = size;
+	object.info.modificationdate = time(0);
+}
+
+void MtpSimulatedDevice::DoEndEditObject(uint32_t id)
+{
+	Transaction(0);
+	LockMutex lock(m_mutex);
+
+	GetObject(id);
+}
+
+void MtpSimulatedDevice::DoCreateFolder(const std::string& name, uint32_t parentId, uint32_t storageId)
+{
+	Transaction(0);
+	LockMutex lock(m_mutex);
+
+	if (m_storages.find(storageId) == m_storages.end())
+		throw MtpError("Invalid storage id", LIBMTP_ERROR_GENERAL);
+	if ((parentId != 0) && (GetObject(parentId).info.filetype != LIBMTP_FILETYPE_FOLDER))
+		throw MtpError("Parent is not a folder", LIBMTP_ERROR_GENERAL);
+	uint32_t id = AddObject(name, parentId, storageId, LIBMTP_FILETYPE_FOLDER, 0);
+	m_objects[id].info.modificationdate = time(0);
+}
+
+void MtpSimulatedDevice::DoDeleteObject(uint32_t id)
+{
+	Transaction(0);
+	LockMutex lock(m_mutex);
+
+	Object& object = GetObject(id);
+	if (!m_children[id].empty())
+		throw MtpError("Folder not empty", LIBMTP_ERROR_GENERAL);
+	m_children.erase(id);
+	m_children[object.info.parentId].erase(id);
+	m_objects.erase(id);
+}
+
+void MtpSimulatedDevice::DoRenameFile(uint32_t id, const std::string& newName)
+{
+	Transaction(0);
+	LockMutex lock(m_mutex);
+
+	GetObject(id).info.name = newName;
+}
+
+void MtpSimulatedDevice::DoSetObjectProperty(uint32_t id, LIBMTP_property_t property, const std::string& value)
+{
+	Transaction(0);
+	LockMutex lock(m_mutex);
+
+	Object& object = GetObject(id);
+	if ((property == LIBMTP_PROPERTY_Name) || (property == LIBMTP_PROPERTY_ObjectFileName))
+		object.info.name = value;
+}
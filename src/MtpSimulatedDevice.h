@@ -0,0 +1,122 @@
+/*
+ * MtpSimulatedDevice.h
+ *
+ * This software is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 3 as published by the Free Software Foundation.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02111-1301, USA.
+ * licensing@fsf.org
+ */
+
+#ifndef MTPSIMULATEDDEVICE_H_
+#define MTPSIMULATEDDEVICE_H_
+
+#include "MtpDevice.h"
+#include "Mutex.h"
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+struct MtpSimulatedDeviceSettings
+{
+	MtpSimulatedDeviceSettings();
+
+	// Parses a comma separated list of name=value pairs, for example
+	// "latency=2000,bandwidth=20000,folders=10,files=1000". Throws
+	// std::invalid_argument if it can't.
+	static MtpSimulatedDeviceSettings Parse(const std::string& settings);
+
+	unsigned	latencyMicroseconds;	// per command
+	unsigned	bandwidthKBps;			// 0 for unlimited
+	unsigned	folders;				// created in the storage root
+	unsigned	filesPerFolder;
+	unsigned	fileSize;
+	bool		partialObject;			// GetPartialObject supported
+	bool		editObjects;			// Android edit extensions supported
+	std::string	storageName;			// of the initial storage, empty for none
+};
+
+/*
+ * An in memory device, so that the caching and scheduling above the device
+ * can be exercised and timed without a phone attached. It starts out with a
+ * single storage area holding the configured number of folders and files,
+ * and each command sleeps for the configured latency plus the time its data
+ * would take at the configured bandwidth. The contents of the initial files
+ * are generated rather than stored, so large trees don't need the memory.
+ */
+class MtpSimulatedDevice : public MtpDevice
+{
+public:
+	MtpSimulatedDevice(const MtpSimulatedDeviceSettings& settings);
+
+	// The id of the initial storage
+	static const uint32_t StorageId = 0x00010001;
+
+	// For setting up a particular tree (the trace replay uses these). AddStorage
+	// returns the id of the storage with that name, adding it if needed. AddPath
+	// creates any missing folders in path (relative to the storage root) and then
+	// the object itself, a folder or a file of the given size with generated
+	// contents, unless it already exists. Neither takes any simulated time.
+	uint32_t AddStorage(const std::string& description);
+	uint32_t AddPath(uint32_t storageId, const std::string& path, bool folder, uint64_t size);
+
+protected:
+	std::string DoGetModelname();
+	std::string DoGetSerialnumber();
+	std::vector<MtpStorageInfo> DoGetStorageDevices();
+	std::vector<MtpFileInfo> DoGetFolderContents(uint32_t storageId, uint32_t folderId);
+	MtpFileInfo DoGetFileInfo(uint32_t id);
+	void DoGetFile(uint32_t id, int fd);
+	size_t DoGetPartialObject(uint32_t id, uint64_t offset, uint32_t maxBytes, void* buffer);
+	void DoSendFile(LIBMTP_file_t* destination, int fd);
+	void DoSendStream(LIBMTP_file_t* destination, int fd, const std::atomic<bool>& cancel);
+	void DoBeginEditObject(uint32_t id);
+	void DoSendPartialObject(uint32_t id, uint64_t offset, const unsigned char* data, uint32_t size);
+	void DoTruncateObject(uint32_t id, uint64_t size);
+	void DoEndEditObject(uint32_t id);
+	void DoCreateFolder(const std::string& name, uint32_t parentId, uint32_t storageId);
+	void DoDeleteObject(uint32_t id);
+	void DoRenameFile(uint32_t id, const std::string& newName);
+	void DoSetObjectProperty(uint32_t id, LIBMTP_property_t property, const std::string& value);
+
+	struct Object
+	{
+		Object() : generated(false) {}
+
+		MtpFileInfo			info;
+		bool				generated;	// contents come from ReadGenerated instead of data
+		std::vector<char>	data;
+	};
+
+	// Adds the object a SendObject delivered and sets destination->item_id
+	void StoreSentObject(LIBMTP_file_t* destination, std::vector<char>& contents);
+	uint32_t AddObject(const std::string& name, uint32_t parentId, uint32_t storageId, LIBMTP_filetype_t type,
+			uint64_t size);
+	uint32_t FindChild(uint32_t storageId, uint32_t parentId, const std::string& name);
+	Object& GetObject(uint32_t id);
+	size_t ReadObject(Object& object, uint64_t offset, size_t size, char* buffer);
+	void Transaction(size_t bytes);
+
+	static const uint64_t Capacity = 64ULL * 1024 * 1024 * 1024;
+
+	MtpSimulatedDeviceSettings					m_settings;
+	RecursiveMutex								m_mutex;
+	uint32_t									m_nextId;
+	std::map<uint32_t, std::string>				m_storages;
+	std::map<uint32_t, Object>					m_objects;
+	std::map<uint32_t, std::set<uint32_t> >		m_children;
+};
+
+
+#endif /* MTPSIMULATEDDEVICE_H_ */
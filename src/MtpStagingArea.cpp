@@ -0,0 +1,217 @@
+/*
+ * MtpStagingArea.cpp
+ *
+ * This software is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 3 as published by the Free Software Foundation.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02111-1301, USA.
+ * licensing@fsf.org
+ */
+#include "MtpStagingArea.h"
+#include "MtpStats.h"
+#include "mtpFilesystemErrors.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+const uint64_t MtpStagingArea::SmallFileBytes;
+const int MtpStagingArea::MaxWaitSeconds;
+
+MtpStagedFile::MtpStagedFile(MtpStagingArea& area, int fd, bool inMemory, uint64_t size) :
+	m_area(area), m_fd(fd), m_inMemory(inMemory), m_size(size)
+{
+}
+
+MtpStagedFile::~MtpStagedFile()
+{
+	if (m_fd >= 0)
+		close(m_fd);
+	m_area.release(*this);
+}
+
+void MtpStagedFile::resize(uint64_t size)
+{
+	m_area.resize(*this, size);
+}
+
+MtpStagingArea::MtpStagingArea(const std::string& directory, uint64_t budgetBytes, uint64_t memoryBytes) :
+	m_mutex(MtpStats::LockStaging), m_directory(directory), m_budgetBytes(budgetBytes),
+	m_memoryBytes(memoryBytes), m_usedMemory(0), m_usedDisk(0)
+{
+	if (m_directory.empty())
+	{
+		const char* tmpdir = getenv("TMPDIR");
+		m_directory = (tmpdir && *tmpdir) ? tmpdir : P_tmpdir;
+	}
+	updateStats();
+}
+
+MtpStagingArea::~MtpStagingArea()
+{
+}
+
+std::unique_ptr<MtpStagedFile> MtpStagingArea::create(uint64_t size)
+{
+	std::unique_ptr<MtpStagedFile> result;
+	{
+		LockMutex lock(m_mutex);
+
+		makeRoom(size, 0);
+		bool inMemory = (size <= SmallFileBytes) && (m_usedMemory + size <= m_memoryBytes);
+		// Counted from now on, so that opens running alongside see it
+		result.reset(new MtpStagedFile(*this, -1, inMemory, size));
+		(inMemory ? m_usedMemory : m_usedDisk) += size;
+		updateStats();
+	}
+
+	int fd = -1;
+#ifdef MFD_CLOEXEC
+	if (result->m_inMemory)
+		fd = memfd_create("jmtpfs", MFD_CLOEXEC);
+#endif
+	if ((fd < 0) && result->m_inMemory)
+	{
+		LockMutex lock(m_mutex);
+		m_usedMemory -= size;
+		m_usedDisk += size;
+		result->m_inMemory = false;
+		updateStats();
+	}
+	if (fd < 0)
+		fd = createOnDisk();
+	result->m_fd = fd;
+	return result;
+}
+
+// Called with m_mutex held, before adding bytes to a file that already
+// has ownBytes. A file bigger than the whole budget only has to wait
+// until it's alone.
+void MtpStagingArea::makeRoom(uint64_t bytes, uint64_t ownBytes)
+{
+	if (!m_budgetBytes || (m_usedMemory + m_usedDisk == ownBytes) || (m_usedMemory + m_usedDisk + bytes <= m_budgetBytes))
+		return;
+	MtpStats::Add(MtpStats::StagingWaits);
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += MaxWaitSeconds;
+	while ((m_usedMemory + m_usedDisk > ownBytes) && (m_usedMemory + m_usedDisk + bytes > m_budgetBytes))
+	{
+		if (!m_freed.Wait(m_mutex, deadline))
+			throw MtpFilesystemErrorWithErrorCode(ENOSPC, "no room left to stage file");
+	}
+}
+
+int MtpStagingArea::createOnDisk()
+{
+	int fd = -1;
+#ifdef O_TMPFILE
+	fd = open(m_directory.c_str(), O_TMPFILE | O_RDWR | O_EXCL | O_CLOEXEC, 0600);
+	if (fd >= 0)
+		return fd;
+#endif
+	// The filesystem can't do unnamed files, so make one and remove its name
+	std::string name = m_directory + "/jmtpfsXXXXXX";
+	std::vector<char> path(name.begin(), name.end());
+	path.push_back(0);
+	fd = mkstemp(&path[0]);
+	if (fd < 0)
+		throw CantCreateTempFile(errno);
+	unlink(&path[0]);
+	return fd;
+}
+
+void MtpStagingArea::resize(MtpStagedFile& file, uint64_t size)
+{
+	{
+		LockMutex lock(m_mutex);
+
+		if (size > file.m_size)
+			makeRoom(size - file.m_size, file.m_size);
+		bool fits = (size <= file.m_size) ||
+				((size <= SmallFileBytes) && (m_usedMemory - file.m_size + size <= m_memoryBytes));
+		if (!file.m_inMemory || fits)
+		{
+			uint64_t& used = file.m_inMemory ? m_usedMemory : m_usedDisk;
+			used = used - file.m_size + size;
+			if (size < file.m_size)
+				m_freed.Broadcast();
+			file.m_size = size;
+			updateStats();
+			return;
+		}
+	}
+
+	// Too big for memory now, so copy it to disk and put the disk file in
+	// its place. Only the file's owner uses it, so nothing else can change
+	// it meanwhile.
+	int disk = createOnDisk();
+	int fd = file.m_fd;
+	struct stat info;
+	if (fstat(fd, &info))
+	{
+		int error = errno;
+		close(disk);
+		throw WriteError(error);
+	}
+	off_t offset = 0;
+	while(offset < info.st_size)
+	{
+		ssize_t sent = sendfile(disk, fd, &offset, info.st_size - offset);
+		if ((sent < 0) && (errno == EINTR))
+			continue;
+		if (sent <= 0)
+		{
+			int error = (sent < 0) ? errno : EIO;
+			close(disk);
+			throw WriteError(error);
+		}
+	}
+	if (dup2(disk, fd) < 0)
+	{
+		int error = errno;
+		close(disk);
+		throw WriteError(error);
+	}
+	close(disk);
+
+	LockMutex lock(m_mutex);
+	m_usedMemory -= file.m_size;
+	m_usedDisk += size;
+	file.m_inMemory = false;
+	file.m_size = size;
+	MtpStats::Add(MtpStats::StagingSpills);
+	updateStats();
+}
+
+void MtpStagingArea::release(MtpStagedFile& file)
+{
+	LockMutex lock(m_mutex);
+
+	(file.m_inMemory ? m_usedMemory : m_usedDisk) -= file.m_size;
+	m_freed.Broadcast();
+	updateStats();
+}
+
+void MtpStagingArea::updateStats()
+{
+	MtpStats::SetGauge(MtpStats::StagedMemoryBytes, m_usedMemory);
+	MtpStats::SetGauge(MtpStats::StagedDiskBytes, m_usedDisk);
+	MtpStats::SetGauge(MtpStats::StagingBudgetBytes, m_budgetBytes);
+}
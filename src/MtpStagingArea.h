@@ -0,0 +1,102 @@
+/*
+ * MtpStagingArea.h
+ *
+ * This software is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 3 as published by the Free Software Foundation.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02111-1301, USA.
+ * licensing@fsf.org
+ */
+
+#ifndef MTPSTAGINGAREA_H_
+#define MTPSTAGINGAREA_H_
+
+#include "Mutex.h"
+
+#include <memory>
+#include <stdint.h>
+#include <string>
+
+class MtpStagingArea;
+
+/*
+ * A local file holding a copy of a file on the device. Small ones are
+ * kept in memory and moved to disk if they grow too big. The descriptor
+ * stays the same when that happens.
+ */
+class MtpStagedFile
+{
+public:
+	~MtpStagedFile();
+
+	int fd() { return m_fd; }
+	uint64_t size() { return m_size; }
+	bool inMemory() { return m_inMemory; }
+	// Called before the file grows to, or after it shrinks to, size
+	void resize(uint64_t size);
+
+private:
+	friend class MtpStagingArea;
+
+	MtpStagedFile(MtpStagingArea& area, int fd, bool inMemory, uint64_t size);
+	MtpStagedFile(const MtpStagedFile&);
+	MtpStagedFile& operator=(const MtpStagedFile&);
+
+	MtpStagingArea&	m_area;
+	int				m_fd;
+	bool			m_inMemory;
+	uint64_t		m_size;
+};
+
+/*
+ * Where local copies of files live while they are open or waiting to be
+ * sent. Files of up to SmallFileBytes are kept in memory while the total
+ * there is under memoryBytes, everything else goes in directory. With a
+ * budget, a new file, or one that grows, waits (for up to MaxWaitSeconds)
+ * until enough of the other staged files have been freed to make room.
+ */
+class MtpStagingArea
+{
+public:
+	static const uint64_t SmallFileBytes = 4 * 1024 * 1024;
+	static const int MaxWaitSeconds = 30;
+
+	// An empty directory means the system's temporary directory, 0 bytes no budget
+	MtpStagingArea(const std::string& directory, uint64_t budgetBytes, uint64_t memoryBytes);
+	~MtpStagingArea();
+
+	// A new empty file, expected to grow to size
+	std::unique_ptr<MtpStagedFile> create(uint64_t size);
+
+private:
+	friend class MtpStagedFile;
+
+	MtpStagingArea(const MtpStagingArea&);
+	MtpStagingArea& operator=(const MtpStagingArea&);
+
+	void makeRoom(uint64_t bytes, uint64_t ownBytes);
+	int createOnDisk();
+	void resize(MtpStagedFile& file, uint64_t size);
+	void release(MtpStagedFile& file);
+	void updateStats();
+
+	RecursiveMutex	m_mutex;
+	Condition		m_freed;
+	std::string		m_directory;
+	uint64_t		m_budgetBytes;
+	uint64_t		m_memoryBytes;
+	uint64_t		m_usedMemory;
+	uint64_t		m_usedDisk;
+};
+
+
+#endif /* MTPSTAGINGAREA_H_ */
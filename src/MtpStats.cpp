@@ -0,0 +1,368 @@
+/*
+ * MtpStats.cpp
+ *
+ * This software is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 3 as published by the Free Software Foundation.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02111-1301, USA.
+ * licensing@fsf.org
+ */
+#include "MtpStats.h"
+#include "Mutex.h"
+
+#include <atomic>
+#include <exception>
+#include <vector>
+#include <pthread.h>
+#include <time.h>
+
+namespace
+{
+
+const int DeviceHistograms = MtpStats::FuseOpCount;
+const int LockWaitHistograms = DeviceHistograms + MtpStats::DeviceCallCount;
+const int LockHoldHistograms = LockWaitHistograms + MtpStats::LockCount;
+const int Histograms = LockHoldHistograms + MtpStats::LockCount;
+// Slow waits are counted by lock and holding operation, the last being no operation
+const int Holders = MtpStats::FuseOpCount + 1;
+const int Buckets = MtpStats::LatencyBuckets;
+
+const char* fuseOpNames[MtpStats::FuseOpCount] = { "getattr", "readdir", "open", "release", "read", "mkdir",
+		"rmdir", "create", "write", "truncate", "unlink", "flush", "rename", "statfs", "chmod", "utime",
+		"lookup", "forget", "setattr", "fallocate", "fsync" };
+
+const char* deviceCallNames[MtpStats::DeviceCallCount] = { "GetModelname", "GetSerialnumber",
+		"GetStorageDevices", "GetStorageInfo", "GetFolderContents", "GetFileInfo", "GetFile",
+		"GetPartialObject", "SendFile", "SendStream", "EditObject", "CreateFolder", "DeleteObject", "RenameFile", "SetObjectProperty" };
+
+const char* lockNames[MtpStats::LockCount] = { "modify", "libmtp", "device", "device_queue", "metadata_cache",
+		"block_cache", "dentry_cache", "inode_table", "local_file", "write_back",
+		"content_cache", "staging", "local_file_transfer" };
+
+// Only ever written by the thread that owns it
+struct ThreadStats
+{
+	ThreadStats()
+	{
+		for(int i = 0; i < MtpStats::CounterCount; i++)
+			counters[i] = 0;
+		for(int h = 0; h < Histograms; h++)
+		{
+			for(int b = 0; b < Buckets; b++)
+				buckets[h][b] = 0;
+			sums[h] = 0;
+			errors[h] = 0;
+		}
+		for(int l = 0; l < MtpStats::LockCount; l++)
+			for(int o = 0; o < Holders; o++)
+				slowWaits[l][o] = 0;
+	}
+
+	std::atomic<uint64_t>	counters[MtpStats::CounterCount];
+	std::atomic<uint64_t>	buckets[Histograms][Buckets];
+	std::atomic<uint64_t>	sums[Histograms];
+	std::atomic<uint64_t>	errors[Histograms];
+	std::atomic<uint64_t>	slowWaits[MtpStats::LockCount][Holders];
+};
+
+struct Totals
+{
+	Totals()
+	{
+		for(int i = 0; i < MtpStats::CounterCount; i++)
+			counters[i] = 0;
+		for(int h = 0; h < Histograms; h++)
+		{
+			for(int b = 0; b < Buckets; b++)
+				buckets[h][b] = 0;
+			sums[h] = 0;
+			errors[h] = 0;
+		}
+		for(int l = 0; l < MtpStats::LockCount; l++)
+			for(int o = 0; o < Holders; o++)
+				slowWaits[l][o] = 0;
+	}
+
+	uint64_t	counters[MtpStats::CounterCount];
+	uint64_t	buckets[Histograms][Buckets];
+	uint64_t	sums[Histograms];
+	uint64_t	errors[Histograms];
+	uint64_t	slowWaits[MtpStats::LockCount][Holders];
+};
+
+// Threads come and go (FUSE starts more when busy), so the copy of an exited
+// thread is handed to the next new thread rather than freed. Its counts stay
+// in the totals either way.
+RecursiveMutex					threadsMutex;
+std::vector<ThreadStats*>		allThreads;
+std::vector<ThreadStats*>		freeThreads;
+pthread_key_t					threadKey;
+pthread_once_t					threadKeyOnce = PTHREAD_ONCE_INIT;
+__thread ThreadStats*			threadStats = 0;
+__thread int					currentFuseOp = MtpStats::FuseOpCount;
+
+std::atomic<uint64_t>			gauges[MtpStats::GaugeCount];
+
+void threadExited(void* stats)
+{
+	LockMutex lock(threadsMutex);
+	freeThreads.push_back((ThreadStats*) stats);
+}
+
+void createThreadKey()
+{
+	pthread_key_create(&threadKey, threadExited);
+}
+
+ThreadStats& thisThread()
+{
+	if (!threadStats)
+	{
+		pthread_once(&threadKeyOnce, createThreadKey);
+		LockMutex lock(threadsMutex);
+		if (freeThreads.empty())
+		{
+			threadStats = new ThreadStats;
+			allThreads.push_back(threadStats);
+		}
+		else
+		{
+			threadStats = freeThreads.back();
+			freeThreads.pop_back();
+		}
+		pthread_setspecific(threadKey, threadStats);
+	}
+	return *threadStats;
+}
+
+inline void add(std::atomic<uint64_t>& value, uint64_t n)
+{
+	value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+void record(int histogram, uint64_t microseconds, bool failed)
+{
+	int bucket = 0;
+	while((bucket < Buckets - 1) && (microseconds >> bucket))
+		bucket++;
+	ThreadStats& stats = thisThread();
+	add(stats.buckets[histogram][bucket], 1);
+	add(stats.sums[histogram], microseconds);
+	if (failed)
+		add(stats.errors[histogram], 1);
+}
+
+void writeHistogram(std::ostream& out, const Totals& totals, int histogram, const char* name, const char* label,
+		const char* labelValue)
+{
+	uint64_t count = 0;
+	for(int b = 0; b < Buckets - 1; b++)
+	{
+		count += totals.buckets[histogram][b];
+		out << name << "_bucket{" << label << "=\"" << labelValue << "\",le=\"" << ((double) (1ULL << b)) / 1e6
+				<< "\"} " << count << "\n";
+	}
+	count += totals.buckets[histogram][Buckets - 1];
+	out << name << "_bucket{" << label << "=\"" << labelValue << "\",le=\"+Inf\"} " << count << "\n";
+	out << name << "_sum{" << label << "=\"" << labelValue << "\"} " << totals.sums[histogram] / 1e6 << "\n";
+	out << name << "_count{" << label << "=\"" << labelValue << "\"} " << count << "\n";
+}
+
+void writeCounter(std::ostream& out, const char* name, const char* label, const char* labelValue, uint64_t value)
+{
+	out << name << "{" << label << "=\"" << labelValue << "\"} " << value << "\n";
+}
+
+}
+
+const int MtpStats::LatencyBuckets;
+bool MtpStats::m_lockProfiling = false;
+uint64_t MtpStats::m_slowWaitMicroseconds = 0;
+
+uint64_t MtpStats::NowMicroseconds()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return ((uint64_t) now.tv_sec) * 1000000 + now.tv_nsec / 1000;
+}
+
+void MtpStats::Add(Counter counter, uint64_t n)
+{
+	add(thisThread().counters[counter], n);
+}
+
+void MtpStats::SetGauge(Gauge gauge, uint64_t value)
+{
+	gauges[gauge].store(value, std::memory_order_relaxed);
+}
+
+void MtpStats::FuseDone(FuseOp op, uint64_t microseconds, bool failed)
+{
+	record(op, microseconds, failed);
+}
+
+void MtpStats::DeviceDone(DeviceCall call, uint64_t microseconds, bool failed)
+{
+	record(DeviceHistograms + call, microseconds, failed);
+}
+
+int MtpStats::SetCurrentFuseOp(int op)
+{
+	int previous = currentFuseOp;
+	currentFuseOp = op;
+	return previous;
+}
+
+int MtpStats::CurrentFuseOp()
+{
+	return currentFuseOp;
+}
+
+void MtpStats::EnableLockProfiling(uint64_t slowWaitMicroseconds)
+{
+	m_slowWaitMicroseconds = slowWaitMicroseconds;
+	m_lockProfiling = true;
+}
+
+void MtpStats::LockWaited(Lock lock, uint64_t microseconds, int holderOp)
+{
+	record(LockWaitHistograms + lock, microseconds, false);
+	if (microseconds >= m_slowWaitMicroseconds)
+		add(thisThread().slowWaits[lock][holderOp], 1);
+}
+
+void MtpStats::LockHeld(Lock lock, uint64_t microseconds)
+{
+	record(LockHoldHistograms + lock, microseconds, false);
+}
+
+void MtpStats::WritePrometheus(std::ostream& out)
+{
+	Totals totals;
+	{
+		LockMutex lock(threadsMutex);
+
+		for(std::vector<ThreadStats*>::iterator t = allThreads.begin(); t != allThreads.end(); t++)
+		{
+			ThreadStats& stats = **t;
+			for(int i = 0; i < CounterCount; i++)
+				totals.counters[i] += stats.counters[i].load(std::memory_order_relaxed);
+			for(int h = 0; h < Histograms; h++)
+			{
+				for(int b = 0; b < Buckets; b++)
+					totals.buckets[h][b] += stats.buckets[h][b].load(std::memory_order_relaxed);
+				totals.sums[h] += stats.sums[h].load(std::memory_order_relaxed);
+				totals.errors[h] += stats.errors[h].load(std::memory_order_relaxed);
+			}
+			for(int l = 0; l < LockCount; l++)
+				for(int o = 0; o < Holders; o++)
+					totals.slowWaits[l][o] += stats.slowWaits[l][o].load(std::memory_order_relaxed);
+		}
+	}
+
+	out.precision(9);
+	out << "# HELP jmtpfs_fuse_operation_seconds Time taken by filesystem operations.\n";
+	out << "# TYPE jmtpfs_fuse_operation_seconds histogram\n";
+	for(int op = 0; op < FuseOpCount; op++)
+		writeHistogram(out, totals, op, "jmtpfs_fuse_operation_seconds", "op", fuseOpNames[op]);
+	out << "# HELP jmtpfs_fuse_operation_errors_total Filesystem operations that returned an error.\n";
+	out << "# TYPE jmtpfs_fuse_operation_errors_total counter\n";
+	for(int op = 0; op < FuseOpCount; op++)
+		writeCounter(out, "jmtpfs_fuse_operation_errors_total", "op", fuseOpNames[op], totals.errors[op]);
+
+	out << "# HELP jmtpfs_device_call_seconds Time taken by device calls, including waiting for the device.\n";
+	out << "# TYPE jmtpfs_device_call_seconds histogram\n";
+	for(int call = 0; call < DeviceCallCount; call++)
+		writeHistogram(out, totals, DeviceHistograms + call, "jmtpfs_device_call_seconds", "call", deviceCallNames[call]);
+	out << "# HELP jmtpfs_device_call_errors_total Device calls that failed.\n";
+	out << "# TYPE jmtpfs_device_call_errors_total counter\n";
+	for(int call = 0; call < DeviceCallCount; call++)
+		writeCounter(out, "jmtpfs_device_call_errors_total", "call", deviceCallNames[call],
+				totals.errors[DeviceHistograms + call]);
+
+	out << "# HELP jmtpfs_metadata_cache_requests_total File and folder information lookups.\n";
+	out << "# TYPE jmtpfs_metadata_cache_requests_total counter\n";
+	writeCounter(out, "jmtpfs_metadata_cache_requests_total", "result", "hit", totals.counters[MetadataCacheHits]);
+	writeCounter(out, "jmtpfs_metadata_cache_requests_total", "result", "miss", totals.counters[MetadataCacheMisses]);
+	writeCounter(out, "jmtpfs_metadata_cache_requests_total", "result", "expired", totals.counters[MetadataCacheExpired]);
+	out << "# HELP jmtpfs_read_cache_blocks_total Blocks of file data found in or fetched into the read cache.\n";
+	out << "# TYPE jmtpfs_read_cache_blocks_total counter\n";
+	writeCounter(out, "jmtpfs_read_cache_blocks_total", "result", "hit", totals.counters[ReadCacheHits]);
+	writeCounter(out, "jmtpfs_read_cache_blocks_total", "result", "miss", totals.counters[ReadCacheMisses]);
+	out << "# HELP jmtpfs_content_cache_requests_total Whole files found in or missing from the on disk content cache.\n";
+	out << "# TYPE jmtpfs_content_cache_requests_total counter\n";
+	writeCounter(out, "jmtpfs_content_cache_requests_total", "result", "hit", totals.counters[ContentCacheHits]);
+	writeCounter(out, "jmtpfs_content_cache_requests_total", "result", "miss", totals.counters[ContentCacheMisses]);
+	out << "# HELP jmtpfs_device_bytes_total File data transferred to and from the device.\n";
+	out << "# TYPE jmtpfs_device_bytes_total counter\n";
+	writeCounter(out, "jmtpfs_device_bytes_total", "direction", "read", totals.counters[DeviceBytesRead]);
+	writeCounter(out, "jmtpfs_device_bytes_total", "direction", "write", totals.counters[DeviceBytesWritten]);
+	out << "# HELP jmtpfs_fuse_bytes_total File data read and written through the filesystem.\n";
+	out << "# TYPE jmtpfs_fuse_bytes_total counter\n";
+	writeCounter(out, "jmtpfs_fuse_bytes_total", "direction", "read", totals.counters[FuseBytesRead]);
+	writeCounter(out, "jmtpfs_fuse_bytes_total", "direction", "write", totals.counters[FuseBytesWritten]);
+	out << "# HELP jmtpfs_staged_bytes Local copies of files being read or written.\n";
+	out << "# TYPE jmtpfs_staged_bytes gauge\n";
+	writeCounter(out, "jmtpfs_staged_bytes", "storage", "memory", gauges[StagedMemoryBytes].load(std::memory_order_relaxed));
+	writeCounter(out, "jmtpfs_staged_bytes", "storage", "disk", gauges[StagedDiskBytes].load(std::memory_order_relaxed));
+	out << "# HELP jmtpfs_staging_budget_bytes Limit on staged bytes, 0 for none.\n";
+	out << "# TYPE jmtpfs_staging_budget_bytes gauge\n";
+	out << "jmtpfs_staging_budget_bytes " << gauges[StagingBudgetBytes].load(std::memory_order_relaxed) << "\n";
+	out << "# HELP jmtpfs_staging_spills_total Local copies moved from memory to disk as they grew.\n";
+	out << "# TYPE jmtpfs_staging_spills_total counter\n";
+	out << "jmtpfs_staging_spills_total " << totals.counters[StagingSpills] << "\n";
+	out << "# HELP jmtpfs_staging_waits_total Opens that had to wait for staged bytes to be freed.\n";
+	out << "# TYPE jmtpfs_staging_waits_total counter\n";
+	out << "jmtpfs_staging_waits_total " << totals.counters[StagingWaits] << "\n";
+
+	if (!m_lockProfiling)
+		return;
+	out << "# HELP jmtpfs_lock_wait_seconds Time spent waiting to take a lock.\n";
+	out << "# TYPE jmtpfs_lock_wait_seconds histogram\n";
+	for(int l = 0; l < LockCount; l++)
+		writeHistogram(out, totals, LockWaitHistograms + l, "jmtpfs_lock_wait_seconds", "lock", lockNames[l]);
+	out << "# HELP jmtpfs_lock_hold_seconds Time a lock was held for.\n";
+	out << "# TYPE jmtpfs_lock_hold_seconds histogram\n";
+	for(int l = 0; l < LockCount; l++)
+		writeHistogram(out, totals, LockHoldHistograms + l, "jmtpfs_lock_hold_seconds", "lock", lockNames[l]);
+	out << "# HELP jmtpfs_lock_slow_waits_total Waits over " << m_slowWaitMicroseconds / 1e6
+			<< " seconds, by the operation holding the lock when the wait started.\n";
+	out << "# TYPE jmtpfs_lock_slow_waits_total counter\n";
+	for(int l = 0; l < LockCount; l++)
+		for(int o = 0; o < Holders; o++)
+			if (totals.slowWaits[l][o])
+				out << "jmtpfs_lock_slow_waits_total{lock=\"" << lockNames[l] << "\",holder=\""
+						<< (o < FuseOpCount ? fuseOpNames[o] : "none") << "\"} " << totals.slowWaits[l][o] << "\n";
+}
+
+const char* MtpStats::FuseOpName(FuseOp op)
+{
+	return fuseOpNames[op];
+}
+
+const char* MtpStats::DeviceCallName(DeviceCall call)
+{
+	return deviceCallNames[call];
+}
+
+const char* MtpStats::LockName(Lock lock)
+{
+	return lockNames[lock];
+}
+
+MtpStatsDeviceTimer::~MtpStatsDeviceTimer()
+{
+	uint64_t duration = MtpStats::NowMicroseconds() - m_start;
+	MtpStats::DeviceDone(m_call, duration, std::uncaught_exception());
+	if (MtpTimeline::Enabled())
+		MtpTimeline::Span("device", MtpStats::DeviceCallName(m_call), m_start, duration, m_bytes ? "bytes" : 0, m_bytes);
+}
@@ -0,0 +1,161 @@
+/*
+ * MtpStats.h
+ *
+ * This software is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 3 as published by the Free Software Foundation.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02111-1301, USA.
+ * licensing@fsf.org
+ */
+
+#ifndef MTPSTATS_H_
+#define MTPSTATS_H_
+
+#include "MtpTimeline.h"
+#include <stdint.h>
+#include <ostream>
+
+/*
+ * Process wide counters and latency histograms, read through the
+ * /.jmtpfs/stats file. Every thread updates its own copy of the counters
+ * with plain relaxed atomic stores, so recording costs no locked
+ * instructions or shared cache lines, and a reader adds up the copies.
+ * Latencies go in power of two microsecond buckets.
+ *
+ * Lock profiling is off unless turned on at startup. When on, each
+ * profiled lock records how long threads waited for it and held it, and
+ * waits longer than a threshold are counted by the operation that was
+ * holding the lock.
+ */
+class MtpStats
+{
+public:
+	enum FuseOp
+	{
+		FuseGetattr, FuseReaddir, FuseOpen, FuseRelease, FuseRead, FuseMkdir, FuseRmdir, FuseCreate,
+		FuseWrite, FuseTruncate, FuseUnlink, FuseFlush, FuseRename, FuseStatfs, FuseChmod, FuseUtime,
+		FuseLookup, FuseForget, FuseSetattr, FuseFallocate, FuseFsync,
+		FuseOpCount
+	};
+
+	enum DeviceCall
+	{
+		DeviceGetModelname, DeviceGetSerialnumber, DeviceGetStorageDevices, DeviceGetStorageInfo,
+		DeviceGetFolderContents, DeviceGetFileInfo, DeviceGetFile, DeviceGetPartialObject, DeviceSendFile,
+		DeviceSendStream, DeviceEditObject, DeviceCreateFolder, DeviceDeleteObject, DeviceRenameFile, DeviceSetObjectProperty,
+		DeviceCallCount
+	};
+
+	enum Counter
+	{
+		MetadataCacheHits, MetadataCacheMisses, MetadataCacheExpired,
+		ReadCacheHits, ReadCacheMisses,
+		ContentCacheHits, ContentCacheMisses,
+		DeviceBytesRead, DeviceBytesWritten,
+		FuseBytesRead, FuseBytesWritten,
+		StagingSpills, StagingWaits,
+		CounterCount
+	};
+
+	// Levels rather than totals, set by whoever owns them
+	enum Gauge
+	{
+		StagedMemoryBytes, StagedDiskBytes, StagingBudgetBytes,
+		GaugeCount
+	};
+
+	enum Lock
+	{
+		LockModify, LockLibmtp, LockDevice, LockDeviceQueue, LockMetadataCache, LockBlockCache,
+		LockDentryCache, LockInodeTable, LockLocalFile, LockWriteBack,
+		LockContentCache, LockStaging, LockLocalFileTransfer,
+		LockCount
+	};
+
+	// Bucket i holds latencies under 2^i microseconds, the last one everything else
+	static const int LatencyBuckets = 27;
+
+	static void Add(Counter counter, uint64_t n = 1);
+	static void SetGauge(Gauge gauge, uint64_t value);
+	static void FuseDone(FuseOp op, uint64_t microseconds, bool failed);
+	static void DeviceDone(DeviceCall call, uint64_t microseconds, bool failed);
+
+	// The operation the calling thread is running, or FuseOpCount if none.
+	// Returns the previous one.
+	static int SetCurrentFuseOp(int op);
+	static int CurrentFuseOp();
+
+	// Must be called before any other threads are started
+	static void EnableLockProfiling(uint64_t slowWaitMicroseconds);
+	static bool LockProfiling() { return m_lockProfiling; }
+	static void LockWaited(Lock lock, uint64_t microseconds, int holderOp);
+	static void LockHeld(Lock lock, uint64_t microseconds);
+
+	static const char* FuseOpName(FuseOp op);
+	static const char* DeviceCallName(DeviceCall call);
+	static const char* LockName(Lock lock);
+
+	// Writes everything in the Prometheus text exposition format
+	static void WritePrometheus(std::ostream& out);
+
+	static uint64_t NowMicroseconds();
+
+private:
+	static bool		m_lockProfiling;
+	static uint64_t	m_slowWaitMicroseconds;
+};
+
+// Times a FUSE operation from construction to destruction, also recording
+// it in the timeline
+class MtpStatsFuseTimer
+{
+public:
+	MtpStatsFuseTimer(MtpStats::FuseOp op) : m_op(op), m_failed(false), m_start(MtpStats::NowMicroseconds()),
+		m_previousOp(MtpStats::SetCurrentFuseOp(op)) {}
+	~MtpStatsFuseTimer()
+	{
+		uint64_t duration = MtpStats::NowMicroseconds() - m_start;
+		MtpStats::FuseDone(m_op, duration, m_failed);
+		MtpStats::SetCurrentFuseOp(m_previousOp);
+		if (MtpTimeline::Enabled())
+		{
+			MtpTimeline::Span("fuse", MtpStats::FuseOpName(m_op), m_start, duration);
+			MtpTimeline::DumpIfRequested();
+		}
+	}
+
+	void failed() { m_failed = true; }
+
+private:
+	MtpStats::FuseOp	m_op;
+	bool				m_failed;
+	uint64_t			m_start;
+	int					m_previousOp;
+};
+
+// Times a device call, counting it as failed if it ends with an exception.
+// Bytes given to it are shown on the call's span in the timeline.
+class MtpStatsDeviceTimer
+{
+public:
+	MtpStatsDeviceTimer(MtpStats::DeviceCall call) : m_call(call), m_start(MtpStats::NowMicroseconds()), m_bytes(0) {}
+	~MtpStatsDeviceTimer();
+
+	void addBytes(uint64_t bytes) { m_bytes += bytes; }
+
+private:
+	MtpStats::DeviceCall	m_call;
+	uint64_t				m_start;
+	uint64_t				m_bytes;
+};
+
+#endif /* MTPSTATS_H_ */
@@ -0,0 +1,157 @@
+/*
+ * MtpStreamingUpload.cpp
+ *
+ * This software is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 3 as published by the Free Software Foundation.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02111-1301, USA.
+ * licensing@fsf.org
+ */
+#include "MtpStreamingUpload.h"
+#include "mtpFilesystemErrors.h"
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <errno.h>
+
+const int MtpStreamingUpload::STALL_SECONDS;
+
+MtpStreamingUpload::MtpStreamingUpload(MtpDevice& device, const std::string& name, uint32_t parentId,
+		uint32_t storageId, uint64_t size, uint32_t replaceId) :
+	m_device(device), m_file(name, parentId, storageId, size), m_size(size), m_written(0),
+	m_replaceId(replaceId), m_replaced(false), m_running(false), m_cancel(false)
+{
+	// A socket rather than a pipe, so a receive timeout can catch a stalled
+	// writer and a send after the device end is gone fails without SIGPIPE.
+	int fds[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds))
+		throw MtpFilesystemErrorWithErrorCode(errno, "can't create upload socket");
+	m_feed = fds[0];
+	m_source = fds[1];
+	struct timeval timeout;
+	timeout.tv_sec = STALL_SECONDS;
+	timeout.tv_usec = 0;
+	setsockopt(m_source, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+}
+
+MtpStreamingUpload::~MtpStreamingUpload()
+{
+	cancel();
+	if (m_feed >= 0)
+		::close(m_feed);
+	if (m_source >= 0)
+		::close(m_source);
+}
+
+bool MtpStreamingUpload::start()
+{
+	if (pthread_create(&m_thread, 0, run, this))
+		return false;
+	m_running = true;
+	return true;
+}
+
+void* MtpStreamingUpload::run(void* self)
+{
+	MtpStreamingUpload& upload = *(MtpStreamingUpload*) self;
+	try
+	{
+		// The new object has to be sent under the same name, so the old
+		// one goes first.
+		if (upload.m_replaceId)
+		{
+			upload.m_device.DeleteObject(upload.m_replaceId);
+			upload.m_replaced = true;
+		}
+		upload.m_device.SendStream(upload.m_file, upload.m_source, upload.m_cancel);
+	}
+	catch(...)
+	{
+		upload.m_error = std::current_exception();
+		// The device may have created the object before the data stopped coming
+		uint32_t partialId = ((LIBMTP_file_t*)upload.m_file)->item_id;
+		if (partialId)
+		{
+			try
+			{
+				upload.m_device.DeleteObject(partialId);
+			}
+			catch(MtpError&)
+			{
+			}
+		}
+	}
+	// Makes any further write fail straight away
+	::close(upload.m_source);
+	upload.m_source = -1;
+	return 0;
+}
+
+bool MtpStreamingUpload::write(const void* data, size_t size)
+{
+	if ((m_written == 0) && !m_running && !start())
+		return false;
+	const char* p = (const char*) data;
+	size_t left = size;
+	while(left)
+	{
+		ssize_t sent = send(m_feed, p, left, MSG_NOSIGNAL);
+		if (sent < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		p += sent;
+		left -= sent;
+	}
+	m_written += size;
+	return true;
+}
+
+void MtpStreamingUpload::join()
+{
+	if (!m_running)
+		return;
+	::close(m_feed);
+	m_feed = -1;
+	pthread_join(m_thread, 0);
+	m_running = false;
+}
+
+uint32_t MtpStreamingUpload::finish()
+{
+	join();
+	if (m_error)
+		std::rethrow_exception(m_error);
+	return ((LIBMTP_file_t*)m_file)->item_id;
+}
+
+void MtpStreamingUpload::cancel()
+{
+	if (!m_running)
+		return;
+	m_cancel = true;
+	join();
+	// The last bytes may have gone through before the cancel was seen
+	uint32_t id = ((LIBMTP_file_t*)m_file)->item_id;
+	if (!m_error && id)
+	{
+		try
+		{
+			m_device.DeleteObject(id);
+		}
+		catch(MtpError&)
+		{
+		}
+	}
+}
@@ -0,0 +1,88 @@
+/*
+ * MtpStreamingUpload.h
+ *
+ * This software is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 3 as published by the Free Software Foundation.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02111-1301, USA.
+ * licensing@fsf.org
+ */
+
+#ifndef MTPSTREAMINGUPLOAD_H_
+#define MTPSTREAMINGUPLOAD_H_
+
+#include "MtpDevice.h"
+#include <atomic>
+#include <exception>
+#include <pthread.h>
+
+/*
+ * Sends a new file to the device while it is still being written. A
+ * SendObject has to be given the size up front and can't be split up, so
+ * a background thread runs it, reading from a socket that write feeds.
+ * The device can do nothing else while the transfer runs, which is paced
+ * by the writer. So the transfer only starts with the first write, and
+ * if the writer then stops feeding it for STALL_SECONDS it is given up,
+ * rather than leaving every other command waiting on it. Each pause in
+ * the writing can hold up other commands for at most that long.
+ */
+class MtpStreamingUpload
+{
+public:
+	// replaceId, if not 0, is an object with the same name that the file
+	// replaces. It is deleted just before the transfer starts, from the
+	// upload's thread rather than the caller's.
+	MtpStreamingUpload(MtpDevice& device, const std::string& name, uint32_t parentId, uint32_t storageId,
+			uint64_t size, uint32_t replaceId = 0);
+	// Cancels the transfer if finish wasn't called
+	~MtpStreamingUpload();
+
+	// Passes on the next size bytes of the file. Returns false if the
+	// transfer has failed, in which case nothing was left on the device.
+	bool write(const void* data, size_t size);
+	uint64_t written() { return m_written; }
+	uint64_t size() { return m_size; }
+	// replaceId until it has been deleted, 0 afterwards. Only settled
+	// once finish or cancel has returned.
+	uint32_t replacing() { return m_replaced ? 0 : m_replaceId; }
+
+	// Waits for the device to accept the object and returns its id. Should
+	// only be called once all size bytes have been written.
+	uint32_t finish();
+	void cancel();
+
+	static const int STALL_SECONDS = 2;
+
+private:
+	MtpStreamingUpload(const MtpStreamingUpload&);
+	MtpStreamingUpload& operator=(const MtpStreamingUpload&);
+
+	bool start();
+	static void* run(void* self);
+	void join();
+
+	MtpDevice&			m_device;
+	NewLIBMTPFile		m_file;
+	uint64_t			m_size;
+	uint64_t			m_written;
+	uint32_t			m_replaceId;
+	std::atomic<bool>	m_replaced;
+	int					m_feed;		// our end of the socket
+	int					m_source;	// the end the device reads from
+	pthread_t			m_thread;
+	bool				m_running;
+	std::atomic<bool>	m_cancel;
+	std::exception_ptr	m_error;
+};
+
+
+#endif /* MTPSTREAMINGUPLOAD_H_ */
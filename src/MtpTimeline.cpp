@@ -0,0 +1,265 @@
+/*
+ * MtpTimeline.cpp
+ *
+ * This software is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 3 as published by the Free Software Foundation.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02111-1301, USA.
+ * licensing@fsf.org
+ */
+#include "MtpTimeline.h"
+#include "MtpStats.h"
+#include "Mutex.h"
+
+#include <atomic>
+#include <fstream>
+#include <iostream>
+#include <vector>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+
+namespace
+{
+
+/*
+ * The owning thread writes a slot while a dump may be reading it, so each
+ * slot carries a sequence number that is zero while it is being written.
+ * A reader only keeps a slot if the number was the same before and after
+ * copying it.
+ */
+struct Slot
+{
+	Slot() : sequence(0) {}
+
+	std::atomic<uint64_t>		sequence;
+	std::atomic<const char*>	category;	// 0 for a counter sample
+	std::atomic<const char*>	name;
+	std::atomic<const char*>	argName;
+	std::atomic<uint64_t>		start;
+	std::atomic<uint64_t>		duration;
+	std::atomic<uint64_t>		arg;
+};
+
+struct Ring
+{
+	Ring(int t) : slots(MtpTimeline::EventsPerThread), next(0), thread(t) {}
+
+	std::vector<Slot>		slots;
+	std::atomic<uint64_t>	next;
+	int						thread;
+};
+
+struct Event
+{
+	const char*	category;
+	const char*	name;
+	const char*	argName;
+	uint64_t	start;
+	uint64_t	duration;
+	uint64_t	arg;
+};
+
+// The ring of an exited thread is reused by the next new thread, keeping
+// what it recorded until it is overwritten.
+RecursiveMutex				ringsMutex;
+std::vector<Ring*>			allRings;
+std::vector<Ring*>			freeRings;
+pthread_key_t				ringKey;
+pthread_once_t				ringKeyOnce = PTHREAD_ONCE_INIT;
+__thread Ring*				threadRing = 0;
+
+std::string					dumpFileName;
+RecursiveMutex				dumpMutex;
+
+void threadExited(void* ring)
+{
+	LockMutex lock(ringsMutex);
+	freeRings.push_back((Ring*) ring);
+}
+
+void createRingKey()
+{
+	pthread_key_create(&ringKey, threadExited);
+}
+
+Ring& thisThread()
+{
+	if (!threadRing)
+	{
+		pthread_once(&ringKeyOnce, createRingKey);
+		LockMutex lock(ringsMutex);
+		if (freeRings.empty())
+		{
+			threadRing = new Ring(allRings.size() + 1);
+			allRings.push_back(threadRing);
+		}
+		else
+		{
+			threadRing = freeRings.back();
+			freeRings.pop_back();
+		}
+		pthread_setspecific(ringKey, threadRing);
+	}
+	return *threadRing;
+}
+
+void record(const char* category, const char* name, const char* argName, uint64_t start, uint64_t duration,
+		uint64_t arg)
+{
+	Ring& ring = thisThread();
+	uint64_t index = ring.next.load(std::memory_order_relaxed);
+	Slot& slot = ring.slots[index % ring.slots.size()];
+	slot.sequence.store(0, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	slot.category.store(category, std::memory_order_relaxed);
+	slot.name.store(name, std::memory_order_relaxed);
+	slot.argName.store(argName, std::memory_order_relaxed);
+	slot.start.store(start, std::memory_order_relaxed);
+	slot.duration.store(duration, std::memory_order_relaxed);
+	slot.arg.store(arg, std::memory_order_relaxed);
+	slot.sequence.store(index + 1, std::memory_order_release);
+	ring.next.store(index + 1, std::memory_order_release);
+}
+
+bool copySlot(const Slot& slot, Event& event)
+{
+	uint64_t sequence = slot.sequence.load(std::memory_order_acquire);
+	if (sequence == 0)
+		return false;
+	event.category = slot.category.load(std::memory_order_relaxed);
+	event.name = slot.name.load(std::memory_order_relaxed);
+	event.argName = slot.argName.load(std::memory_order_relaxed);
+	event.start = slot.start.load(std::memory_order_relaxed);
+	event.duration = slot.duration.load(std::memory_order_relaxed);
+	event.arg = slot.arg.load(std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_acquire);
+	return slot.sequence.load(std::memory_order_relaxed) == sequence;
+}
+
+}
+
+const uint64_t MtpTimeline::EventsPerThread;
+bool MtpTimeline::m_enabled = false;
+volatile sig_atomic_t MtpTimeline::m_dumpRequested = 0;
+
+void MtpTimeline::Enable(const std::string& dumpFile)
+{
+	dumpFileName = dumpFile;
+	m_enabled = true;
+	if (!dumpFileName.empty())
+	{
+		// Not much can be done in a signal handler, so the dump is written
+		// by the next thread to finish a filesystem operation.
+		struct sigaction action;
+		memset(&action, 0, sizeof(action));
+		action.sa_handler = requestDump;
+		sigemptyset(&action.sa_mask);
+		action.sa_flags = SA_RESTART;
+		sigaction(SIGUSR1, &action, 0);
+	}
+}
+
+void MtpTimeline::Span(const char* category, const char* name, uint64_t startMicroseconds,
+		uint64_t durationMicroseconds, const char* argName, uint64_t arg)
+{
+	record(category, name, argName, startMicroseconds, durationMicroseconds, arg);
+}
+
+void MtpTimeline::Counter(const char* name, const char* series, uint64_t value)
+{
+	record(0, name, series, MtpStats::NowMicroseconds(), 0, value);
+}
+
+void MtpTimeline::requestDump(int)
+{
+	m_dumpRequested = 1;
+}
+
+void MtpTimeline::dump()
+{
+	LockMutex lock(dumpMutex);
+	if (!m_dumpRequested)
+		return;
+	m_dumpRequested = 0;
+	std::ofstream out(dumpFileName.c_str());
+	WriteJson(out);
+	if (!out)
+		std::cerr << "Couldn't write timeline to " << dumpFileName << std::endl;
+}
+
+void MtpTimeline::WriteJson(std::ostream& out)
+{
+	std::vector<Ring*> rings;
+	{
+		LockMutex lock(ringsMutex);
+		rings = allRings;
+	}
+
+	out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+	bool first = true;
+	for(std::vector<Ring*>::iterator r = rings.begin(); r != rings.end(); r++)
+	{
+		Ring& ring = **r;
+		if (!first)
+			out << ",\n";
+		first = false;
+		out << "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":" << ring.thread
+				<< ",\"args\":{\"name\":\"thread " << ring.thread << "\"}}";
+
+		uint64_t end = ring.next.load(std::memory_order_acquire);
+		uint64_t begin = end > ring.slots.size() ? end - ring.slots.size() : 0;
+		for(uint64_t i = begin; i < end; i++)
+		{
+			Event event;
+			if (!copySlot(ring.slots[i % ring.slots.size()], event))
+				continue;
+			out << ",\n";
+			if (event.category)
+			{
+				out << "{\"ph\":\"X\",\"cat\":\"" << event.category << "\",\"name\":\"" << event.name
+						<< "\",\"pid\":1,\"tid\":" << ring.thread << ",\"ts\":" << event.start
+						<< ",\"dur\":" << event.duration;
+				if (event.argName)
+					out << ",\"args\":{\"" << event.argName << "\":" << event.arg << "}";
+				out << "}";
+			}
+			else
+			{
+				out << "{\"ph\":\"C\",\"name\":\"" << event.name << "\",\"pid\":1,\"tid\":" << ring.thread
+						<< ",\"ts\":" << event.start << ",\"args\":{\"" << event.argName << "\":" << event.arg << "}}";
+			}
+		}
+	}
+	out << "\n]}\n";
+}
+
+uint64_t MtpTimeline::JsonSizeBound()
+{
+	LockMutex lock(ringsMutex);
+
+	// Names are short literals, so no event takes more than this
+	const uint64_t maxEventBytes = 256;
+	return 1024 + allRings.size() * (EventsPerThread + 1) * maxEventBytes;
+}
+
+MtpTimelineSpan::MtpTimelineSpan(const char* category, const char* name, const char* argName) :
+	m_category(category), m_name(name), m_argName(argName), m_arg(0),
+	m_start(MtpTimeline::Enabled() ? MtpStats::NowMicroseconds() : 0)
+{
+}
+
+MtpTimelineSpan::~MtpTimelineSpan()
+{
+	if (m_start)
+		MtpTimeline::Span(m_category, m_name, m_start, MtpStats::NowMicroseconds() - m_start, m_argName, m_arg);
+}
@@ -0,0 +1,85 @@
+/*
+ * MtpTimeline.h
+ *
+ * This software is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 3 as published by the Free Software Foundation.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02111-1301, USA.
+ * licensing@fsf.org
+ */
+
+#ifndef MTPTIMELINE_H_
+#define MTPTIMELINE_H_
+
+#include <stdint.h>
+#include <signal.h>
+#include <ostream>
+#include <string>
+
+/*
+ * Records what each thread was doing over time, for viewing in a trace
+ * viewer such as chrome://tracing or Perfetto. Each thread writes spans and
+ * counter samples into its own fixed size ring buffer, so only the most
+ * recent events are kept and recording never blocks. Names must be string
+ * literals (or otherwise live forever), since only the pointer is kept.
+ *
+ * Off unless Enable is called at startup.
+ */
+class MtpTimeline
+{
+public:
+	static const uint64_t EventsPerThread = 16384;
+
+	// Must be called before any other threads are started. SIGUSR1 then
+	// writes the timeline to dumpFile, if one is given.
+	static void Enable(const std::string& dumpFile);
+	static bool Enabled() { return m_enabled; }
+
+	static void Span(const char* category, const char* name, uint64_t startMicroseconds,
+			uint64_t durationMicroseconds, const char* argName = 0, uint64_t arg = 0);
+	static void Counter(const char* name, const char* series, uint64_t value);
+
+	// Writes the dump asked for by SIGUSR1, if there is one. Called at the end
+	// of each filesystem operation, when no locks are held.
+	static void DumpIfRequested() { if (m_dumpRequested) dump(); }
+
+	// Writes everything recorded in the Chrome trace_event JSON format
+	static void WriteJson(std::ostream& out);
+	// An upper bound on the size of what WriteJson writes
+	static uint64_t JsonSizeBound();
+
+private:
+	static void dump();
+	static void requestDump(int);
+
+	static bool						m_enabled;
+	static volatile sig_atomic_t	m_dumpRequested;
+};
+
+// Records a span from construction to destruction, if the timeline is enabled
+class MtpTimelineSpan
+{
+public:
+	MtpTimelineSpan(const char* category, const char* name, const char* argName = 0);
+	~MtpTimelineSpan();
+
+	void setArg(uint64_t arg) { m_arg = arg; }
+
+private:
+	const char*	m_category;
+	const char*	m_name;
+	const char*	m_argName;
+	uint64_t	m_arg;
+	uint64_t	m_start;
+};
+
+#endif /* MTPTIMELINE_H_ */
@@ -0,0 +1,246 @@
+/*
+ * MtpTrace.cpp
+ *
+ * This software is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 3 as published by the Free Software Foundation.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02111-1301, USA.
+ * licensing@fsf.org
+ */
+#include "MtpTrace.h"
+#include "MtpDeviceQueue.h"
+#include "mtpFilesystemErrors.h"
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+static const char traceMagic[] = "JMTPTRC1";
+
+static const char* opNames[TraceOpCount] = { "?", "getattr", "readdir", "open", "release", "read", "mkdir",
+		"rmdir", "create", "write", "truncate", "unlink", "flush", "rename", "statfs", "chmod", "utime",
+		"fallocate", "fsync" };
+
+const char* MtpTraceOpName(int op)
+{
+	if ((op <= 0) || (op >= TraceOpCount))
+		return opNames[0];
+	return opNames[op];
+}
+
+static uint64_t nowNanoseconds()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return ((uint64_t) now.tv_sec) * 1000000000ULL + now.tv_nsec;
+}
+
+static void appendNumber(std::string& buffer, uint64_t value)
+{
+	do
+	{
+		unsigned char b = value & 0x7F;
+		value >>= 7;
+		if (value)
+			b |= 0x80;
+		buffer.push_back((char) b);
+	} while(value);
+}
+
+static void appendString(std::string& buffer, const std::string& s)
+{
+	appendNumber(buffer, s.size());
+	buffer.append(s);
+}
+
+MtpTraceRecord::MtpTraceRecord() : op(0), result(0), offset(0), size(0), start(0), duration(0),
+		deviceCommands(0), thread(0), nodeType(TraceNodeUnknown), nodeSize(0)
+{
+}
+
+MtpTraceWriter::MtpTraceWriter(const std::string& fileName) : m_start(nowNanoseconds()), m_threads(0)
+{
+	m_file = fopen(fileName.c_str(), "wb");
+	if (!m_file)
+		throw WriteError(errno);
+	m_buffer.reserve(FlushBytes * 2);
+	m_buffer.append(traceMagic, sizeof(traceMagic) - 1);
+}
+
+MtpTraceWriter::~MtpTraceWriter()
+{
+	try
+	{
+		flush();
+	}
+	catch(std::exception&)
+	{
+	}
+	fclose(m_file);
+}
+
+uint64_t MtpTraceWriter::now() const
+{
+	return nowNanoseconds() - m_start;
+}
+
+uint32_t MtpTraceWriter::threadNumber()
+{
+	static __thread uint32_t number = 0;
+	if (number == 0)
+	{
+		LockMutex lock(m_mutex);
+		number = ++m_threads;
+	}
+	return number;
+}
+
+void MtpTraceWriter::write(const MtpTraceRecord& record)
+{
+	LockMutex lock(m_mutex);
+
+	m_buffer.push_back((char) record.op);
+	// zigzag, so small negative errors stay small
+	appendNumber(m_buffer, (((uint64_t) record.result) << 1) ^ (uint64_t) (((int64_t) record.result) >> 63));
+	appendNumber(m_buffer, record.offset);
+	appendNumber(m_buffer, record.size);
+	appendNumber(m_buffer, record.start);
+	appendNumber(m_buffer, record.duration);
+	appendNumber(m_buffer, record.deviceCommands);
+	appendNumber(m_buffer, record.thread);
+	m_buffer.push_back((char) record.nodeType);
+	appendNumber(m_buffer, record.nodeSize);
+	appendString(m_buffer, record.path);
+	appendString(m_buffer, record.newPath);
+	if (m_buffer.size() >= FlushBytes)
+		flush();
+}
+
+void MtpTraceWriter::flush()
+{
+	LockMutex lock(m_mutex);
+
+	if (m_buffer.empty())
+		return;
+	size_t written = fwrite(m_buffer.data(), 1, m_buffer.size(), m_file);
+	m_buffer.clear();
+	if ((written == 0) || (fflush(m_file) != 0))
+		throw WriteError(errno);
+}
+
+MtpTraceReader::MtpTraceReader(const std::string& fileName)
+{
+	m_file = fopen(fileName.c_str(), "rb");
+	if (!m_file)
+		throw ReadError(errno);
+	char magic[sizeof(traceMagic) - 1];
+	if ((fread(magic, 1, sizeof(magic), m_file) != sizeof(magic)) || (memcmp(magic, traceMagic, sizeof(magic)) != 0))
+	{
+		fclose(m_file);
+		throw ReadError(EINVAL);
+	}
+}
+
+MtpTraceReader::~MtpTraceReader()
+{
+	fclose(m_file);
+}
+
+uint64_t MtpTraceReader::readNumber()
+{
+	uint64_t value = 0;
+	for(int shift = 0; shift < 64; shift += 7)
+	{
+		int c = fgetc(m_file);
+		if (c == EOF)
+			throw ReadError(EINVAL);
+		value |= ((uint64_t) (c & 0x7F)) << shift;
+		if (!(c & 0x80))
+			return value;
+	}
+	throw ReadError(EINVAL);
+}
+
+std::string MtpTraceReader::readString()
+{
+	uint64_t length = readNumber();
+	if (length > 65536)
+		throw ReadError(EINVAL);
+	std::string s(length, '\0');
+	if (length && (fread(&s[0], 1, length, m_file) != length))
+		throw ReadError(EINVAL);
+	return s;
+}
+
+bool MtpTraceReader::read(MtpTraceRecord& record)
+{
+	int op = fgetc(m_file);
+	if (op == EOF)
+		return false;
+	record.op = op;
+	uint64_t result = readNumber();
+	record.result = (int) ((result >> 1) ^ (~(result & 1) + 1));
+	record.offset = readNumber();
+	record.size = readNumber();
+	record.start = readNumber();
+	record.duration = readNumber();
+	record.deviceCommands = readNumber();
+	record.thread = readNumber();
+	int nodeType = fgetc(m_file);
+	if (nodeType == EOF)
+		throw ReadError(EINVAL);
+	record.nodeType = nodeType;
+	record.nodeSize = readNumber();
+	record.path = readString();
+	record.newPath = readString();
+	return true;
+}
+
+MtpTraceScope::MtpTraceScope(MtpTraceWriter& writer, int op, const char* path, const char* newPath,
+		uint64_t offset, uint64_t size) : m_writer(writer), m_startCommands(MtpDeviceQueue::ThreadCommands())
+{
+	m_record.op = op;
+	m_record.path = path;
+	if (newPath)
+		m_record.newPath = newPath;
+	m_record.offset = offset;
+	m_record.size = size;
+	m_record.thread = writer.threadNumber();
+	m_record.start = writer.now();
+}
+
+void MtpTraceScope::setNode(const struct stat& info)
+{
+	m_record.nodeType = S_ISDIR(info.st_mode) ? TraceNodeFolder : TraceNodeFile;
+	m_record.nodeSize = info.st_size;
+}
+
+void MtpTraceScope::setSize(uint64_t size)
+{
+	m_record.size = size;
+}
+
+int MtpTraceScope::finish(int result)
+{
+	m_record.duration = m_writer.now() - m_record.start;
+	m_record.deviceCommands = MtpDeviceQueue::ThreadCommands() - m_startCommands;
+	m_record.result = result;
+	try
+	{
+		m_writer.write(m_record);
+	}
+	catch(std::exception&)
+	{
+		// A full disk shouldn't fail the filesystem operation
+	}
+	return result;
+}
@@ -0,0 +1,153 @@
+/*
+ * MtpTrace.h
+ *
+ * This software is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 3 as published by the Free Software Foundation.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02111-1301, USA.
+ * licensing@fsf.org
+ */
+
+#ifndef MTPTRACE_H_
+#define MTPTRACE_H_
+
+#include "Mutex.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <sys/stat.h>
+
+enum MtpTraceOp
+{
+	TraceGetattr = 1,
+	TraceReaddir,
+	TraceOpen,
+	TraceRelease,
+	TraceRead,
+	TraceMkdir,
+	TraceRmdir,
+	TraceCreate,
+	TraceWrite,
+	TraceTruncate,
+	TraceUnlink,
+	TraceFlush,
+	TraceRename,
+	TraceStatfs,
+	TraceChmod,
+	TraceUtime,
+	TraceFallocate,
+	TraceFsync,
+	TraceOpCount
+};
+
+const char* MtpTraceOpName(int op);
+
+enum MtpTraceNodeType
+{
+	TraceNodeUnknown = 0,
+	TraceNodeFile,
+	TraceNodeFolder
+};
+
+struct MtpTraceRecord
+{
+	MtpTraceRecord();
+
+	int				op;
+	int				result;			// what was returned to FUSE
+	uint64_t		offset;			// read, write and truncate
+	uint64_t		size;			// read and write size, readdir entry count
+	uint64_t		start;			// nanoseconds since the trace was started
+	uint64_t		duration;		// nanoseconds
+	uint64_t		deviceCommands;
+	uint32_t		thread;
+	int				nodeType;		// what a successful getattr found
+	uint64_t		nodeSize;
+	std::string		path;
+	std::string		newPath;		// rename
+};
+
+/*
+ * Writes FUSE operations to a trace file so a slow access pattern can be
+ * replayed later (see jmtpfsReplay.cpp). Records are variable length, with
+ * integers stored as LEB128 varints, and are buffered and written in large
+ * blocks. Records are written as operations finish, so they are not
+ * necessarily in start order.
+ */
+class MtpTraceWriter
+{
+public:
+	MtpTraceWriter(const std::string& fileName);
+	~MtpTraceWriter();
+
+	// Nanoseconds since the trace was started
+	uint64_t now() const;
+	// A small number identifying the calling thread
+	uint32_t threadNumber();
+
+	void write(const MtpTraceRecord& record);
+	void flush();
+
+private:
+	MtpTraceWriter(const MtpTraceWriter&);
+	MtpTraceWriter& operator=(const MtpTraceWriter&);
+
+	static const size_t FlushBytes = 64 * 1024;
+
+	RecursiveMutex	m_mutex;
+	FILE*			m_file;
+	uint64_t		m_start;
+	uint32_t		m_threads;
+	std::string		m_buffer;
+};
+
+class MtpTraceReader
+{
+public:
+	MtpTraceReader(const std::string& fileName);
+	~MtpTraceReader();
+
+	// Returns false at the end of the trace
+	bool read(MtpTraceRecord& record);
+
+private:
+	MtpTraceReader(const MtpTraceReader&);
+	MtpTraceReader& operator=(const MtpTraceReader&);
+
+	uint64_t readNumber();
+	std::string readString();
+
+	FILE*	m_file;
+};
+
+/*
+ * Times one FUSE operation and counts the device commands it issued. The
+ * record is written when finish is called with the result.
+ */
+class MtpTraceScope
+{
+public:
+	MtpTraceScope(MtpTraceWriter& writer, int op, const char* path, const char* newPath = 0,
+			uint64_t offset = 0, uint64_t size = 0);
+
+	void setNode(const struct stat& info);
+	void setSize(uint64_t size);
+	int finish(int result);
+
+private:
+	MtpTraceWriter&	m_writer;
+	MtpTraceRecord	m_record;
+	uint64_t		m_startCommands;
+};
+
+#endif /* MTPTRACE_H_ */
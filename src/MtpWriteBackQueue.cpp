@@ -0,0 +1,127 @@
+/*
+ * MtpWriteBackQueue.cpp
+ *
+ * This software is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 3 as published by the Free Software Foundation.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02111-1301, USA.
+ * licensing@fsf.org
+ */
+#include "MtpWriteBackQueue.h"
+#include "MtpMetadataCache.h"
+#include "mtpFilesystemErrors.h"
+#include "MtpStats.h"
+#include <errno.h>
+
+const size_t MtpWriteBackQueue::MaxFailures;
+
+MtpWriteBackQueue::MtpWriteBackQueue(MtpMetadataCache& cache) : m_cache(cache), m_mutex(MtpStats::LockWriteBack),
+	m_nextTicket(0), m_finished(0), m_forgotten(0), m_stopping(false), m_running(false)
+{
+}
+
+MtpWriteBackQueue::~MtpWriteBackQueue()
+{
+	{
+		LockMutex lock(m_mutex);
+
+		if (!m_running)
+			return;
+		m_stopping = true;
+		m_condition.Broadcast();
+	}
+	pthread_join(m_thread, 0);
+}
+
+uint64_t MtpWriteBackQueue::add(uint32_t id, const std::shared_ptr<MtpLocalFileCopy>& localFile)
+{
+	LockMutex lock(m_mutex);
+
+	for(std::deque<Job>::iterator i = m_jobs.begin(); i != m_jobs.end(); i++)
+	{
+		if (i->localFile == localFile)
+			return i->ticket;
+	}
+	if (!m_running)
+	{
+		int error = pthread_create(&m_thread, 0, run, this);
+		if (error)
+			throw MtpFilesystemErrorWithErrorCode(error, "can't start write back thread");
+		m_running = true;
+	}
+	Job job;
+	job.id = id;
+	job.localFile = localFile;
+	job.ticket = m_nextTicket++;
+	m_jobs.push_back(job);
+	m_condition.Broadcast();
+	return job.ticket;
+}
+
+void MtpWriteBackQueue::waitFor(uint64_t ticket)
+{
+	LockMutex lock(m_mutex);
+
+	while(m_finished <= ticket)
+		m_condition.Wait(m_mutex);
+	if (m_failed.erase(ticket) || (ticket < m_forgotten))
+		throw WriteError(EIO);
+}
+
+void MtpWriteBackQueue::waitForAll()
+{
+	LockMutex lock(m_mutex);
+
+	while(m_finished < m_nextTicket)
+		m_condition.Wait(m_mutex);
+}
+
+void* MtpWriteBackQueue::run(void* self)
+{
+	((MtpWriteBackQueue*) self)->run();
+	return 0;
+}
+
+void MtpWriteBackQueue::run()
+{
+	LockMutex lock(m_mutex);
+
+	for(;;)
+	{
+		while(m_jobs.empty() && !m_stopping)
+			m_condition.Wait(m_mutex);
+		if (m_jobs.empty())
+			return;
+		Job job = m_jobs.front();
+		m_jobs.pop_front();
+
+		m_mutex.Unlock();
+		bool sent = m_cache.writeBack(job.id, job.localFile);
+		job.localFile.reset();
+		m_mutex.Lock();
+
+		// Nobody may ever ask about a failure, so only the recent ones are
+		// kept. Older tickets can't be told apart from dropped failures, so
+		// they don't get to report success.
+		if (!sent)
+		{
+			if (m_failed.size() >= MaxFailures)
+			{
+				m_forgotten = *m_failed.begin() + 1;
+				m_failed.erase(m_failed.begin());
+			}
+			m_failed.insert(job.ticket);
+		}
+		m_finished = job.ticket + 1;
+		m_condition.Broadcast();
+	}
+}
@@ -0,0 +1,83 @@
+/*
+ * MtpWriteBackQueue.h
+ *
+ * This software is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 3 as published by the Free Software Foundation.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02111-1301, USA.
+ * licensing@fsf.org
+ */
+
+#ifndef MTPWRITEBACKQUEUE_H_
+#define MTPWRITEBACKQUEUE_H_
+
+#include "MtpLocalFileCopy.h"
+#include "Mutex.h"
+#include <stdint.h>
+#include <deque>
+#include <memory>
+#include <set>
+
+class MtpMetadataCache;
+
+/*
+ * Sends closed local copies to the device from a background thread, one
+ * at a time and in the order they were closed, so that closing a file
+ * doesn't have to wait for the transfer. Each job gets a ticket that can
+ * be waited on to find out when (and whether) it made it to the device.
+ */
+class MtpWriteBackQueue
+{
+public:
+	MtpWriteBackQueue(MtpMetadataCache& cache);
+	// Waits for everything queued to be sent
+	~MtpWriteBackQueue();
+
+	// A copy that is already waiting its turn keeps its place, and its
+	// ticket is returned again.
+	uint64_t add(uint32_t id, const std::shared_ptr<MtpLocalFileCopy>& localFile);
+	// Throws WriteError if the job failed, or if it is too old for that
+	// to still be known
+	void waitFor(uint64_t ticket);
+	void waitForAll();
+
+private:
+	MtpWriteBackQueue(const MtpWriteBackQueue&);
+	MtpWriteBackQueue& operator=(const MtpWriteBackQueue&);
+
+	struct Job
+	{
+		uint32_t							id;
+		std::shared_ptr<MtpLocalFileCopy>	localFile;
+		uint64_t							ticket;
+	};
+
+	static void* run(void* self);
+	void run();
+
+	static const size_t	MaxFailures = 1000;
+
+	MtpMetadataCache&	m_cache;
+	RecursiveMutex		m_mutex;
+	Condition			m_condition;
+	std::deque<Job>		m_jobs;
+	uint64_t			m_nextTicket;
+	uint64_t			m_finished;		// every ticket below this one is done
+	std::set<uint64_t>	m_failed;
+	uint64_t			m_forgotten;	// failures below this one may have been dropped
+	bool				m_stopping;
+	bool				m_running;		// the thread is started on first use
+	pthread_t			m_thread;
+};
+
+
+#endif /* MTPWRITEBACKQUEUE_H_ */
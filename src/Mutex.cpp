@@ -20,9 +20,11 @@
  */
 
 #include "Mutex.h"
+#include "MtpStats.h"
 
 #include <sstream>
 #include <stdexcept>
+#include <errno.h>
 
 void checkPthreadError(int err)
 {
@@ -34,7 +36,11 @@ void checkPthreadError(int err)
 	}
 }
 
-RecursiveMutex::RecursiveMutex()
+const int RecursiveMutex::Unprofiled;
+
+RecursiveMutex::RecursiveMutex(int profileAs) :
+	m_profileAs(((profileAs >= 0) && (profileAs < MtpStats::LockCount)) ? profileAs : Unprofiled),
+	m_depth(0), m_lockedAt(0), m_holderOp(MtpStats::FuseOpCount)
 {
 	pthread_mutexattr_t mattr;
 	checkPthreadError(pthread_mutexattr_init(&mattr));
@@ -50,14 +56,101 @@ RecursiveMutex::~RecursiveMutex()
 
 void RecursiveMutex::Lock()
 {
-	checkPthreadError(pthread_mutex_lock(&m_mutex));
+	bool profiling = MtpStats::LockProfiling();
+	if ((m_profileAs == Unprofiled) || !(profiling || MtpTimeline::Enabled()))
+	{
+		checkPthreadError(pthread_mutex_lock(&m_mutex));
+		return;
+	}
+
+	uint64_t waited = 0;
+	int holderOp = MtpStats::FuseOpCount;
+	int err = pthread_mutex_trylock(&m_mutex);
+	if (err == EBUSY)
+	{
+		holderOp = m_holderOp.load(std::memory_order_relaxed);
+		uint64_t waitStart = MtpStats::NowMicroseconds();
+		checkPthreadError(pthread_mutex_lock(&m_mutex));
+		waited = MtpStats::NowMicroseconds() - waitStart;
+		// Only waits go in the timeline, taking a free lock isn't interesting
+		if (MtpTimeline::Enabled())
+			MtpTimeline::Span("lock", MtpStats::LockName((MtpStats::Lock) m_profileAs), waitStart, waited);
+	}
+	else
+		checkPthreadError(err);
+	if (!profiling)
+		return;
+	if (m_depth++ == 0)
+	{
+		MtpStats::LockWaited((MtpStats::Lock) m_profileAs, waited, holderOp);
+		m_lockedAt = MtpStats::NowMicroseconds();
+		m_holderOp.store(MtpStats::CurrentFuseOp(), std::memory_order_relaxed);
+	}
 }
 
 void RecursiveMutex::Unlock()
 {
+	// m_depth is 0 if the lock wasn't profiled when it was taken
+	if (m_depth && (--m_depth == 0))
+	{
+		MtpStats::LockHeld((MtpStats::Lock) m_profileAs, MtpStats::NowMicroseconds() - m_lockedAt);
+		m_holderOp.store(MtpStats::FuseOpCount, std::memory_order_relaxed);
+	}
 	checkPthreadError(pthread_mutex_unlock(&m_mutex));
 }
 
+Condition::Condition()
+{
+	checkPthreadError(pthread_cond_init(&m_condition, 0));
+}
+
+Condition::~Condition()
+{
+	pthread_cond_destroy(&m_condition);
+}
+
+void Condition::Wait(RecursiveMutex& mutex)
+{
+	Wait(mutex, 0);
+}
+
+bool Condition::Wait(RecursiveMutex& mutex, const struct timespec& deadline)
+{
+	return Wait(mutex, &deadline);
+}
+
+bool Condition::Wait(RecursiveMutex& mutex, const struct timespec* deadline)
+{
+	// The mutex is free while we wait, so that doesn't count as holding it
+	unsigned depth = mutex.m_depth;
+	if (depth)
+	{
+		MtpStats::LockHeld((MtpStats::Lock) mutex.m_profileAs, MtpStats::NowMicroseconds() - mutex.m_lockedAt);
+		mutex.m_depth = 0;
+		mutex.m_holderOp.store(MtpStats::FuseOpCount, std::memory_order_relaxed);
+	}
+	int result = 0;
+	if (deadline)
+		result = pthread_cond_timedwait(&m_condition, &mutex.m_mutex, deadline);
+	else
+		result = pthread_cond_wait(&m_condition, &mutex.m_mutex);
+	if (depth)
+	{
+		mutex.m_depth = depth;
+		mutex.m_lockedAt = MtpStats::NowMicroseconds();
+		mutex.m_holderOp.store(MtpStats::CurrentFuseOp(), std::memory_order_relaxed);
+	}
+	if (result == ETIMEDOUT)
+		return false;
+	checkPthreadError(result);
+	return true;
+}
+
+void Condition::Broadcast()
+{
+	checkPthreadError(pthread_cond_broadcast(&m_condition));
+}
+
 LockMutex::LockMutex(RecursiveMutex& mutex) : m_mutex(mutex)
 {
 	m_mutex.Lock();
@@ -23,18 +23,57 @@
 #define MUTEX_H_
 
 #include <pthread.h>
+#include <stdint.h>
+#include <atomic>
 
+/*
+ * A mutex given a lock name from MtpStats::Lock is profiled when lock
+ * profiling is turned on, and its contended waits are shown in the
+ * timeline. Waits are measured for the outermost Lock only, and a hold
+ * lasts from the outermost Lock to the matching Unlock. The name is taken
+ * as a plain int so that everything using a mutex doesn't need MtpStats.
+ */
 class RecursiveMutex
 {
 public:
-	RecursiveMutex();
+	static const int Unprofiled = -1;
+
+	RecursiveMutex(int profileAs = Unprofiled);
 	~RecursiveMutex();
 
 	void Lock();
 	void Unlock();
 
 protected:
-	pthread_mutex_t	m_mutex;
+	friend class Condition;
+	pthread_mutex_t		m_mutex;
+
+	// Profiling state. Everything but the holder is only touched by the owner.
+	int					m_profileAs;
+	unsigned			m_depth;
+	uint64_t			m_lockedAt;
+	std::atomic<int>	m_holderOp;
+};
+
+/*
+ * A condition variable to use with a RecursiveMutex. The mutex must
+ * be locked exactly once by the calling thread when Wait is called.
+ */
+class Condition
+{
+public:
+	Condition();
+	~Condition();
+
+	void Wait(RecursiveMutex& mutex);
+	// Returns false if deadline (CLOCK_REALTIME) passed first
+	bool Wait(RecursiveMutex& mutex, const struct timespec& deadline);
+	void Broadcast();
+
+protected:
+	bool Wait(RecursiveMutex& mutex, const struct timespec* deadline);
+
+	pthread_cond_t	m_condition;
 };
 
 class LockMutex
@@ -25,6 +25,11 @@
 #include "FuseHeader.h"
 #include "MtpFuseContext.h"
 #include "MtpRoot.h"
+#include "jmtpfsLowLevel.h"
+#include "MtpSimulatedDevice.h"
+#include "MtpTrace.h"
+#include "MtpStats.h"
+#include "MtpTimeline.h"
 
 #include <iostream>
 #include <cstddef>
@@ -33,29 +38,32 @@
 #include <iomanip>
 #include <assert.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <vector>
 
 #define JMTPFS_VERSION "0.5"
 
 using namespace std;
 
-/*
- * A global lock for filesystem operations. I really didn't want to do this, but trying to keep everything
- * in sync when different threads accessed the same nodes in the filesystem was getting way to complicated.
- * So for now just to get something working I've pulled out all the lower level synchronization code and
- * we'll just use the global lock here.
- */
-RecursiveMutex	globalLock;
-
-#define FUSE_ERROR_BLOCK_START \
+// The timer lives outside the try block so the handlers can mark it failed
+#define FUSE_ERROR_BLOCK_START(op) \
+	MtpStatsFuseTimer fuseTimer(op); \
 	try \
 	{ \
-	LockMutex lock(globalLock); \
 	    MtpFuseContext* context((MtpFuseContext*)(fuse_get_context()->private_data)); \
+	    (void) context; \
+
+#define FUSE_MODIFY_BLOCK_START(op) \
+	FUSE_ERROR_BLOCK_START(op) \
+	LockMutex lock(context->modifyLock());
 
 #define FUSE_ERROR_BLOCK_END \
 	} \
 	catch(FileNotFound&) \
 	{ \
+		fuseTimer.failed(); \
 		return -ENOENT; \
 	} \
 	catch(MtpDeviceDisconnected&) \
@@ -64,18 +72,45 @@ RecursiveMutex	globalLock;
 	} \
 	catch(MtpFilesystemErrorWithErrorCode& e) \
 	{ \
+		fuseTimer.failed(); \
 		return -(e.ErrorCode()); \
 	} \
 	catch(std::exception&) \
 	{ \
+		fuseTimer.failed(); \
 		return -EIO; \
 	}
 
 
 
+// Closing a file that was written to sends a new copy of it to the device,
+// which gets a new object id.
+static void closeNode(MtpFuseContext* context, const FilesystemPath& path, MtpNode& n, bool release)
+{
+	uint32_t id = n.Id();
+	if (release)
+		n.Close();
+	else
+		n.Flush();
+	if (n.Id() != id)
+		context->forgetPath(path);
+}
+
+// An open file keeps the node it was opened with in fi->fh, so reads and
+// writes don't have to look the path up again.
+static void setOpenedNode(struct fuse_file_info* fi, std::unique_ptr<MtpNode> n)
+{
+	fi->fh = (uintptr_t) n.release();
+}
+
+static MtpNode& openedNode(struct fuse_file_info* fi)
+{
+	return *(MtpNode*)(uintptr_t) fi->fh;
+}
+
 extern "C" int jmtpfs_getattr(const char* pathStr, struct stat* info)
 {
-	FUSE_ERROR_BLOCK_START
+	FUSE_ERROR_BLOCK_START(MtpStats::FuseGetattr)
 
 		FilesystemPath path(pathStr);
 		context->getNode(path)->getattr(*info);
@@ -90,14 +125,18 @@ extern "C" int jmtpfs_getattr(const char* pathStr, struct stat* info)
 extern "C" int jmtpfs_readdir(const char* pathStr, void* buf, fuse_fill_dir_t filler,
 		off_t offset, struct fuse_file_info *fi)
 {
-	FUSE_ERROR_BLOCK_START
+	FUSE_ERROR_BLOCK_START(MtpStats::FuseReaddir)
 
 		FilesystemPath path(pathStr);
 		std::unique_ptr<MtpNode> n = context->getNode(path);
-		std::vector<std::string> contents = n->readdir();
-		for(std::vector<std::string>::iterator i = contents.begin(); i != contents.end(); i++)
+		std::vector<MtpDirectoryEntry> contents = n->readDirectoryEntries();
+		if (filler(buf, ".", 0, 0) || filler(buf, "..", 0, 0))
+			return 0;
+		for(std::vector<MtpDirectoryEntry>::iterator i = contents.begin(); i != contents.end(); i++)
 		{
-			if (filler(buf,i->c_str(),0, 0))
+			i->info.st_uid = context->uid();
+			i->info.st_gid = context->gid();
+			if (filler(buf, i->name.c_str(), &i->info, 0))
 				return 0;
 		}
 		return 0;
@@ -106,44 +145,115 @@ extern "C" int jmtpfs_readdir(const char* pathStr, void* buf, fuse_fill_dir_t fi
 }
 
 
-extern "C" int jmtpfs_open(const char *pathStr, struct fuse_file_info *)
+extern "C" int jmtpfs_open(const char *pathStr, struct fuse_file_info *fi)
 {
-	FUSE_ERROR_BLOCK_START
+	FUSE_ERROR_BLOCK_START(MtpStats::FuseOpen)
 
 	FilesystemPath path(pathStr);
-	context->getNode(path)->Open();
+	std::unique_ptr<MtpNode> n = context->getNode(path);
+	n->Open((fi->flags & O_ACCMODE) != O_RDONLY);
+	setOpenedNode(fi, std::move(n));
 	return 0;
 
 	FUSE_ERROR_BLOCK_END
 }
 
-extern "C" int jmtpfs_release(const char *pathStr, struct fuse_file_info *)
+extern "C" int jmtpfs_release(const char *pathStr, struct fuse_file_info *fi)
 {
-	FUSE_ERROR_BLOCK_START
+	FUSE_ERROR_BLOCK_START(MtpStats::FuseRelease)
 
+	std::unique_ptr<MtpNode> n(&openedNode(fi));
 	FilesystemPath path(pathStr);
-	context->getNode(path)->Close();
+	closeNode(context, path, *n, true);
 	return 0;
 
 	FUSE_ERROR_BLOCK_END
 }
 
-extern "C" int jmtpfs_read(const char *pathStr, char *buf, size_t  size, off_t offset, struct fuse_file_info *)
+extern "C" int jmtpfs_read(const char *pathStr, char *buf, size_t  size, off_t offset, struct fuse_file_info *fi)
 {
-	FUSE_ERROR_BLOCK_START
+	FUSE_ERROR_BLOCK_START(MtpStats::FuseRead)
 
-	FilesystemPath path(pathStr);
-	return context->getNode(path)->Read(buf,size,offset);
+	int bytesRead = openedNode(fi).Read(buf,size,offset);
+	MtpStats::Add(MtpStats::FuseBytesRead, bytesRead);
+	return bytesRead;
+
+	FUSE_ERROR_BLOCK_END
+}
+
+#if FUSE_VERSION >= 29
+// FUSE sends a read_buf reply from the descriptor after we return, so the
+// one given to it has to stay open until then. Each thread keeps its own
+// duplicate of the last one it handed out, replaced at its next read.
+class ReadBufDescriptor
+{
+public:
+	ReadBufDescriptor() : m_fd(-1) {}
+	~ReadBufDescriptor() { reset(-1); }
+
+	void reset(int fd)
+	{
+		if (m_fd >= 0)
+			close(m_fd);
+		m_fd = fd;
+	}
+
+private:
+	int	m_fd;
+};
+
+static thread_local ReadBufDescriptor readBufDescriptor;
+
+extern "C" int jmtpfs_read_buf(const char *pathStr, struct fuse_bufvec **bufp, size_t size, off_t offset,
+		struct fuse_file_info *fi)
+{
+	FUSE_ERROR_BLOCK_START(MtpStats::FuseRead)
+
+	readBufDescriptor.reset(-1);
+	// FUSE frees this, and any memory in it, whatever we return
+	struct fuse_bufvec* bufv = (struct fuse_bufvec*) malloc(sizeof(struct fuse_bufvec));
+	if (bufv == 0)
+		return -ENOMEM;
+	*bufv = FUSE_BUFVEC_INIT(0);
+	*bufp = bufv;
+
+	MtpNode& n = openedNode(fi);
+	std::shared_ptr<MtpLocalFileCopy> localFile = n.OpenedCopy(false);
+	if (localFile)
+	{
+		bufv->buf[0].size = localFile->readWith(size, offset, [&](int fd, size_t length) -> size_t
+		{
+			int copy = dup(fd);
+			if (copy < 0)
+				throw ReadError(errno);
+			readBufDescriptor.reset(copy);
+			bufv->buf[0].flags = (enum fuse_buf_flags) (FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+			bufv->buf[0].fd = copy;
+			bufv->buf[0].pos = offset;
+			return length;
+		});
+	}
+	else
+	{
+		bufv->buf[0].mem = malloc(size);
+		if (bufv->buf[0].mem == 0)
+			return -ENOMEM;
+		bufv->buf[0].size = n.Read((char*) bufv->buf[0].mem, size, offset);
+	}
+	MtpStats::Add(MtpStats::FuseBytesRead, bufv->buf[0].size);
+	return 0;
 
 	FUSE_ERROR_BLOCK_END
 }
+#endif
 
 extern "C" int jmtpfs_mkdir(const char* pathStr, mode_t mode)
 {
-	FUSE_ERROR_BLOCK_START
+	FUSE_MODIFY_BLOCK_START(MtpStats::FuseMkdir)
 
 	FilesystemPath path(pathStr);
 	context->getNode(path.AllButTail())->mkdir(path.Tail());
+	context->forgetPath(path);
 	return 0;
 
 	FUSE_ERROR_BLOCK_END
@@ -151,10 +261,11 @@ extern "C" int jmtpfs_mkdir(const char* pathStr, mode_t mode)
 
 extern "C" int jmtpfs_rmdir(const char* pathStr)
 {
-	FUSE_ERROR_BLOCK_START
+	FUSE_MODIFY_BLOCK_START(MtpStats::FuseRmdir)
 
 	FilesystemPath path(pathStr);
 	context->getNode(path)->Remove();
+	context->forgetTree(path);
 	return 0;
 
 	FUSE_ERROR_BLOCK_END
@@ -163,71 +274,160 @@ extern "C" int jmtpfs_rmdir(const char* pathStr)
 
 extern "C" int jmtpfs_create(const char* pathStr, mode_t mode, struct fuse_file_info *fileInfo)
 {
-	FUSE_ERROR_BLOCK_START
+	FUSE_MODIFY_BLOCK_START(MtpStats::FuseCreate)
 
 	FilesystemPath path(pathStr);
 	std::unique_ptr<MtpNode> n = context->getNode(path.AllButTail());
 	n->CreateFile(path.Tail());
+	context->forgetPath(path);
 	n = context->getNode(path);
-	n->Open();
+	n->Open(true);
+	setOpenedNode(fileInfo, std::move(n));
 	return 0;
 
 	FUSE_ERROR_BLOCK_END
 }
 
-extern "C" int jmtpfs_write(const char *pathStr, const char *data, size_t size, off_t offset, struct fuse_file_info *)
+extern "C" int jmtpfs_write(const char *pathStr, const char *data, size_t size, off_t offset, struct fuse_file_info *fi)
 {
-	FUSE_ERROR_BLOCK_START
+	FUSE_ERROR_BLOCK_START(MtpStats::FuseWrite)
 
-	FilesystemPath path(pathStr);
-	return context->getNode(path)->Write(data, size, offset);
+	int bytesWritten = openedNode(fi).Write(data, size, offset);
+	MtpStats::Add(MtpStats::FuseBytesWritten, bytesWritten);
+	return bytesWritten;
 
 	FUSE_ERROR_BLOCK_END
 }
 
+#if FUSE_VERSION >= 29
+// Splices what was written straight into the local copy when there is one
+extern "C" int jmtpfs_write_buf(const char *pathStr, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi)
+{
+	FUSE_ERROR_BLOCK_START(MtpStats::FuseWrite)
+
+	MtpNode& n = openedNode(fi);
+	size_t size = fuse_buf_size(buf);
+	std::shared_ptr<MtpLocalFileCopy> localFile = n.OpenedCopy(true);
+	size_t bytesWritten;
+	if (localFile)
+	{
+		bytesWritten = localFile->writeWith(size, offset, [&](int fd, size_t length) -> size_t
+		{
+			struct fuse_bufvec destination = FUSE_BUFVEC_INIT(length);
+			destination.buf[0].flags = (enum fuse_buf_flags) (FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+			destination.buf[0].fd = fd;
+			destination.buf[0].pos = offset;
+			ssize_t copied = fuse_buf_copy(&destination, buf, FUSE_BUF_SPLICE_NONBLOCK);
+			if (copied < 0)
+				throw WriteError(-copied);
+			return copied;
+		});
+	}
+	else
+	{
+		std::vector<char> data(size);
+		struct fuse_bufvec destination = FUSE_BUFVEC_INIT(size);
+		destination.buf[0].mem = data.data();
+		ssize_t copied = fuse_buf_copy(&destination, buf, (enum fuse_buf_copy_flags) 0);
+		if (copied < 0)
+			throw WriteError(-copied);
+		bytesWritten = n.Write(data.data(), copied, offset);
+	}
+	MtpStats::Add(MtpStats::FuseBytesWritten, bytesWritten);
+	return bytesWritten;
+
+	FUSE_ERROR_BLOCK_END
+}
+#endif
+
 extern "C" int jmtpfs_truncate(const char *pathStr, off_t length)
 {
-	FUSE_ERROR_BLOCK_START
+	FUSE_MODIFY_BLOCK_START(MtpStats::FuseTruncate)
 
 	FilesystemPath path(pathStr);
-	context->getNode(path)->Truncate(length);
+	std::unique_ptr<MtpNode> n = context->getNode(path);
+	uint32_t id = n->Id();
+	n->Truncate(length);
+	// Truncating usually sends a new copy of the file, which gets a new object id
+	if (n->Id() != id)
+		context->forgetPath(path);
 	return 0;
 
 	FUSE_ERROR_BLOCK_END
 }
 
+#if FUSE_VERSION >= 29
+extern "C" int jmtpfs_fallocate(const char *pathStr, int mode, off_t offset, off_t length, struct fuse_file_info*)
+{
+	// Only plain allocation makes sense, as a hint of how big a file will be
+	if (mode)
+		return -EOPNOTSUPP;
+
+	FUSE_MODIFY_BLOCK_START(MtpStats::FuseFallocate)
+
+	FilesystemPath path(pathStr);
+	std::unique_ptr<MtpNode> n = context->getNode(path);
+	uint32_t id = n->Id();
+	n->Allocate(offset, length);
+	if (n->Id() != id)
+		context->forgetPath(path);
+	return 0;
+
+	FUSE_ERROR_BLOCK_END
+}
+#endif
+
 extern "C" int jmtpfs_unlink(const char *pathStr)
 {
-	FUSE_ERROR_BLOCK_START
+	FUSE_MODIFY_BLOCK_START(MtpStats::FuseUnlink)
 
 	FilesystemPath path(pathStr);
 	context->getNode(path)->Remove();
+	context->forgetPath(path);
 	return 0;
 
 	FUSE_ERROR_BLOCK_END
 }
 
-extern "C" int jmtpfs_flush(const char *pathStr, struct fuse_file_info *)
+extern "C" int jmtpfs_flush(const char *pathStr, struct fuse_file_info *fi)
 {
-	FUSE_ERROR_BLOCK_START
+	FUSE_ERROR_BLOCK_START(MtpStats::FuseFlush)
 
 	FilesystemPath path(pathStr);
-	context->getNode(path)->Close();
+	closeNode(context, path, openedNode(fi), false);
 	return 0;
 
 	FUSE_ERROR_BLOCK_END
 }
 
 
+// Closing only queues changes to be sent, fsync waits for them to get there
+extern "C" int jmtpfs_fsync(const char *pathStr, int, struct fuse_file_info *fi)
+{
+	FUSE_ERROR_BLOCK_START(MtpStats::FuseFsync)
+
+	FilesystemPath path(pathStr);
+	MtpNode& n = openedNode(fi);
+	uint32_t id = n.Id();
+	n.Fsync();
+	if (n.Id() != id)
+		context->forgetPath(path);
+	return 0;
+
+	FUSE_ERROR_BLOCK_END
+}
+
 extern "C" int jmtpfs_rename(const char *pathStr, const char *newPathStr)
 {
-	FUSE_ERROR_BLOCK_START
+	FUSE_MODIFY_BLOCK_START(MtpStats::FuseRename)
 
 	FilesystemPath path(pathStr);
 	std::unique_ptr<MtpNode> n = context->getNode(path);
 	FilesystemPath newPath(newPathStr);
 	std::unique_ptr<MtpNode> newParent = context->getNode(newPath.AllButTail());
 	n->Rename(*newParent, newPath.Tail());
+	context->forgetTree(path);
+	context->forgetTree(newPath);
 
 	return 0;
 
@@ -236,7 +436,7 @@ extern "C" int jmtpfs_rename(const char *pathStr, const char *newPathStr)
 
 extern "C" int jmtpfs_statfs(const char *pathStr, struct statvfs *stat)
 {
-	FUSE_ERROR_BLOCK_START
+	FUSE_ERROR_BLOCK_START(MtpStats::FuseStatfs)
 
 	FilesystemPath path(pathStr);
 	std::unique_ptr<MtpNode> n = context->getNode(path);
@@ -248,7 +448,7 @@ extern "C" int jmtpfs_statfs(const char *pathStr, struct statvfs *stat)
 
 extern "C" int jmtpfs_chmod(const char* pathStr, mode_t mode)
 {
-	FUSE_ERROR_BLOCK_START
+	FUSE_ERROR_BLOCK_START(MtpStats::FuseChmod)
 
 	FilesystemPath path(pathStr);
 	context->getNode(path);
@@ -261,7 +461,7 @@ extern "C" int jmtpfs_chmod(const char* pathStr, mode_t mode)
 
 extern "C" int jmtpfs_utime(const char* pathStr, struct utimbuf*)
 {
-	FUSE_ERROR_BLOCK_START
+	FUSE_ERROR_BLOCK_START(MtpStats::FuseUtime)
 
 	FilesystemPath path(pathStr);
 	context->getNode(path);
@@ -273,16 +473,180 @@ extern "C" int jmtpfs_utime(const char* pathStr, struct utimbuf*)
 }
 
 
+// With -trace the operations below are installed instead of the ones above,
+// so there is no cost when not tracing.
+static std::unique_ptr<MtpTraceWriter> traceWriter;
+
+extern "C" int jmtpfs_trace_getattr(const char* pathStr, struct stat* info)
+{
+	MtpTraceScope trace(*traceWriter, TraceGetattr, pathStr);
+	int result = jmtpfs_getattr(pathStr, info);
+	if (result == 0)
+		trace.setNode(*info);
+	return trace.finish(result);
+}
+
+// Counts the entries the real filler accepted
+struct TraceReaddirFiller
+{
+	void*				buf;
+	fuse_fill_dir_t		filler;
+	uint64_t			entries;
+};
+
+extern "C" int jmtpfs_trace_fill_dir(void* buf, const char* name, const struct stat* info, off_t offset)
+{
+	TraceReaddirFiller* f = (TraceReaddirFiller*) buf;
+	int result = f->filler(f->buf, name, info, offset);
+	if (result == 0)
+		f->entries++;
+	return result;
+}
+
+extern "C" int jmtpfs_trace_readdir(const char* pathStr, void* buf, fuse_fill_dir_t filler,
+		off_t offset, struct fuse_file_info *fi)
+{
+	MtpTraceScope trace(*traceWriter, TraceReaddir, pathStr);
+	TraceReaddirFiller f = { buf, filler, 0 };
+	int result = jmtpfs_readdir(pathStr, &f, jmtpfs_trace_fill_dir, offset, fi);
+	// not counting . and ..
+	trace.setSize(f.entries > 2 ? f.entries - 2 : 0);
+	return trace.finish(result);
+}
+
+extern "C" int jmtpfs_trace_open(const char *pathStr, struct fuse_file_info* fi)
+{
+	MtpTraceScope trace(*traceWriter, TraceOpen, pathStr);
+	return trace.finish(jmtpfs_open(pathStr, fi));
+}
+
+extern "C" int jmtpfs_trace_release(const char *pathStr, struct fuse_file_info* fi)
+{
+	MtpTraceScope trace(*traceWriter, TraceRelease, pathStr);
+	return trace.finish(jmtpfs_release(pathStr, fi));
+}
+
+extern "C" int jmtpfs_trace_read(const char *pathStr, char *buf, size_t  size, off_t offset, struct fuse_file_info* fi)
+{
+	MtpTraceScope trace(*traceWriter, TraceRead, pathStr, 0, offset, size);
+	return trace.finish(jmtpfs_read(pathStr, buf, size, offset, fi));
+}
+
+extern "C" int jmtpfs_trace_mkdir(const char* pathStr, mode_t mode)
+{
+	MtpTraceScope trace(*traceWriter, TraceMkdir, pathStr);
+	return trace.finish(jmtpfs_mkdir(pathStr, mode));
+}
+
+extern "C" int jmtpfs_trace_rmdir(const char* pathStr)
+{
+	MtpTraceScope trace(*traceWriter, TraceRmdir, pathStr);
+	return trace.finish(jmtpfs_rmdir(pathStr));
+}
+
+extern "C" int jmtpfs_trace_create(const char* pathStr, mode_t mode, struct fuse_file_info* fi)
+{
+	MtpTraceScope trace(*traceWriter, TraceCreate, pathStr);
+	return trace.finish(jmtpfs_create(pathStr, mode, fi));
+}
+
+extern "C" int jmtpfs_trace_write(const char *pathStr, const char *data, size_t size, off_t offset,
+		struct fuse_file_info* fi)
+{
+	MtpTraceScope trace(*traceWriter, TraceWrite, pathStr, 0, offset, size);
+	return trace.finish(jmtpfs_write(pathStr, data, size, offset, fi));
+}
+
+extern "C" int jmtpfs_trace_truncate(const char *pathStr, off_t length)
+{
+	MtpTraceScope trace(*traceWriter, TraceTruncate, pathStr, 0, length);
+	return trace.finish(jmtpfs_truncate(pathStr, length));
+}
+
+#if FUSE_VERSION >= 29
+extern "C" int jmtpfs_trace_fallocate(const char *pathStr, int mode, off_t offset, off_t length,
+		struct fuse_file_info* fi)
+{
+	MtpTraceScope trace(*traceWriter, TraceFallocate, pathStr, 0, offset, length);
+	return trace.finish(jmtpfs_fallocate(pathStr, mode, offset, length, fi));
+}
+#endif
+
+extern "C" int jmtpfs_trace_unlink(const char *pathStr)
+{
+	MtpTraceScope trace(*traceWriter, TraceUnlink, pathStr);
+	return trace.finish(jmtpfs_unlink(pathStr));
+}
+
+extern "C" int jmtpfs_trace_flush(const char *pathStr, struct fuse_file_info* fi)
+{
+	MtpTraceScope trace(*traceWriter, TraceFlush, pathStr);
+	return trace.finish(jmtpfs_flush(pathStr, fi));
+}
+
+extern "C" int jmtpfs_trace_fsync(const char *pathStr, int datasync, struct fuse_file_info* fi)
+{
+	MtpTraceScope trace(*traceWriter, TraceFsync, pathStr);
+	return trace.finish(jmtpfs_fsync(pathStr, datasync, fi));
+}
+
+extern "C" int jmtpfs_trace_rename(const char *pathStr, const char *newPathStr)
+{
+	MtpTraceScope trace(*traceWriter, TraceRename, pathStr, newPathStr);
+	return trace.finish(jmtpfs_rename(pathStr, newPathStr));
+}
+
+extern "C" int jmtpfs_trace_statfs(const char *pathStr, struct statvfs *stat)
+{
+	MtpTraceScope trace(*traceWriter, TraceStatfs, pathStr);
+	return trace.finish(jmtpfs_statfs(pathStr, stat));
+}
+
+extern "C" int jmtpfs_trace_chmod(const char* pathStr, mode_t mode)
+{
+	MtpTraceScope trace(*traceWriter, TraceChmod, pathStr);
+	return trace.finish(jmtpfs_chmod(pathStr, mode));
+}
+
+extern "C" int jmtpfs_trace_utime(const char* pathStr, struct utimbuf* times)
+{
+	MtpTraceScope trace(*traceWriter, TraceUtime, pathStr);
+	return trace.finish(jmtpfs_utime(pathStr, times));
+}
+
+
 struct jmtpfs_options
 {
 	jmtpfs_options() : listDevices(0), displayHelp(0),
-			showVersion(0), device(0), listStorage(0) {}
+			showVersion(0), device(0), listStorage(0), readCacheMegabytes(32),
+			useIndex(0), indexDirectory(0), metadataTtl(0), adaptiveTtl(0), metadataCacheMegabytes(64),
+			lowLevel(0), simulate(0), trace(0), lockProfile(0), lockProfileMilliseconds(10),
+			timeline(0), timelineFile(0), syncWrites(0), contentCacheMegabytes(0),
+			stagingDirectory(0), stagingMegabytes(0), stagingMemoryMegabytes(32) {}
 
 	int	listDevices;
 	int displayHelp;
 	int showVersion;
 	int listStorage;
 	char* device;
+	unsigned readCacheMegabytes;
+	int useIndex;
+	char* indexDirectory;
+	char* metadataTtl;
+	int adaptiveTtl;
+	unsigned metadataCacheMegabytes;
+	int lowLevel;
+	char* simulate;
+	char* trace;
+	int lockProfile;
+	unsigned lockProfileMilliseconds;
+	int timeline;
+	char* timelineFile;
+	int syncWrites;
+	unsigned contentCacheMegabytes;
+	char* stagingDirectory;
+	unsigned stagingMegabytes;
+	unsigned stagingMemoryMegabytes;
 };
 
 static struct fuse_opt jmtpfs_opts[] = {
@@ -293,6 +657,27 @@ static struct fuse_opt jmtpfs_opts[] = {
 		{"-h", offsetof(struct jmtpfs_options, displayHelp), 1},
 		{"--help", offsetof(struct jmtpfs_options, displayHelp),1},
 		{"-device=%s", offsetof(struct jmtpfs_options, device),0},
+		{"-readcache=%u", offsetof(struct jmtpfs_options, readCacheMegabytes),0},
+		{"-index", offsetof(struct jmtpfs_options, useIndex),1},
+		{"-indexdir=%s", offsetof(struct jmtpfs_options, indexDirectory),0},
+		{"-metadatattl=%s", offsetof(struct jmtpfs_options, metadataTtl),0},
+		{"-adaptivettl", offsetof(struct jmtpfs_options, adaptiveTtl),1},
+		{"-syncwrites", offsetof(struct jmtpfs_options, syncWrites),1},
+		{"-contentcache=%u", offsetof(struct jmtpfs_options, contentCacheMegabytes),0},
+		{"-stagingdir=%s", offsetof(struct jmtpfs_options, stagingDirectory),0},
+		{"-staging=%u", offsetof(struct jmtpfs_options, stagingMegabytes),0},
+		{"-stagingmemory=%u", offsetof(struct jmtpfs_options, stagingMemoryMegabytes),0},
+		{"-metadatacache=%u", offsetof(struct jmtpfs_options, metadataCacheMegabytes),0},
+		{"-lowlevel", offsetof(struct jmtpfs_options, lowLevel),1},
+		{"-simulate=%s", offsetof(struct jmtpfs_options, simulate),0},
+		{"-trace=%s", offsetof(struct jmtpfs_options, trace),0},
+		{"-lockprofile", offsetof(struct jmtpfs_options, lockProfile),1},
+		{"-lockprofile=%u", offsetof(struct jmtpfs_options, lockProfileMilliseconds),0},
+		// fuse_opt applies every matching template, so this also turns it on
+		{"-lockprofile=", offsetof(struct jmtpfs_options, lockProfile),1},
+		{"-timeline", offsetof(struct jmtpfs_options, timeline),1},
+		{"-timeline=%s", offsetof(struct jmtpfs_options, timelineFile),0},
+		{"-timeline=", offsetof(struct jmtpfs_options, timeline),1},
 		{"-V", offsetof(struct jmtpfs_options, showVersion),1},
 		{"--version", offsetof(struct jmtpfs_options, showVersion),1},
 		FUSE_OPT_END
@@ -318,10 +703,16 @@ int main(int argc, char *argv[])
 	jmtpfs_oper.truncate = jmtpfs_truncate;
 	jmtpfs_oper.unlink = jmtpfs_unlink;
 	jmtpfs_oper.flush = jmtpfs_flush;
+	jmtpfs_oper.fsync = jmtpfs_fsync;
 	jmtpfs_oper.rename = jmtpfs_rename;
 	jmtpfs_oper.statfs = jmtpfs_statfs;
 	jmtpfs_oper.chmod = jmtpfs_chmod;
 	jmtpfs_oper.utime = jmtpfs_utime;
+#if FUSE_VERSION >= 29
+	jmtpfs_oper.fallocate = jmtpfs_fallocate;
+	jmtpfs_oper.read_buf = jmtpfs_read_buf;
+	jmtpfs_oper.write_buf = jmtpfs_write_buf;
+#endif
 
 	jmtpfs_options options;
 
@@ -391,6 +782,53 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	MtpCacheSettings cacheSettings;
+	cacheSettings.readCacheBytes = ((size_t) options.readCacheMegabytes) * 1024 * 1024;
+	cacheSettings.metadataCacheBytes = ((size_t) options.metadataCacheMegabytes) * 1024 * 1024;
+	cacheSettings.adaptiveTtl = options.adaptiveTtl;
+	cacheSettings.writeBack = !options.syncWrites;
+	if (options.stagingDirectory)
+		cacheSettings.stagingDirectory = options.stagingDirectory;
+	cacheSettings.stagingBytes = ((uint64_t) options.stagingMegabytes) * 1024 * 1024;
+	cacheSettings.stagingMemoryBytes = ((uint64_t) options.stagingMemoryMegabytes) * 1024 * 1024;
+	if (options.metadataTtl)
+	{
+		std::string ttlStr(options.metadataTtl);
+		if (ttlStr == "forever")
+			cacheSettings.metadataTtl = MtpCacheSettings::NeverExpire;
+		else
+		{
+			std::istringstream ttl(ttlStr);
+			int seconds = -1;
+			ttl >> seconds;
+			if ((seconds < 0) || !ttl.eof())
+			{
+				std::cerr << "Invalid metadata ttl" << std::endl;
+				options.displayHelp = 1;
+			}
+			else
+				cacheSettings.metadataTtl = seconds;
+		}
+	}
+
+	// Before any threads start, since it changes how locks are taken
+	if (options.lockProfile)
+		MtpStats::EnableLockProfiling(((uint64_t) options.lockProfileMilliseconds) * 1000);
+	if (options.timeline)
+	{
+		// FUSE changes to / when it goes into the background, and the file is
+		// only written later
+		std::string timelineFile;
+		if (options.timelineFile)
+		{
+			timelineFile = options.timelineFile;
+			char cwd[PATH_MAX];
+			if ((timelineFile[0] != '/') && getcwd(cwd, sizeof(cwd)))
+				timelineFile = std::string(cwd) + "/" + timelineFile;
+		}
+		MtpTimeline::Enable(timelineFile);
+	}
+
 	if (options.listStorage)
 	{
 		LIBMTP_Init();
@@ -433,29 +871,95 @@ int main(int argc, char *argv[])
 	}
 	else
 	{
-		LIBMTP_Init();
 		std::unique_ptr<MtpDevice> device;
-		ConnectedMtpDevices devices;
-		if (devices.NumDevices()==0)
+		if (options.simulate)
 		{
-			std::cerr << "No mtp devices found." << std::endl;
-			return -1;
+			try
+			{
+				device.reset(new MtpSimulatedDevice(MtpSimulatedDeviceSettings::Parse(options.simulate)));
+			}
+			catch(std::invalid_argument& e)
+			{
+				std::cerr << "Invalid simulated device settings: " << e.what() << std::endl;
+				return -1;
+			}
 		}
-		try
+		else
 		{
-			if ((requestedBusLocation==-1) || (requestedDevnum == -1))
-				device = devices.GetDevice(0);
-			else
-				device = devices.GetDevice(requestedBusLocation, requestedDevnum);
+			LIBMTP_Init();
+			ConnectedMtpDevices devices;
+			if (devices.NumDevices()==0)
+			{
+				std::cerr << "No mtp devices found." << std::endl;
+				return -1;
+			}
+			try
+			{
+				if ((requestedBusLocation==-1) || (requestedDevnum == -1))
+					device = devices.GetDevice(0);
+				else
+					device = devices.GetDevice(requestedBusLocation, requestedDevnum);
+			}
+			catch(MtpDeviceNotFound&)
+			{
+				std::cerr << "Requested device not found" << std::endl;
+				return -1;
+			}
 		}
-		catch(MtpDeviceNotFound&)
+
+		std::string indexDirectory;
+		if (options.indexDirectory)
+			indexDirectory = options.indexDirectory;
+		else if (options.useIndex)
+			indexDirectory = MtpMetadataIndex::DefaultDirectory();
+
+		if (options.contentCacheMegabytes)
 		{
-			std::cerr << "Requested device not found" << std::endl;
-			return -1;
+			cacheSettings.contentCacheBytes = ((uint64_t) options.contentCacheMegabytes) * 1024 * 1024;
+			cacheSettings.contentCacheDirectory = options.indexDirectory ? options.indexDirectory :
+					MtpMetadataIndex::DefaultDirectory();
 		}
 
-		context = std::unique_ptr<MtpFuseContext>(new MtpFuseContext(std::move(device), getuid(), getgid()));
+		context = std::unique_ptr<MtpFuseContext>(new MtpFuseContext(std::move(device), getuid(), getgid(),
+				cacheSettings, indexDirectory));
 
+		if (options.trace && options.lowLevel)
+			std::cerr << "-trace only works with the path based interface, not tracing" << std::endl;
+		else if (options.trace)
+		{
+			try
+			{
+				traceWriter.reset(new MtpTraceWriter(options.trace));
+			}
+			catch(std::exception& e)
+			{
+				std::cerr << "Unable to create the trace file: " << e.what() << std::endl;
+				return -1;
+			}
+			jmtpfs_oper.getattr = jmtpfs_trace_getattr;
+			jmtpfs_oper.readdir = jmtpfs_trace_readdir;
+			jmtpfs_oper.open = jmtpfs_trace_open;
+			jmtpfs_oper.release = jmtpfs_trace_release;
+			jmtpfs_oper.read = jmtpfs_trace_read;
+			jmtpfs_oper.mkdir = jmtpfs_trace_mkdir;
+			jmtpfs_oper.rmdir = jmtpfs_trace_rmdir;
+			jmtpfs_oper.create = jmtpfs_trace_create;
+			jmtpfs_oper.write = jmtpfs_trace_write;
+			jmtpfs_oper.truncate = jmtpfs_trace_truncate;
+			jmtpfs_oper.unlink = jmtpfs_trace_unlink;
+			jmtpfs_oper.flush = jmtpfs_trace_flush;
+			jmtpfs_oper.fsync = jmtpfs_trace_fsync;
+			jmtpfs_oper.rename = jmtpfs_trace_rename;
+			jmtpfs_oper.statfs = jmtpfs_trace_statfs;
+			jmtpfs_oper.chmod = jmtpfs_trace_chmod;
+			jmtpfs_oper.utime = jmtpfs_trace_utime;
+#if FUSE_VERSION >= 29
+			jmtpfs_oper.fallocate = jmtpfs_trace_fallocate;
+			// Reads and writes are only traced through read and write
+			jmtpfs_oper.read_buf = 0;
+			jmtpfs_oper.write_buf = 0;
+#endif
+		}
 	}
 
 	if (options.showVersion)
@@ -469,7 +973,12 @@ int main(int argc, char *argv[])
 	fuse_opt_add_arg(&args, "-s"); // bug in fuse4x where multithreaded sometimes doesn't exit correctly.
 #endif
 
-	int result = fuse_main(args.argc, args.argv, &jmtpfs_oper, context.get());
+	int result;
+	if (options.lowLevel && context)
+		result = jmtpfs_lowlevel_main(&args, context.get(), cacheSettings.metadataTtl);
+	else
+		result = fuse_main(args.argc, args.argv, &jmtpfs_oper, context.get());
+	traceWriter.reset();
 
 	if (options.displayHelp)
 	{
@@ -477,6 +986,31 @@ int main(int argc, char *argv[])
 		std::cout << "    -l    --listDevices         list available mtp devices and then exit" << std::endl;
 //		std::cout << "    -ls   --listStorage         list the storage areas on the device (or all devices if -l is also specified)" << std::endl;
 		std::cout << "    -device=<busnum>,<devnum>   Device to mount. It not specified the first device found is used"<< std::endl;
+		std::cout << "    -readcache=<megabytes>      Memory used to cache data read from the device (default 32)" << std::endl;
+		std::cout << "    -metadatattl=<seconds>      How long file and folder information is cached (default 5)" << std::endl;
+		std::cout << "                                Use \"forever\" if nothing else will change files on the device" << std::endl;
+		std::cout << "    -adaptivettl                Cache folders that don't change for progressively longer" << std::endl;
+		std::cout << "    -metadatacache=<megabytes>  Memory used to cache file and folder information (default 64)" << std::endl;
+		std::cout << "    -syncwrites                 Send changed files to the device before close returns, instead" << std::endl;
+		std::cout << "                                of in the background" << std::endl;
+		std::cout << "    -lowlevel                   Use the inode based FUSE interface. Lets the kernel cache" << std::endl;
+		std::cout << "                                file and folder information for the metadata ttl" << std::endl;
+		std::cout << "    -simulate=<settings>        Mount a simulated in memory device instead of a real one." << std::endl;
+		std::cout << "                                settings is a comma separated list of latency=<microseconds>," << std::endl;
+		std::cout << "                                bandwidth=<KB/s>, folders=<n>, files=<files per folder>," << std::endl;
+		std::cout << "                                filesize=<bytes>, partial=<0|1>, edit=<0|1>" << std::endl;
+		std::cout << "    -index                      Keep folder listings on disk between mounts (in ~/.cache/jmtpfs)" << std::endl;
+		std::cout << "    -indexdir=<directory>       Like -index, but keep the listings in the given directory" << std::endl;
+		std::cout << "    -contentcache=<megabytes>   Keep up to this much of the files read from the device on disk" << std::endl;
+		std::cout << "                                (in the -indexdir directory, or ~/.cache/jmtpfs)" << std::endl;
+		std::cout << "    -stagingdir=<directory>     Keep local copies of open files here instead of $TMPDIR or /tmp" << std::endl;
+		std::cout << "    -staging=<megabytes>        Make opens wait while local copies take more than this (default no limit)" << std::endl;
+		std::cout << "    -stagingmemory=<megabytes>  Keep up to this much of the small local copies in memory (default 32)" << std::endl;
+		std::cout << "    -trace=<file>               Record every filesystem operation to file, for jmtpfs_replay" << std::endl;
+		std::cout << "    -lockprofile[=<ms>]         Add lock wait and hold times to /.jmtpfs/stats, and count waits" << std::endl;
+		std::cout << "                                longer than ms (default 10) by the operation holding the lock" << std::endl;
+		std::cout << "    -timeline[=<file>]          Record recent operations, lock waits and transfers of each thread," << std::endl;
+		std::cout << "                                readable from /.jmtpfs/timeline, or written to file on SIGUSR1" << std::endl;
 
 	}
 
@@ -0,0 +1,389 @@
+/*
+ * jmtpfsBenchmark.cpp
+ *
+ * This software is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 3 as published by the Free Software Foundation.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02111-1301, USA.
+ * licensing@fsf.org
+ */
+
+/*
+ * Microbenchmarks for the per call cost of the metadata and path resolution
+ * paths, run against a simulated device with no latency so that only our
+ * own overhead is measured. Each benchmark reports calls per second, heap
+ * allocations per call and the median and 99th percentile call time. Run
+ * with "make benchmark".
+ */
+
+#include "MtpFuseContext.h"
+#include "MtpSimulatedDevice.h"
+#include "MtpMetadataCache.h"
+#include "MtpFilesystemPath.h"
+#include "mtpFilesystemErrors.h"
+#include "Mutex.h"
+#include "MtpStats.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <ftw.h>
+#include <functional>
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <new>
+#include <stdexcept>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// The benchmarks are single threaded, so a plain counter is enough.
+static unsigned long long allocations = 0;
+
+void* operator new(size_t size)
+{
+	allocations++;
+	void* p = malloc(size ? size : 1);
+	if (!p)
+		throw std::bad_alloc();
+	return p;
+}
+
+void* operator new[](size_t size)
+{
+	return operator new(size);
+}
+
+void operator delete(void* p) throw()
+{
+	free(p);
+}
+
+void operator delete[](void* p) throw()
+{
+	free(p);
+}
+
+static uint64_t Now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t) ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+class Benchmark
+{
+public:
+	Benchmark(unsigned iterations) : m_iterations(iterations)
+	{
+		m_times.reserve(iterations);
+		std::cout << std::left << std::setw(36) << "benchmark" << std::right << std::setw(12) << "ops/sec"
+				<< std::setw(12) << "allocs/op" << std::setw(10) << "p50 ns" << std::setw(10) << "p99 ns" << std::endl;
+	}
+
+	// Calls op(i) for i from 0 to the iteration count and prints the results.
+	void run(const std::string& name, const std::function<void(unsigned)>& op)
+	{
+		m_times.clear();
+		unsigned long long startAllocations = allocations;
+		uint64_t start = Now();
+		for(unsigned i = 0; i < m_iterations; i++)
+		{
+			uint64_t opStart = Now();
+			op(i);
+			m_times.push_back(Now() - opStart);
+		}
+		uint64_t total = Now() - start;
+		unsigned long long used = allocations - startAllocations;
+
+		std::sort(m_times.begin(), m_times.end());
+		std::cout << std::left << std::setw(36) << name << std::right << std::fixed
+				<< std::setw(12) << std::setprecision(0) << (m_iterations * 1e9 / std::max<uint64_t>(total, 1))
+				<< std::setw(12) << std::setprecision(2) << ((double) used / m_iterations)
+				<< std::setw(10) << m_times[m_times.size() / 2]
+				<< std::setw(10) << m_times[(m_times.size() * 99) / 100] << std::endl;
+	}
+
+private:
+	unsigned				m_iterations;
+	std::vector<uint64_t>	m_times;
+};
+
+// Fills the cache with a small file entry without touching a device.
+class BenchmarkFiller : public MtpMetadataCacheFiller
+{
+public:
+	BenchmarkFiller() : m_id(0) {}
+
+	void setId(uint32_t id)
+	{
+		m_id = id;
+	}
+
+	MtpNodeMetadata getMetadata()
+	{
+		MtpNodeMetadata md;
+		md.self = MtpFileInfo(m_id, 0, MtpSimulatedDevice::StorageId, "file.jpg", LIBMTP_FILETYPE_JPEG, 1024);
+		return md;
+	}
+
+private:
+	uint32_t m_id;
+};
+
+// Counts the reads of file contents that reach the device
+class CountingDevice : public MtpSimulatedDevice
+{
+public:
+	CountingDevice(const MtpSimulatedDeviceSettings& settings) : MtpSimulatedDevice(settings), m_reads(0) {}
+
+	unsigned reads() { return m_reads; }
+
+protected:
+	void DoGetFile(uint32_t id, int fd)
+	{
+		m_reads++;
+		MtpSimulatedDevice::DoGetFile(id, fd);
+	}
+
+	size_t DoGetPartialObject(uint32_t id, uint64_t offset, uint32_t maxBytes, void* buffer)
+	{
+		m_reads++;
+		return MtpSimulatedDevice::DoGetPartialObject(id, offset, maxBytes, buffer);
+	}
+
+private:
+	unsigned m_reads;
+};
+
+static int RemoveEntry(const char* path, const struct stat*, int, struct FTW*)
+{
+	remove(path);
+	return 0;
+}
+
+static std::string FilePath(unsigned folder, unsigned file)
+{
+	std::ostringstream s;
+	s << "/Simulated Storage/folder" << folder << "/file" << file << ".jpg";
+	return s.str();
+}
+
+static std::string FileName(unsigned file)
+{
+	std::ostringstream s;
+	s << "file" << file << ".jpg";
+	return s.str();
+}
+
+// Not a benchmark: checks that with the content cache on, opening an
+// unchanged file a second time is served from the cache even when the
+// device could have read it a piece at a time.
+static void CheckContentCache()
+{
+	MtpSimulatedDeviceSettings settings;
+	settings.latencyMicroseconds = 0;
+	settings.bandwidthKBps = 0;
+	settings.folders = 1;
+	settings.filesPerFolder = 1;
+	settings.fileSize = 1024 * 1024;
+	settings.partialObject = true;
+
+	char directory[] = "/tmp/jmtpfs_benchmark.XXXXXX";
+	if (!mkdtemp(directory))
+		throw WriteError(errno);
+	try
+	{
+		MtpCacheSettings cacheSettings;
+		cacheSettings.contentCacheDirectory = directory;
+		cacheSettings.contentCacheBytes = settings.fileSize * 4;
+
+		// A new context each time, so the second open can't be served from
+		// the first one's read cache
+		FilesystemPath path(FilePath(0, 0).c_str());
+		std::vector<char> buffer(4096);
+		unsigned reads[2];
+		for(int pass = 0; pass < 2; pass++)
+		{
+			CountingDevice* device = new CountingDevice(settings);
+			MtpFuseContext context(std::unique_ptr<MtpDevice>(device), getuid(), getgid(), cacheSettings, "");
+			std::unique_ptr<MtpNode> file = context.getNode(path);
+			file->Open(false);
+			file->Read(&buffer[0], buffer.size(), 0);
+			file->Close();
+			reads[pass] = device->reads();
+		}
+		if ((reads[0] == 0) || (reads[1] != 0))
+			throw std::runtime_error("Reopening an unchanged file didn't use the content cache");
+	}
+	catch(...)
+	{
+		nftw(directory, RemoveEntry, 16, FTW_DEPTH | FTW_PHYS);
+		throw;
+	}
+	nftw(directory, RemoveEntry, 16, FTW_DEPTH | FTW_PHYS);
+	std::cout << "content cache reopen check passed" << std::endl;
+}
+
+static void Usage(const char* name)
+{
+	std::cerr << "usage: " << name << " [-iterations=N] [-simulate=name=value,...]" << std::endl;
+	std::cerr << "    -simulate is passed to the simulated device, see jmtpfs -h" << std::endl;
+}
+
+int main(int argc, char* argv[])
+{
+	unsigned iterations = 200000;
+	MtpSimulatedDeviceSettings settings;
+	settings.latencyMicroseconds = 0;
+	settings.bandwidthKBps = 0;
+	settings.folders = 4;
+	settings.filesPerFolder = 10000;
+	settings.fileSize = 4 * 1024 * 1024;
+
+	try
+	{
+		for(int i = 1; i < argc; i++)
+		{
+			std::string arg = argv[i];
+			if (arg.compare(0, 12, "-iterations=") == 0)
+				iterations = std::max(atoi(arg.c_str() + 12), 1);
+			else if (arg.compare(0, 10, "-simulate=") == 0)
+			{
+				// Start from the benchmark defaults rather than the mount defaults
+				std::ostringstream full;
+				full << "latency=0,bandwidth=0,folders=" << settings.folders << ",files=" << settings.filesPerFolder
+						<< ",filesize=" << settings.fileSize << "," << arg.substr(10);
+				settings = MtpSimulatedDeviceSettings::Parse(full.str());
+			}
+			else
+			{
+				Usage(argv[0]);
+				return 1;
+			}
+		}
+		if ((settings.folders == 0) || (settings.filesPerFolder == 0))
+			throw std::invalid_argument("Need at least one folder and file");
+	}
+	catch(std::invalid_argument& e)
+	{
+		std::cerr << e.what() << std::endl;
+		Usage(argv[0]);
+		return 1;
+	}
+
+	try
+	{
+		Benchmark benchmark(iterations);
+		unsigned files = settings.folders * settings.filesPerFolder;
+
+		std::vector<std::string> paths;
+		for(unsigned i = 0; i < files; i++)
+			paths.push_back(FilePath(i % settings.folders, i / settings.folders));
+
+		benchmark.run("FilesystemPath parse", [&](unsigned i) {
+			FilesystemPath path(paths[i % files].c_str());
+			path.Head();
+			path.Body();
+			path.Tail();
+			path.AllButTail();
+		});
+
+		{
+			MtpCacheSettings cacheSettings;
+			cacheSettings.metadataTtl = MtpCacheSettings::NeverExpire;
+			MtpMetadataCache cache(cacheSettings);
+			BenchmarkFiller filler;
+			const unsigned warm = 1000;
+			for(unsigned i = 0; i < warm; i++)
+			{
+				filler.setId(i + 1);
+				cache.getItem(i + 1, filler);
+			}
+			benchmark.run("MtpMetadataCache::getItem hit", [&](unsigned i) {
+				cache.getItem((i % warm) + 1, filler);
+			});
+			benchmark.run("MtpMetadataCache::clearItem+getItem", [&](unsigned i) {
+				uint32_t id = (i % warm) + 1;
+				filler.setId(id);
+				cache.clearItem(id);
+				cache.getItem(id, filler);
+			});
+		}
+
+		{
+			// Small enough that every miss trims the least recently used entry
+			MtpCacheSettings cacheSettings;
+			cacheSettings.metadataCacheBytes = 64 * 1024;
+			MtpMetadataCache cache(cacheSettings);
+			BenchmarkFiller filler;
+			benchmark.run("MtpMetadataCache::getItem miss+trim", [&](unsigned i) {
+				filler.setId(i + 1);
+				cache.getItem(i + 1, filler);
+			});
+		}
+
+		MtpCacheSettings cacheSettings;
+		cacheSettings.metadataTtl = MtpCacheSettings::NeverExpire;
+		MtpFuseContext context(std::unique_ptr<MtpDevice>(new MtpSimulatedDevice(settings)), getuid(), getgid(),
+				cacheSettings, "");
+
+		std::vector<std::string> names;
+		for(unsigned i = 0; i < settings.filesPerFolder; i++)
+			names.push_back(FileName(i));
+		std::unique_ptr<MtpNode> folder = context.getNode(FilesystemPath("/Simulated Storage/folder0"));
+		folder->readDirectoryEntries();
+		benchmark.run("MtpFolder::getNode", [&](unsigned i) {
+			folder->getNode(FilesystemPath(names[i % names.size()].c_str()));
+		});
+
+		// The first pass over each path misses the dentry cache, later ones hit
+		benchmark.run("MtpFuseContext::getNode", [&](unsigned i) {
+			context.getNode(FilesystemPath(paths[i % files].c_str()));
+		});
+
+		std::unique_ptr<MtpNode> file = context.getNode(FilesystemPath(paths[0].c_str()));
+		file->Open(false);
+		std::vector<char> buffer(4096);
+		off_t reads = settings.fileSize / buffer.size();
+		if (reads == 0)
+			reads = 1;
+		benchmark.run("MtpFile::Read 4K", [&](unsigned i) {
+			file->Read(&buffer[0], buffer.size(), (i % reads) * buffer.size());
+		});
+		file->Close();
+
+		CheckContentCache();
+
+		RecursiveMutex mutex(MtpStats::LockModify);
+		benchmark.run("LockMutex", [&](unsigned i) {
+			LockMutex lock(mutex);
+		});
+		MtpStats::EnableLockProfiling(10000);
+		benchmark.run("LockMutex with lock profiling", [&](unsigned i) {
+			LockMutex lock(mutex);
+		});
+	}
+	catch(MtpError& e)
+	{
+		std::cerr << "MTP error " << e.what() << std::endl;
+		return 1;
+	}
+	catch(std::exception& e)
+	{
+		std::cerr << e.what() << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
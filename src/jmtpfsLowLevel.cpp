@@ -0,0 +1,534 @@
+/*
+ * jmtpfsLowLevel.cpp
+ *
+ * This software is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 3 as published by the Free Software Foundation.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02111-1301, USA.
+ * licensing@fsf.org
+ */
+#include "jmtpfsLowLevel.h"
+#include "MtpInodeTable.h"
+#include "mtpFilesystemErrors.h"
+#include "MtpStats.h"
+
+#include <fuse_lowlevel.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <iostream>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+struct jmtpfs_lowlevel
+{
+	jmtpfs_lowlevel(MtpFuseContext* c, double t) :
+		context(c), inodes(c->getNode(FilesystemPath("/"))), timeout(t) {}
+
+	MtpFuseContext*	context;
+	MtpInodeTable	inodes;
+	double			timeout;
+};
+
+// The timer lives outside the try block so the handlers can mark it failed
+#define LOWLEVEL_BLOCK_START(op) \
+	MtpStatsFuseTimer fuseTimer(op); \
+	try \
+	{ \
+		jmtpfs_lowlevel* fs((jmtpfs_lowlevel*) fuse_req_userdata(req)); \
+		(void) fs; \
+
+#define LOWLEVEL_MODIFY_BLOCK_START(op) \
+	LOWLEVEL_BLOCK_START(op) \
+	LockMutex lock(fs->context->modifyLock());
+
+#define LOWLEVEL_BLOCK_END \
+	} \
+	catch(FileNotFound&) \
+	{ \
+		fuseTimer.failed(); \
+		fuse_reply_err(req, ENOENT); \
+	} \
+	catch(MtpDeviceDisconnected&) \
+	{ \
+		exit(-1); \
+	} \
+	catch(MtpFilesystemErrorWithErrorCode& e) \
+	{ \
+		fuseTimer.failed(); \
+		fuse_reply_err(req, e.ErrorCode()); \
+	} \
+	catch(std::exception&) \
+	{ \
+		fuseTimer.failed(); \
+		fuse_reply_err(req, EIO); \
+	}
+
+static void getAttributes(jmtpfs_lowlevel* fs, MtpNode& node, struct stat& info)
+{
+	memset(&info, 0, sizeof(info));
+	node.getattr(info);
+	info.st_uid = fs->context->uid();
+	info.st_gid = fs->context->gid();
+}
+
+static void fillEntry(jmtpfs_lowlevel* fs, MtpNode& node, struct fuse_entry_param& entry)
+{
+	memset(&entry, 0, sizeof(entry));
+	getAttributes(fs, node, entry.attr);
+	entry.ino = entry.attr.st_ino;
+	entry.attr_timeout = fs->timeout;
+	entry.entry_timeout = fs->timeout;
+	fs->inodes.add(entry.ino, node);
+}
+
+// Writing to a file, or truncating it, sends a new copy to the device
+// under a new object id. The kernel still knows it by the old inode.
+static void closeNode(jmtpfs_lowlevel* fs, fuse_ino_t ino, MtpNode& node, bool release)
+{
+	uint32_t id = node.Id();
+	if (release)
+		node.Close();
+	else
+		node.Flush();
+	if (node.Id() != id)
+		fs->inodes.replace(ino, node);
+}
+
+// An open file keeps its node in fi->fh, so reads and writes don't have to
+// go through the inode table.
+static void setOpenedNode(struct fuse_file_info* fi, std::unique_ptr<MtpNode> n)
+{
+	fi->fh = (uintptr_t) n.release();
+}
+
+static MtpNode& openedNode(struct fuse_file_info* fi)
+{
+	return *(MtpNode*)(uintptr_t) fi->fh;
+}
+
+// The open was interrupted, so there won't be a release. The reply has
+// already gone out, so errors can't be reported from here.
+static void abandonOpenedNode(jmtpfs_lowlevel* fs, fuse_ino_t ino, struct fuse_file_info* fi)
+{
+	std::unique_ptr<MtpNode> n(&openedNode(fi));
+	try
+	{
+		closeNode(fs, ino, *n, true);
+	}
+	catch(std::exception&)
+	{
+	}
+}
+
+extern "C" void jmtpfs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char* name)
+{
+	LOWLEVEL_BLOCK_START(MtpStats::FuseLookup)
+
+	std::unique_ptr<MtpNode> n = fs->inodes.getNode(parent)->getNode(FilesystemPath(name));
+	struct fuse_entry_param entry;
+	fillEntry(fs, *n, entry);
+	fuse_reply_entry(req, &entry);
+
+	LOWLEVEL_BLOCK_END
+}
+
+extern "C" void jmtpfs_ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+{
+	MtpStatsFuseTimer fuseTimer(MtpStats::FuseForget);
+	jmtpfs_lowlevel* fs((jmtpfs_lowlevel*) fuse_req_userdata(req));
+	fs->inodes.forget(ino, nlookup);
+	fuse_reply_none(req);
+}
+
+extern "C" void jmtpfs_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info*)
+{
+	LOWLEVEL_BLOCK_START(MtpStats::FuseGetattr)
+
+	std::unique_ptr<MtpNode> n = fs->inodes.getNode(ino);
+	struct stat info;
+	getAttributes(fs, *n, info);
+	fuse_reply_attr(req, &info, fs->timeout);
+
+	LOWLEVEL_BLOCK_END
+}
+
+extern "C" void jmtpfs_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat* attr, int toSet, struct fuse_file_info*)
+{
+	LOWLEVEL_MODIFY_BLOCK_START(MtpStats::FuseSetattr)
+
+	std::unique_ptr<MtpNode> n = fs->inodes.getNode(ino);
+	if (toSet & FUSE_SET_ATTR_SIZE)
+	{
+		uint32_t id = n->Id();
+		n->Truncate(attr->st_size);
+		if (n->Id() != id)
+			fs->inodes.replace(ino, *n);
+	}
+	// Changes to the mode, owner, or times are ignored since mtp doesn't support
+	// them. But we need to pretend to do them to make things like "cp -r" and the
+	// mac finder happy.
+	struct stat info;
+	getAttributes(fs, *n, info);
+	fuse_reply_attr(req, &info, fs->timeout);
+
+	LOWLEVEL_BLOCK_END
+}
+
+#if FUSE_VERSION >= 29
+extern "C" void jmtpfs_ll_fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t offset, off_t length,
+		struct fuse_file_info*)
+{
+	// Only plain allocation makes sense, as a hint of how big a file will be
+	if (mode)
+	{
+		fuse_reply_err(req, EOPNOTSUPP);
+		return;
+	}
+
+	LOWLEVEL_MODIFY_BLOCK_START(MtpStats::FuseFallocate)
+
+	std::unique_ptr<MtpNode> n = fs->inodes.getNode(ino);
+	uint32_t id = n->Id();
+	n->Allocate(offset, length);
+	if (n->Id() != id)
+		fs->inodes.replace(ino, *n);
+	fuse_reply_err(req, 0);
+
+	LOWLEVEL_BLOCK_END
+}
+#endif
+
+extern "C" void jmtpfs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info*)
+{
+	LOWLEVEL_BLOCK_START(MtpStats::FuseReaddir)
+
+	std::vector<MtpDirectoryEntry> entries;
+	entries.resize(2);
+	entries[0].name = ".";
+	entries[1].name = "..";
+	for(int i = 0; i < 2; i++)
+	{
+		memset(&entries[i].info, 0, sizeof(entries[i].info));
+		entries[i].info.st_ino = ino;
+		entries[i].info.st_mode = S_IFDIR;
+	}
+	std::vector<MtpDirectoryEntry> contents = fs->inodes.getNode(ino)->readDirectoryEntries();
+	entries.insert(entries.end(), contents.begin(), contents.end());
+
+	// The offset given to the kernel for each entry is the index of the one after it
+	std::vector<char> buf(size);
+	size_t used = 0;
+	for(size_t i = offset; i < entries.size(); i++)
+	{
+		size_t entrySize = fuse_add_direntry(req, &buf[0] + used, size - used, entries[i].name.c_str(),
+				&entries[i].info, i + 1);
+		if (entrySize > size - used)
+			break;
+		used += entrySize;
+	}
+	fuse_reply_buf(req, &buf[0], used);
+
+	LOWLEVEL_BLOCK_END
+}
+
+extern "C" void jmtpfs_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
+{
+	LOWLEVEL_BLOCK_START(MtpStats::FuseOpen)
+
+	std::unique_ptr<MtpNode> n = fs->inodes.getNode(ino);
+	n->Open((fi->flags & O_ACCMODE) != O_RDONLY);
+	setOpenedNode(fi, std::move(n));
+	if (fuse_reply_open(req, fi) == -ENOENT)
+		abandonOpenedNode(fs, ino, fi);
+
+	LOWLEVEL_BLOCK_END
+}
+
+extern "C" void jmtpfs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info* fi)
+{
+	LOWLEVEL_BLOCK_START(MtpStats::FuseRead)
+
+	MtpNode& n = openedNode(fi);
+#if FUSE_VERSION >= 29
+	std::shared_ptr<MtpLocalFileCopy> localFile = n.OpenedCopy(false);
+	if (localFile)
+	{
+		// Replied to straight from the local copy, which FUSE can splice
+		bool replied = false;
+		size_t count = localFile->readWith(size, offset, [&](int fd, size_t length) -> size_t
+		{
+			struct fuse_bufvec bufv = FUSE_BUFVEC_INIT(length);
+			bufv.buf[0].flags = (enum fuse_buf_flags) (FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+			bufv.buf[0].fd = fd;
+			bufv.buf[0].pos = offset;
+			fuse_reply_data(req, &bufv, FUSE_BUF_SPLICE_MOVE);
+			replied = true;
+			return length;
+		});
+		MtpStats::Add(MtpStats::FuseBytesRead, count);
+		if (!replied)
+			fuse_reply_buf(req, 0, 0);
+		return;
+	}
+#endif
+	std::vector<char> buf(size);
+	int count = n.Read(&buf[0], size, offset);
+	MtpStats::Add(MtpStats::FuseBytesRead, count);
+	fuse_reply_buf(req, &buf[0], count);
+
+	LOWLEVEL_BLOCK_END
+}
+
+extern "C" void jmtpfs_ll_write(fuse_req_t req, fuse_ino_t ino, const char* data, size_t size, off_t offset,
+		struct fuse_file_info* fi)
+{
+	LOWLEVEL_BLOCK_START(MtpStats::FuseWrite)
+
+	int count = openedNode(fi).Write(data, size, offset);
+	MtpStats::Add(MtpStats::FuseBytesWritten, count);
+	fuse_reply_write(req, count);
+
+	LOWLEVEL_BLOCK_END
+}
+
+#if FUSE_VERSION >= 29
+// Splices what was written straight into the local copy when there is one
+extern "C" void jmtpfs_ll_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec* buf, off_t offset,
+		struct fuse_file_info* fi)
+{
+	LOWLEVEL_BLOCK_START(MtpStats::FuseWrite)
+
+	MtpNode& n = openedNode(fi);
+	size_t size = fuse_buf_size(buf);
+	std::shared_ptr<MtpLocalFileCopy> localFile = n.OpenedCopy(true);
+	size_t count;
+	if (localFile)
+	{
+		count = localFile->writeWith(size, offset, [&](int fd, size_t length) -> size_t
+		{
+			struct fuse_bufvec destination = FUSE_BUFVEC_INIT(length);
+			destination.buf[0].flags = (enum fuse_buf_flags) (FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+			destination.buf[0].fd = fd;
+			destination.buf[0].pos = offset;
+			ssize_t copied = fuse_buf_copy(&destination, buf, FUSE_BUF_SPLICE_NONBLOCK);
+			if (copied < 0)
+				throw WriteError(-copied);
+			return copied;
+		});
+	}
+	else
+	{
+		std::vector<char> data(size);
+		struct fuse_bufvec destination = FUSE_BUFVEC_INIT(size);
+		destination.buf[0].mem = data.data();
+		ssize_t copied = fuse_buf_copy(&destination, buf, (enum fuse_buf_copy_flags) 0);
+		if (copied < 0)
+			throw WriteError(-copied);
+		count = n.Write(data.data(), copied, offset);
+	}
+	MtpStats::Add(MtpStats::FuseBytesWritten, count);
+	fuse_reply_write(req, count);
+
+	LOWLEVEL_BLOCK_END
+}
+#endif
+
+extern "C" void jmtpfs_ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
+{
+	LOWLEVEL_BLOCK_START(MtpStats::FuseFlush)
+
+	closeNode(fs, ino, openedNode(fi), false);
+	fuse_reply_err(req, 0);
+
+	LOWLEVEL_BLOCK_END
+}
+
+extern "C" void jmtpfs_ll_fsync(fuse_req_t req, fuse_ino_t ino, int, struct fuse_file_info* fi)
+{
+	LOWLEVEL_BLOCK_START(MtpStats::FuseFsync)
+
+	MtpNode& n = openedNode(fi);
+	uint32_t id = n.Id();
+	n.Fsync();
+	if (n.Id() != id)
+		fs->inodes.replace(ino, n);
+	fuse_reply_err(req, 0);
+
+	LOWLEVEL_BLOCK_END
+}
+
+extern "C" void jmtpfs_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
+{
+	LOWLEVEL_BLOCK_START(MtpStats::FuseRelease)
+
+	std::unique_ptr<MtpNode> n(&openedNode(fi));
+	closeNode(fs, ino, *n, true);
+	fuse_reply_err(req, 0);
+
+	LOWLEVEL_BLOCK_END
+}
+
+extern "C" void jmtpfs_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char* name, mode_t)
+{
+	LOWLEVEL_MODIFY_BLOCK_START(MtpStats::FuseMkdir)
+
+	std::unique_ptr<MtpNode> p = fs->inodes.getNode(parent);
+	p->mkdir(name);
+	std::unique_ptr<MtpNode> n = p->getNode(FilesystemPath(name));
+	struct fuse_entry_param entry;
+	fillEntry(fs, *n, entry);
+	fuse_reply_entry(req, &entry);
+
+	LOWLEVEL_BLOCK_END
+}
+
+static void removeEntry(fuse_req_t req, fuse_ino_t parent, const char* name, MtpStats::FuseOp op)
+{
+	LOWLEVEL_MODIFY_BLOCK_START(op)
+
+	fs->inodes.getNode(parent)->getNode(FilesystemPath(name))->Remove();
+	fuse_reply_err(req, 0);
+
+	LOWLEVEL_BLOCK_END
+}
+
+extern "C" void jmtpfs_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char* name)
+{
+	removeEntry(req, parent, name, MtpStats::FuseUnlink);
+}
+
+extern "C" void jmtpfs_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char* name)
+{
+	removeEntry(req, parent, name, MtpStats::FuseRmdir);
+}
+
+extern "C" void jmtpfs_ll_create(fuse_req_t req, fuse_ino_t parent, const char* name, mode_t,
+		struct fuse_file_info* fi)
+{
+	LOWLEVEL_MODIFY_BLOCK_START(MtpStats::FuseCreate)
+
+	std::unique_ptr<MtpNode> p = fs->inodes.getNode(parent);
+	p->CreateFile(name);
+	std::unique_ptr<MtpNode> n = p->getNode(FilesystemPath(name));
+	n->Open(true);
+	struct fuse_entry_param entry;
+	fillEntry(fs, *n, entry);
+	setOpenedNode(fi, std::move(n));
+	if (fuse_reply_create(req, &entry, fi) == -ENOENT)
+		abandonOpenedNode(fs, entry.ino, fi);
+
+	LOWLEVEL_BLOCK_END
+}
+
+extern "C" void jmtpfs_ll_rename(fuse_req_t req, fuse_ino_t parent, const char* name,
+		fuse_ino_t newParent, const char* newName)
+{
+	LOWLEVEL_MODIFY_BLOCK_START(MtpStats::FuseRename)
+
+	// The inode number stays what the kernel was given even if the file has
+	// since been sent back under a new id, so it finds the table entry
+	std::unique_ptr<MtpNode> n = fs->inodes.getNode(parent)->getNode(FilesystemPath(name));
+	struct stat info;
+	getAttributes(fs, *n, info);
+	std::unique_ptr<MtpNode> p = fs->inodes.getNode(newParent);
+	n->Rename(*p, newName);
+
+	// Moves are done as a copy and delete, so the kernel's inode for the old
+	// name now has to refer to the new object.
+	std::unique_ptr<MtpNode> moved = p->getNode(FilesystemPath(newName));
+	fs->inodes.replace(info.st_ino, *moved);
+	fuse_reply_err(req, 0);
+
+	LOWLEVEL_BLOCK_END
+}
+
+extern "C" void jmtpfs_ll_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+	LOWLEVEL_BLOCK_START(MtpStats::FuseStatfs)
+
+	struct statvfs stat;
+	memset(&stat, 0, sizeof(stat));
+	fs->inodes.getNode(ino)->statfs(&stat);
+	fuse_reply_statfs(req, &stat);
+
+	LOWLEVEL_BLOCK_END
+}
+
+static struct fuse_lowlevel_ops jmtpfs_ll_oper;
+
+int jmtpfs_lowlevel_main(struct fuse_args* args, MtpFuseContext* context, time_t metadataTtl)
+{
+	jmtpfs_ll_oper.lookup = jmtpfs_ll_lookup;
+	jmtpfs_ll_oper.forget = jmtpfs_ll_forget;
+	jmtpfs_ll_oper.getattr = jmtpfs_ll_getattr;
+	jmtpfs_ll_oper.setattr = jmtpfs_ll_setattr;
+#if FUSE_VERSION >= 29
+	jmtpfs_ll_oper.fallocate = jmtpfs_ll_fallocate;
+	jmtpfs_ll_oper.write_buf = jmtpfs_ll_write_buf;
+#endif
+	jmtpfs_ll_oper.readdir = jmtpfs_ll_readdir;
+	jmtpfs_ll_oper.open = jmtpfs_ll_open;
+	jmtpfs_ll_oper.read = jmtpfs_ll_read;
+	jmtpfs_ll_oper.write = jmtpfs_ll_write;
+	jmtpfs_ll_oper.flush = jmtpfs_ll_flush;
+	jmtpfs_ll_oper.fsync = jmtpfs_ll_fsync;
+	jmtpfs_ll_oper.release = jmtpfs_ll_release;
+	jmtpfs_ll_oper.mkdir = jmtpfs_ll_mkdir;
+	jmtpfs_ll_oper.unlink = jmtpfs_ll_unlink;
+	jmtpfs_ll_oper.rmdir = jmtpfs_ll_rmdir;
+	jmtpfs_ll_oper.create = jmtpfs_ll_create;
+	jmtpfs_ll_oper.rename = jmtpfs_ll_rename;
+	jmtpfs_ll_oper.statfs = jmtpfs_ll_statfs;
+
+	// The kernel can cache entries and attributes as long as we cache the metadata
+	double timeout = metadataTtl;
+	if (metadataTtl == MtpCacheSettings::NeverExpire)
+		timeout = 365.0 * 24 * 60 * 60;
+	jmtpfs_lowlevel fs(context, timeout);
+
+	char* mountpoint;
+	int multithreaded;
+	int foreground;
+	if (fuse_parse_cmdline(args, &mountpoint, &multithreaded, &foreground) == -1)
+		return 1;
+	if (!mountpoint)
+	{
+		std::cerr << "No mount point given" << std::endl;
+		return 1;
+	}
+
+	int result = 1;
+	struct fuse_chan* channel = fuse_mount(mountpoint, args);
+	if (channel)
+	{
+		struct fuse_session* session = fuse_lowlevel_new(args, &jmtpfs_ll_oper, sizeof(jmtpfs_ll_oper), &fs);
+		if (session)
+		{
+			if (fuse_set_signal_handlers(session) != -1)
+			{
+				fuse_session_add_chan(session, channel);
+				fuse_daemonize(foreground);
+				if (multithreaded)
+					result = fuse_session_loop_mt(session);
+				else
+					result = fuse_session_loop(session);
+				fuse_remove_signal_handlers(session);
+				fuse_session_remove_chan(channel);
+			}
+			fuse_session_destroy(session);
+		}
+		fuse_unmount(mountpoint, channel);
+	}
+	free(mountpoint);
+	return result ? 1 : 0;
+}
@@ -0,0 +1,31 @@
+/*
+ * jmtpfsLowLevel.h
+ *
+ * This software is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 3 as published by the Free Software Foundation.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02111-1301, USA.
+ * licensing@fsf.org
+ */
+
+#ifndef JMTPFSLOWLEVEL_H_
+#define JMTPFSLOWLEVEL_H_
+
+#include "FuseHeader.h"
+#include "MtpFuseContext.h"
+
+// Mounts and runs the filesystem using the inode based low level FUSE
+// interface instead of fuse_main. The kernel is allowed to cache entries
+// and attributes for metadataTtl seconds.
+int jmtpfs_lowlevel_main(struct fuse_args* args, MtpFuseContext* context, time_t metadataTtl);
+
+#endif /* JMTPFSLOWLEVEL_H_ */
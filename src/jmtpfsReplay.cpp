@@ -0,0 +1,422 @@
+/*
+ * jmtpfsReplay.cpp
+ *
+ * This software is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 3 as published by the Free Software Foundation.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02111-1301, USA.
+ * licensing@fsf.org
+ */
+
+/*
+ * Replays a trace recorded with jmtpfs -trace=<file> against a simulated
+ * device, as fast as the simulated device allows, and compares the time
+ * and device commands each kind of operation took with the recording.
+ * Before replaying, the simulated device is filled with the files and
+ * folders the trace shows existed when it was recorded (files get the
+ * size getattr reported, listings are padded to the number of entries
+ * readdir returned).
+ */
+
+#include "MtpFuseContext.h"
+#include "MtpSimulatedDevice.h"
+#include "MtpDeviceQueue.h"
+#include "MtpTrace.h"
+#include "mtpFilesystemErrors.h"
+
+#include <algorithm>
+#include <iostream>
+#include <iomanip>
+#include <map>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <errno.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+static uint64_t Now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t) ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+static bool StartsBefore(const MtpTraceRecord& a, const MtpTraceRecord& b)
+{
+	return a.start < b.start;
+}
+
+static std::string Parent(const std::string& path)
+{
+	return FilesystemPath(path.c_str()).AllButTail().str();
+}
+
+// True if path or one of the folders it is in was created during the trace
+static bool CreatedDuringTrace(const std::set<std::string>& created, std::string path)
+{
+	while(path.size() > 1)
+	{
+		if (created.find(path) != created.end())
+			return true;
+		path = Parent(path);
+	}
+	return false;
+}
+
+struct InitialNode
+{
+	bool		folder;
+	uint64_t	size;
+	uint64_t	listed;		// entries readdir returned, for folders
+};
+
+static void PopulateDevice(MtpSimulatedDevice& device, const std::vector<MtpTraceRecord>& records)
+{
+	std::set<std::string> created;
+	std::map<std::string, InitialNode> initial;
+	for(std::vector<MtpTraceRecord>::const_iterator r = records.begin(); r != records.end(); r++)
+	{
+		if (r->result < 0)
+			continue;
+		if ((r->op == TraceCreate) || (r->op == TraceMkdir))
+			created.insert(r->path);
+		else if (r->op == TraceRename)
+			created.insert(r->newPath);
+		else if ((r->path.size() > 1) && !CreatedDuringTrace(created, r->path))
+		{
+			if ((r->op == TraceGetattr) && (r->nodeType != TraceNodeUnknown) && (initial.find(r->path) == initial.end()))
+			{
+				InitialNode node = { r->nodeType == TraceNodeFolder, r->nodeSize, 0 };
+				initial[r->path] = node;
+			}
+			else if (r->op == TraceReaddir)
+			{
+				InitialNode& node = initial[r->path];
+				node.folder = true;
+				node.listed = std::max(node.listed, r->size);
+			}
+		}
+	}
+
+	std::map<std::string, uint64_t> childCount;
+	for(std::map<std::string, InitialNode>::iterator i = initial.begin(); i != initial.end(); i++)
+		childCount[Parent(i->first)]++;
+
+	for(std::map<std::string, InitialNode>::iterator i = initial.begin(); i != initial.end(); i++)
+	{
+		// /<storage>/<path in storage>
+		size_t p = i->first.find('/', 1);
+		uint32_t storageId = device.AddStorage(i->first.substr(1, p == std::string::npos ? std::string::npos : p - 1));
+		std::string inStorage = (p == std::string::npos) ? "" : i->first.substr(p + 1);
+		if (!inStorage.empty())
+			device.AddPath(storageId, inStorage, i->second.folder, i->second.size);
+		for(uint64_t n = childCount[i->first]; n < i->second.listed; n++)
+		{
+			std::ostringstream name;
+			name << inStorage << (inStorage.empty() ? "" : "/") << "replay-fill-" << n;
+			device.AddPath(storageId, name.str(), false, 0);
+		}
+	}
+}
+
+// Nodes opened during the replay, by path. The trace doesn't say which open
+// a read, write or release goes with, so the latest one is used.
+typedef std::map<std::string, std::vector<std::unique_ptr<MtpNode> > > opened_nodes_type;
+
+static std::unique_ptr<MtpNode> OpenedNode(MtpFuseContext& context, opened_nodes_type& opened,
+		const FilesystemPath& path, bool take)
+{
+	opened_nodes_type::iterator i = opened.find(path.str());
+	if ((i == opened.end()) || i->second.empty())
+		return context.getNode(path);
+	std::unique_ptr<MtpNode> n = take ? std::move(i->second.back()) : i->second.back()->Clone();
+	if (take)
+		i->second.pop_back();
+	return n;
+}
+
+// Does what the callback in jmtpfs.cpp for the operation does
+static int Replay(MtpFuseContext& context, const MtpTraceRecord& r, std::vector<char>& buffer,
+		opened_nodes_type& opened)
+{
+	try
+	{
+		FilesystemPath path(r.path.c_str());
+		switch(r.op)
+		{
+		case TraceGetattr:
+		{
+			struct stat info;
+			context.getNode(path)->getattr(info);
+			return 0;
+		}
+		case TraceReaddir:
+			context.getNode(path)->readDirectoryEntries();
+			return 0;
+		case TraceOpen:
+		{
+			// The open flags aren't recorded
+			std::unique_ptr<MtpNode> n = context.getNode(path);
+			n->Open(true);
+			opened[r.path].push_back(std::move(n));
+			return 0;
+		}
+		case TraceRelease:
+		case TraceFlush:
+		{
+			std::unique_ptr<MtpNode> n = OpenedNode(context, opened, path, r.op == TraceRelease);
+			uint32_t id = n->Id();
+			if (r.op == TraceRelease)
+				n->Close();
+			else
+				n->Flush();
+			if (n->Id() != id)
+				context.forgetPath(path);
+			return 0;
+		}
+		case TraceRead:
+			if (buffer.size() < r.size)
+				buffer.resize(r.size);
+			return OpenedNode(context, opened, path, false)->Read(&buffer[0], r.size, r.offset);
+		case TraceWrite:
+			if (buffer.size() < r.size)
+				buffer.resize(r.size);
+			return OpenedNode(context, opened, path, false)->Write(&buffer[0], r.size, r.offset);
+		case TraceMkdir:
+			context.getNode(path.AllButTail())->mkdir(path.Tail());
+			context.forgetPath(path);
+			return 0;
+		case TraceRmdir:
+			context.getNode(path)->Remove();
+			context.forgetTree(path);
+			return 0;
+		case TraceCreate:
+		{
+			context.getNode(path.AllButTail())->CreateFile(path.Tail());
+			context.forgetPath(path);
+			std::unique_ptr<MtpNode> n = context.getNode(path);
+			n->Open(true);
+			opened[r.path].push_back(std::move(n));
+			return 0;
+		}
+		case TraceTruncate:
+		{
+			std::unique_ptr<MtpNode> n = context.getNode(path);
+			uint32_t id = n->Id();
+			n->Truncate(r.offset);
+			if (n->Id() != id)
+				context.forgetPath(path);
+			return 0;
+		}
+		case TraceFsync:
+		{
+			std::unique_ptr<MtpNode> n = context.getNode(path);
+			uint32_t id = n->Id();
+			n->Fsync();
+			if (n->Id() != id)
+				context.forgetPath(path);
+			return 0;
+		}
+		case TraceFallocate:
+		{
+			std::unique_ptr<MtpNode> n = context.getNode(path);
+			uint32_t id = n->Id();
+			n->Allocate(r.offset, r.size);
+			if (n->Id() != id)
+				context.forgetPath(path);
+			return 0;
+		}
+		case TraceUnlink:
+			context.getNode(path)->Remove();
+			context.forgetPath(path);
+			return 0;
+		case TraceRename:
+		{
+			FilesystemPath newPath(r.newPath.c_str());
+			std::unique_ptr<MtpNode> n = context.getNode(path);
+			std::unique_ptr<MtpNode> newParent = context.getNode(newPath.AllButTail());
+			n->Rename(*newParent, newPath.Tail());
+			context.forgetTree(path);
+			context.forgetTree(newPath);
+			return 0;
+		}
+		case TraceStatfs:
+		{
+			struct statvfs stat;
+			context.getNode(path)->statfs(&stat);
+			return 0;
+		}
+		case TraceChmod:
+		case TraceUtime:
+			context.getNode(path);
+			return 0;
+		default:
+			return -ENOSYS;
+		}
+	}
+	catch(FileNotFound&)
+	{
+		return -ENOENT;
+	}
+	catch(MtpFilesystemErrorWithErrorCode& e)
+	{
+		return -(e.ErrorCode());
+	}
+	catch(std::exception&)
+	{
+		return -EIO;
+	}
+}
+
+struct OpTotals
+{
+	OpTotals() : count(0), recordedNs(0), replayedNs(0), recordedCommands(0), replayedCommands(0), mismatches(0) {}
+
+	uint64_t	count;
+	uint64_t	recordedNs;
+	uint64_t	replayedNs;
+	uint64_t	recordedCommands;
+	uint64_t	replayedCommands;
+	uint64_t	mismatches;
+};
+
+static void PrintTotals(const char* name, const OpTotals& t)
+{
+	std::cout << std::left << std::setw(10) << name << std::right << std::fixed << std::setprecision(1)
+			<< std::setw(10) << t.count
+			<< std::setw(14) << t.recordedNs / 1e6 << std::setw(14) << t.replayedNs / 1e6
+			<< std::setw(12) << t.recordedCommands << std::setw(12) << t.replayedCommands
+			<< std::setw(12) << t.mismatches << std::endl;
+}
+
+static void Usage(const char* name)
+{
+	std::cerr << "usage: " << name << " [options] <trace file>" << std::endl;
+	std::cerr << "    -simulate=<settings>        Simulated device settings, see jmtpfs -h (default latency=0,bandwidth=0)" << std::endl;
+	std::cerr << "    -readcache=<megabytes>      As for jmtpfs" << std::endl;
+	std::cerr << "    -metadatattl=<seconds>      As for jmtpfs, or \"forever\"" << std::endl;
+	std::cerr << "    -adaptivettl                As for jmtpfs" << std::endl;
+	std::cerr << "    -metadatacache=<megabytes>  As for jmtpfs" << std::endl;
+}
+
+int main(int argc, char* argv[])
+{
+	std::string traceFile;
+	std::string simulate = "latency=0,bandwidth=0";
+	MtpCacheSettings cacheSettings;
+	for(int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		if (arg.compare(0, 10, "-simulate=") == 0)
+			simulate += "," + arg.substr(10);
+		else if (arg.compare(0, 11, "-readcache=") == 0)
+			cacheSettings.readCacheBytes = ((size_t) atoi(arg.c_str() + 11)) * 1024 * 1024;
+		else if (arg.compare(0, 15, "-metadatacache=") == 0)
+			cacheSettings.metadataCacheBytes = ((size_t) atoi(arg.c_str() + 15)) * 1024 * 1024;
+		else if (arg == "-metadatattl=forever")
+			cacheSettings.metadataTtl = MtpCacheSettings::NeverExpire;
+		else if (arg.compare(0, 13, "-metadatattl=") == 0)
+			cacheSettings.metadataTtl = atoi(arg.c_str() + 13);
+		else if (arg == "-adaptivettl")
+			cacheSettings.adaptiveTtl = true;
+		else if ((arg[0] != '-') && traceFile.empty())
+			traceFile = arg;
+		else
+		{
+			Usage(argv[0]);
+			return 1;
+		}
+	}
+	if (traceFile.empty())
+	{
+		Usage(argv[0]);
+		return 1;
+	}
+
+	try
+	{
+		MtpSimulatedDeviceSettings settings = MtpSimulatedDeviceSettings::Parse(simulate);
+		settings.folders = 0;
+		settings.storageName = "";
+
+		std::vector<MtpTraceRecord> records;
+		MtpTraceReader reader(traceFile);
+		MtpTraceRecord record;
+		while(reader.read(record))
+			records.push_back(record);
+		std::stable_sort(records.begin(), records.end(), StartsBefore);
+
+		MtpSimulatedDevice* device = new MtpSimulatedDevice(settings);
+		PopulateDevice(*device, records);
+		MtpFuseContext context(std::unique_ptr<MtpDevice>(device), getuid(), getgid(), cacheSettings, "");
+
+		std::vector<OpTotals> totals(TraceOpCount);
+		std::vector<char> buffer;
+		opened_nodes_type opened;
+		uint64_t start = Now();
+		for(std::vector<MtpTraceRecord>::iterator r = records.begin(); r != records.end(); r++)
+		{
+			uint64_t commands = MtpDeviceQueue::ThreadCommands();
+			uint64_t opStart = Now();
+			int result = Replay(context, *r, buffer, opened);
+			OpTotals& t = totals[(r->op > 0) && (r->op < TraceOpCount) ? r->op : 0];
+			t.count++;
+			t.replayedNs += Now() - opStart;
+			t.recordedNs += r->duration;
+			t.replayedCommands += MtpDeviceQueue::ThreadCommands() - commands;
+			t.recordedCommands += r->deviceCommands;
+			if ((result < 0 || r->result < 0) && (result != r->result))
+				t.mismatches++;
+		}
+		uint64_t elapsed = Now() - start;
+
+		std::cout << std::left << std::setw(10) << "op" << std::right << std::setw(10) << "count"
+				<< std::setw(14) << "recorded ms" << std::setw(14) << "replayed ms"
+				<< std::setw(12) << "rec cmds" << std::setw(12) << "rep cmds"
+				<< std::setw(12) << "mismatches" << std::endl;
+		OpTotals all;
+		for(int op = 0; op < TraceOpCount; op++)
+		{
+			OpTotals& t = totals[op];
+			if (t.count == 0)
+				continue;
+			PrintTotals(MtpTraceOpName(op), t);
+			all.count += t.count;
+			all.recordedNs += t.recordedNs;
+			all.replayedNs += t.replayedNs;
+			all.recordedCommands += t.recordedCommands;
+			all.replayedCommands += t.replayedCommands;
+			all.mismatches += t.mismatches;
+		}
+		PrintTotals("total", all);
+		uint64_t recordedEnd = 0;
+		for(std::vector<MtpTraceRecord>::iterator r = records.begin(); r != records.end(); r++)
+			recordedEnd = std::max(recordedEnd, r->start + r->duration);
+		if (!records.empty())
+			std::cout << "recorded wall time " << (recordedEnd - records.front().start) / 1e6
+					<< " ms, replayed " << elapsed / 1e6 << " ms" << std::endl;
+	}
+	catch(std::invalid_argument& e)
+	{
+		std::cerr << "Invalid simulated device settings: " << e.what() << std::endl;
+		return 1;
+	}
+	catch(std::exception& e)
+	{
+		std::cerr << "Unable to replay " << traceFile << ": " << e.what() << std::endl;
+		return 1;
+	}
+
+	return 0;
+}